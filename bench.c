@@ -0,0 +1,1170 @@
+/*
+
+    Allocator benchmarks.
+
+    Compile this file like that (compile.sh does it):
+
+    gcc -Wall -g -O2 -pthread -o bench bench.c -ldl
+
+    Each run executes one workload and prints one line of JSON with
+    its results: operations per second, the median and 99th
+    percentile of the time per operation, and the peak and final
+    resident set size. The same binary runs against glibc's malloc
+    or, with LD_PRELOAD, against memory.so; the "allocator" field
+    tells which one was in use, along with the tunables memory.so
+    got through MEMORY_TUNE, if any. bench.sh runs every workload
+    against both.
+
+    ./bench <workload> [-t threads] [-n operations] [-s size]
+
+    Workloads:
+
+    latency     malloc/free of a single size, size given by -s, in
+                batches of BENCH_BATCH blocks.
+    contention  Like latency, with random small sizes, in -t threads
+                at once.
+    prodcons    -t pairs of threads: the producer allocates, the
+                consumer frees what it receives through a queue.
+                Sizes are random up to 512 bytes, or given by -s.
+    larson      Server churn after Larson and Krishnan: -t threads
+                replace random blocks of a shared working set, and
+                every round is taken over by new threads, which free
+                what the previous ones allocated.
+    realloc     Buffers grown by small random steps up to 1 MiB,
+                through the arena sizes and the dedicated mappings.
+    frag        Allocates mixed sizes, frees three quarters of them
+                in a pattern that pins the rest, then allocates
+                bigger blocks. Reports the live bytes along with the
+                RSS.
+    buffers     Replaces random buffers of a working set of
+                BENCH_BUFFER_SLOTS buffers of 4 KiB to 1 MiB, sizes
+                spread evenly over the powers of two, touching every
+                page of them. Reports the peak RSS per peak live
+                byte, i.e. what fragmentation costs, and in the
+                latencies the time to find a fit.
+    small       Allocates many objects of 8 to 32 bytes, or of the
+                size given by -s, linked in allocation order, then
+                walks the list BENCH_SMALL_WALKS times. Reports the
+                RSS per object and, where perf events are available,
+                the cache misses per object of a walk.
+    chase       Allocates -n nodes of 1 KiB, or of the size given by
+                -s, links them in a random cycle and follows it for
+                BENCH_CHASE_LAPS laps. The nodes live in the arenas,
+                so this shows what huge pages do to a big heap
+                (MEMORY_TUNE=huge_pages=thp): reports the time and,
+                where perf events are available, the dTLB misses per
+                hop.
+    batch       Allocates and frees nodes of 64 bytes, or of the size
+                given by -s, BENCH_BATCH_NODES at a time, in -t
+                threads: once with malloc_batch and free_batch, once
+                with a call of malloc and of free per node. Under an
+                allocator without the batch calls, both runs make a
+                call per node.
+    sized       Allocates -n objects of random sizes up to 256
+                bytes, or of the size given by -s, and frees them in
+                random order, so that the frees touch cold memory:
+                once with free, once with free_sized. Under an
+                allocator without free_sized, both runs use free.
+    decay       Replaces random blocks of a working set of
+                BENCH_DECAY_SLOTS blocks of 4 to 64 KiB, timing every
+                free on its own, then frees seven blocks out of eight
+                and idles for BENCH_DECAY_IDLE_MS. Reports the free
+                latencies, which show inline purging, and the RSS
+                after the idle time against the bytes still live
+                (MEMORY_TUNE=background_thread=yes).
+
+    Latencies are measured per batch of operations, as timing a
+    single malloc costs more than the malloc itself, and reported
+    per operation. The benchmark's own bookkeeping uses mmap, so
+    that it does not disturb the allocator under test.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define BENCH_BATCH 16
+#define BENCH_QUEUE_SIZE 1024
+#define BENCH_LARSON_SLOTS 1024
+#define BENCH_LARSON_ROUNDS 4
+#define BENCH_REALLOC_MAX_SIZE ((size_t) (1024 * 1024))
+#define BENCH_MAX_THREADS 64
+#define BENCH_SMALL_WALKS 8
+#define BENCH_BUFFER_SLOTS 512
+#define BENCH_CHASE_SIZE ((size_t) 1024)
+#define BENCH_CHASE_LAPS 4
+#define BENCH_BATCH_NODES 64
+#define BENCH_DECAY_SLOTS 1024
+#define BENCH_DECAY_IDLE_MS 3000
+
+/* Keeps the compiler from optimizing a malloc/free pair away */
+#define BENCH_USE(ptr) __asm__ volatile("" : : "r"(ptr) : "memory")
+
+typedef struct bench_samples {
+  double *values;
+  size_t count;
+  size_t capacity;
+} bench_samples_t;
+
+typedef struct bench_options {
+  int threads;
+  long operations;
+  size_t size;
+} bench_options_t;
+
+/* This function maps len bytes of zeroed memory for the benchmark's
+   own use, or exits. */
+static void *bench_map(size_t len) {
+  void *memory;
+
+  memory = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  return memory;
+}
+
+static void samples_init(bench_samples_t *samples, size_t capacity) {
+  samples->values = (double *) bench_map((capacity + ((size_t) 1)) * sizeof(double));
+  samples->count = (size_t) 0;
+  samples->capacity = capacity;
+}
+
+static void samples_add(bench_samples_t *samples, double value) {
+  if (samples->count < samples->capacity) {
+    samples->values[samples->count++] = value;
+  }
+}
+
+/* This function appends all values of from to to */
+static void samples_merge(bench_samples_t *to, const bench_samples_t *from) {
+  size_t i;
+
+  for (i=(size_t) 0; i<from->count; i++) {
+    samples_add(to, from->values[i]);
+  }
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double da = *((const double *) a), db = *((const double *) b);
+
+  return (da < db) ? -1 : ((da > db) ? 1 : 0);
+}
+
+/* This function returns the p-th percentile of samples, sorting
+   them first. */
+static double samples_percentile(bench_samples_t *samples, double p) {
+  size_t i;
+
+  if (samples->count == ((size_t) 0)) {
+    return 0.0;
+  }
+  qsort(samples->values, samples->count, sizeof(double), compare_doubles);
+  i = (size_t) (p / 100.0 * ((double) (samples->count - ((size_t) 1))));
+  return samples->values[i];
+}
+
+static double now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((double) ts.tv_sec) * 1e9 + ((double) ts.tv_nsec);
+}
+
+/* A small xorshift generator, so that every run allocates the same
+   sizes in the same order */
+static unsigned long bench_random(unsigned long *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static size_t random_size(unsigned long *state, size_t min, size_t max) {
+  return min + ((size_t) (bench_random(state) % (max - min + ((size_t) 1))));
+}
+
+static long current_rss_kb() {
+  long pages = 0, rss = 0;
+  FILE *fp;
+
+  fp = fopen("/proc/self/statm", "r");
+  if (fp == NULL) {
+    return -1;
+  }
+  if (fscanf(fp, "%ld %ld", &pages, &rss) != 2) {
+    rss = -1;
+  }
+  fclose(fp);
+  return (rss < 0) ? -1 : rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static long peak_rss_kb() {
+  struct rusage usage;
+
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return -1;
+  }
+  return usage.ru_maxrss;
+}
+
+static const char *allocator_name() {
+  static char name[256];
+  const char *env_var;
+
+  if (dlsym(RTLD_DEFAULT, "__malloc_impl") == NULL) {
+    return "glibc";
+  }
+  env_var = getenv("MEMORY_TUNE");
+  if ((env_var == NULL) || (env_var[0] == '\0')) {
+    return "memory.so";
+  }
+  snprintf(name, sizeof(name), "memory.so/%s", env_var);
+  return name;
+}
+
+/* This function prints the results of a workload as one line of
+   JSON. extra is appended to the fields as is. */
+static void report(const char *bench, const bench_options_t *options,
+		   double operations, double seconds,
+		   bench_samples_t *samples, const char *extra) {
+  double p50, p99;
+
+  p50 = samples_percentile(samples, 50.0);
+  p99 = samples_percentile(samples, 99.0);
+  printf("{\"bench\": \"%s\", \"allocator\": \"%s\", \"threads\": %d, \"size\": %zu, "
+	 "\"ops\": %.0f, \"seconds\": %.6f, \"ops_per_sec\": %.0f, "
+	 "\"p50_ns\": %.1f, \"p99_ns\": %.1f, \"peak_rss_kb\": %ld, \"rss_kb\": %ld%s}\n",
+	 bench, allocator_name(), options->threads, options->size,
+	 operations, seconds, (seconds > 0.0) ? operations / seconds : 0.0,
+	 p50, p99, peak_rss_kb(), current_rss_kb(), extra);
+  fflush(stdout);
+}
+
+/* One thread of a workload, with its own samples and random state */
+typedef struct bench_thread {
+  pthread_t thread;
+  pthread_barrier_t *barrier;
+  void *(*work)(struct bench_thread *);
+  bench_samples_t samples;
+  unsigned long random_state;
+  long operations;
+  size_t size;
+  void *shared;
+  int index;
+} bench_thread_t;
+
+static void *bench_thread_main(void *arg) {
+  bench_thread_t *t = (bench_thread_t *) arg;
+
+  pthread_barrier_wait(t->barrier);
+  return t->work(t);
+}
+
+/* This function runs work in count threads, released at the same
+   time.
+   - Returns the wall time from the release to the last join, in s */
+static double run_threads(bench_thread_t *threads, int count,
+			  void *(*work)(bench_thread_t *)) {
+  pthread_barrier_t barrier;
+  double start;
+  int i;
+
+  pthread_barrier_init(&barrier, NULL, (unsigned int) (count + 1));
+  for (i=0; i<count; i++) {
+    threads[i].barrier = &barrier;
+    threads[i].work = work;
+    if (pthread_create(&threads[i].thread, NULL, bench_thread_main, &threads[i]) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+  /* The threads may run to completion as soon as the barrier
+     opens, before this thread runs again */
+  start = now_ns();
+  pthread_barrier_wait(&barrier);
+  for (i=0; i<count; i++) {
+    pthread_join(threads[i].thread, NULL);
+  }
+  pthread_barrier_destroy(&barrier);
+  return (now_ns() - start) / 1e9;
+}
+
+static bench_thread_t *make_threads(const bench_options_t *options, size_t samples_per_thread) {
+  bench_thread_t *threads;
+  int i;
+
+  threads = (bench_thread_t *) bench_map(((size_t) options->threads) * sizeof(bench_thread_t));
+  for (i=0; i<options->threads; i++) {
+    samples_init(&threads[i].samples, samples_per_thread);
+    threads[i].random_state = 88172645463325252ul + (unsigned long) i * 2654435761ul;
+    threads[i].operations = options->operations;
+    threads[i].size = options->size;
+    threads[i].index = i;
+  }
+  return threads;
+}
+
+static void merge_thread_samples(bench_samples_t *all, bench_thread_t *threads, int count) {
+  size_t total = (size_t) 0;
+  int i;
+
+  for (i=0; i<count; i++) {
+    total += threads[i].samples.count;
+  }
+  samples_init(all, total);
+  for (i=0; i<count; i++) {
+    samples_merge(all, &threads[i].samples);
+  }
+}
+
+/* latency and contention: batches of mallocs, then frees, of the
+   thread's size or, without one, random sizes up to 256 bytes */
+static void *malloc_free_work(bench_thread_t *t) {
+  void *ptrs[BENCH_BATCH];
+  double start;
+  long i;
+  int j;
+
+  for (i=0l; i<t->operations; i+=BENCH_BATCH) {
+    start = now_ns();
+    for (j=0; j<BENCH_BATCH; j++) {
+      ptrs[j] = malloc((t->size != ((size_t) 0)) ? t->size : random_size(&t->random_state, 16, 256));
+      *((char *) ptrs[j]) = (char) j;
+      BENCH_USE(ptrs[j]);
+    }
+    for (j=0; j<BENCH_BATCH; j++) {
+      free(ptrs[j]);
+    }
+    samples_add(&t->samples, (now_ns() - start) / (2.0 * BENCH_BATCH));
+  }
+  return NULL;
+}
+
+static void bench_malloc_free(const char *name, bench_options_t *options) {
+  bench_thread_t *threads;
+  bench_samples_t all;
+  double seconds;
+
+  threads = make_threads(options, (size_t) (options->operations / BENCH_BATCH + 1));
+  seconds = run_threads(threads, options->threads, malloc_free_work);
+  merge_thread_samples(&all, threads, options->threads);
+  report(name, options, 2.0 * ((double) options->operations) * options->threads,
+	 seconds, &all, "");
+}
+
+/* prodcons: single producer, single consumer queue of pointers */
+typedef struct bench_queue {
+  void *slots[BENCH_QUEUE_SIZE];
+  unsigned long head;
+  unsigned long tail;
+} bench_queue_t;
+
+static void *producer_work(bench_thread_t *t) {
+  bench_queue_t *queue = (bench_queue_t *) t->shared;
+  unsigned long head = 0ul;
+  double start = 0.0;
+  long i;
+  void *ptr;
+
+  for (i=0l; i<t->operations; i++) {
+    if ((i % BENCH_BATCH) == 0l) {
+      start = now_ns();
+    }
+    ptr = malloc((t->size != ((size_t) 0)) ? t->size : random_size(&t->random_state, 16, 512));
+    *((char *) ptr) = (char) i;
+    while (head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == BENCH_QUEUE_SIZE) {
+      sched_yield();
+    }
+    queue->slots[head % BENCH_QUEUE_SIZE] = ptr;
+    head++;
+    __atomic_store_n(&queue->head, head, __ATOMIC_RELEASE);
+    if ((i % BENCH_BATCH) == BENCH_BATCH - 1) {
+      samples_add(&t->samples, (now_ns() - start) / BENCH_BATCH);
+    }
+  }
+  return NULL;
+}
+
+static void *consumer_work(bench_thread_t *t) {
+  bench_queue_t *queue = (bench_queue_t *) t->shared;
+  unsigned long tail = 0ul;
+  long i;
+
+  for (i=0l; i<t->operations; i++) {
+    while (__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == tail) {
+      sched_yield();
+    }
+    free(queue->slots[tail % BENCH_QUEUE_SIZE]);
+    tail++;
+    __atomic_store_n(&queue->tail, tail, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+static void *prodcons_work(bench_thread_t *t) {
+  return ((t->index % 2) == 0) ? producer_work(t) : consumer_work(t);
+}
+
+static void bench_prodcons(bench_options_t *options) {
+  bench_options_t all_options = *options;
+  bench_thread_t *threads;
+  bench_queue_t *queues;
+  bench_samples_t all;
+  double seconds;
+  int i;
+
+  all_options.threads = 2 * options->threads;
+  threads = make_threads(&all_options, (size_t) (options->operations / BENCH_BATCH + 1));
+  queues = (bench_queue_t *) bench_map(((size_t) options->threads) * sizeof(bench_queue_t));
+  for (i=0; i<all_options.threads; i++) {
+    threads[i].shared = &queues[i / 2];
+  }
+  seconds = run_threads(threads, all_options.threads, prodcons_work);
+  merge_thread_samples(&all, threads, all_options.threads);
+  report("prodcons", options, 2.0 * ((double) options->operations) * options->threads,
+	 seconds, &all, "");
+}
+
+/* larson: random replacement in a working set handed over from one
+   generation of threads to the next */
+static void *larson_work(bench_thread_t *t) {
+  void **slots = (void **) t->shared;
+  double start = 0.0;
+  size_t slot;
+  long i;
+
+  for (i=0l; i<t->operations; i++) {
+    if ((i % BENCH_BATCH) == 0l) {
+      start = now_ns();
+    }
+    slot = (size_t) (bench_random(&t->random_state) % BENCH_LARSON_SLOTS);
+    free(slots[slot]);
+    slots[slot] = malloc(random_size(&t->random_state, 16, 512));
+    *((char *) slots[slot]) = (char) i;
+    if ((i % BENCH_BATCH) == BENCH_BATCH - 1) {
+      samples_add(&t->samples, (now_ns() - start) / (2.0 * BENCH_BATCH));
+    }
+  }
+  return NULL;
+}
+
+static void bench_larson(bench_options_t *options) {
+  bench_options_t round_options = *options;
+  bench_thread_t *threads;
+  bench_samples_t all, round_samples;
+  void **slots;
+  double seconds = 0.0;
+  int round, i;
+  size_t j;
+
+  round_options.operations = options->operations / BENCH_LARSON_ROUNDS;
+  slots = (void **) bench_map(((size_t) options->threads) * BENCH_LARSON_SLOTS * sizeof(void *));
+  samples_init(&all, ((size_t) options->threads) * (size_t) (options->operations / BENCH_BATCH + 1));
+  for (round=0; round<BENCH_LARSON_ROUNDS; round++) {
+    threads = make_threads(&round_options, (size_t) (round_options.operations / BENCH_BATCH + 1));
+    for (i=0; i<options->threads; i++) {
+      /* Every generation works on the slots of another thread of
+	 the previous one */
+      threads[i].shared = &slots[((size_t) ((i + round) % options->threads)) * BENCH_LARSON_SLOTS];
+      threads[i].random_state += (unsigned long) round * 7919ul;
+    }
+    seconds += run_threads(threads, options->threads, larson_work);
+    merge_thread_samples(&round_samples, threads, options->threads);
+    samples_merge(&all, &round_samples);
+  }
+  for (j=(size_t) 0; j<((size_t) options->threads) * BENCH_LARSON_SLOTS; j++) {
+    free(slots[j]);
+  }
+  report("larson", options,
+	 2.0 * ((double) round_options.operations) * BENCH_LARSON_ROUNDS * options->threads,
+	 seconds, &all, "");
+}
+
+/* realloc: buffers grown by random steps of up to 4 KiB */
+static void *realloc_work(bench_thread_t *t) {
+  char *buffer = NULL, *new_buffer;
+  size_t size = (size_t) 0;
+  double start;
+  long i;
+
+  for (i=0l; i<t->operations; i++) {
+    if (size >= BENCH_REALLOC_MAX_SIZE) {
+      free(buffer);
+      buffer = NULL;
+      size = (size_t) 0;
+    }
+    size += random_size(&t->random_state, 1, 4096);
+    start = now_ns();
+    new_buffer = (char *) realloc(buffer, size);
+    samples_add(&t->samples, now_ns() - start);
+    if (new_buffer == NULL) {
+      fprintf(stderr, "realloc failed\n");
+      exit(1);
+    }
+    buffer = new_buffer;
+    buffer[size - ((size_t) 1)] = (char) i;
+  }
+  free(buffer);
+  return NULL;
+}
+
+static void bench_realloc(bench_options_t *options) {
+  bench_thread_t *threads;
+  bench_samples_t all;
+  double seconds;
+
+  threads = make_threads(options, (size_t) options->operations);
+  seconds = run_threads(threads, options->threads, realloc_work);
+  merge_thread_samples(&all, threads, options->threads);
+  report("realloc", options, ((double) options->operations) * options->threads,
+	 seconds, &all, "");
+}
+
+/* frag: every thread allocates operations blocks of 16 B to 2 KiB,
+   frees all but every fourth one, then allocates half as many
+   blocks of 2 KiB to 8 KiB, most of which do not fit in the holes */
+typedef struct frag_state {
+  void **ptrs;
+  size_t *sizes;
+  size_t live_bytes;
+} frag_state_t;
+
+static void frag_allocate(bench_thread_t *t, frag_state_t *state, long i,
+			  size_t min, size_t max) {
+  state->sizes[i] = random_size(&t->random_state, min, max);
+  state->ptrs[i] = malloc(state->sizes[i]);
+  memset(state->ptrs[i], (int) i, state->sizes[i]);
+}
+
+static void *frag_work(bench_thread_t *t) {
+  frag_state_t *state = (frag_state_t *) t->shared;
+  long count = t->operations + t->operations / 2l;
+  double start = 0.0;
+  long i;
+
+  for (i=0l; i<count; i++) {
+    if ((i % BENCH_BATCH) == 0l) {
+      start = now_ns();
+    }
+    if (i < t->operations) {
+      frag_allocate(t, state, i, 16, 2048);
+    } else {
+      frag_allocate(t, state, i, 2048, 8192);
+    }
+    if ((i % BENCH_BATCH) == BENCH_BATCH - 1) {
+      samples_add(&t->samples, (now_ns() - start) / BENCH_BATCH);
+    }
+    if (i == t->operations - 1l) {
+      for (i=0l; i<t->operations; i++) {
+	if ((i % 4l) != 0l) {
+	  free(state->ptrs[i]);
+	  state->ptrs[i] = NULL;
+	}
+      }
+      i = t->operations - 1l;
+    }
+  }
+  for (i=0l; i<count; i++) {
+    if (state->ptrs[i] != NULL) {
+      state->live_bytes += state->sizes[i];
+    }
+  }
+  return NULL;
+}
+
+static void bench_frag(bench_options_t *options) {
+  bench_thread_t *threads;
+  frag_state_t *states;
+  bench_samples_t all;
+  size_t count = (size_t) (options->operations + options->operations / 2l);
+  size_t live_bytes = (size_t) 0;
+  long rss_kb;
+  char extra[128];
+  double seconds;
+  int i;
+  size_t j;
+
+  threads = make_threads(options, count / BENCH_BATCH + ((size_t) 1));
+  states = (frag_state_t *) bench_map(((size_t) options->threads) * sizeof(frag_state_t));
+  for (i=0; i<options->threads; i++) {
+    states[i].ptrs = (void **) bench_map(count * sizeof(void *));
+    states[i].sizes = (size_t *) bench_map(count * sizeof(size_t));
+    threads[i].shared = &states[i];
+  }
+  seconds = run_threads(threads, options->threads, frag_work);
+  merge_thread_samples(&all, threads, options->threads);
+  for (i=0; i<options->threads; i++) {
+    live_bytes += states[i].live_bytes;
+  }
+  /* The RSS per live byte, measured while the blocks are live */
+  rss_kb = current_rss_kb();
+  snprintf(extra, sizeof(extra), ", \"live_bytes\": %zu, \"rss_per_live_byte\": %.3f",
+	   live_bytes, (live_bytes > ((size_t) 0)) ? ((double) rss_kb) * 1024.0 / ((double) live_bytes) : 0.0);
+  report("frag", options, ((double) count) * options->threads, seconds, &all, extra);
+  for (i=0; i<options->threads; i++) {
+    for (j=(size_t) 0; j<count; j++) {
+      free(states[i].ptrs[j]);
+    }
+  }
+}
+
+/* buffers: every operation frees the buffer in a random slot and
+   allocates a new one of a random size in its place */
+typedef struct buffers_state {
+  void *ptrs[BENCH_BUFFER_SLOTS];
+  size_t sizes[BENCH_BUFFER_SLOTS];
+  size_t live_bytes;
+  size_t peak_live_bytes;
+} buffers_state_t;
+
+static void *buffers_work(bench_thread_t *t) {
+  buffers_state_t *state = (buffers_state_t *) t->shared;
+  double start = 0.0;
+  size_t slot, size, offset;
+  long i;
+
+  for (i=0l; i<t->operations; i++) {
+    slot = (size_t) (bench_random(&t->random_state) % BENCH_BUFFER_SLOTS);
+    size = ((size_t) 4096) << (bench_random(&t->random_state) % 8ul);
+    size = random_size(&t->random_state, size, size * ((size_t) 2));
+    if ((i % BENCH_BATCH) == 0l) {
+      start = now_ns();
+    }
+    free(state->ptrs[slot]);
+    state->ptrs[slot] = malloc(size);
+    if ((i % BENCH_BATCH) == BENCH_BATCH - 1) {
+      samples_add(&t->samples, (now_ns() - start) / BENCH_BATCH);
+    }
+    for (offset=(size_t) 0; offset<size; offset+=(size_t) 4096) {
+      ((char *) state->ptrs[slot])[offset] = (char) i;
+    }
+    state->live_bytes += size - state->sizes[slot];
+    state->sizes[slot] = size;
+    if (state->live_bytes > state->peak_live_bytes) {
+      state->peak_live_bytes = state->live_bytes;
+    }
+  }
+  return NULL;
+}
+
+static void bench_buffers(bench_options_t *options) {
+  bench_thread_t *threads;
+  buffers_state_t *states;
+  bench_samples_t all;
+  size_t peak_live_bytes = (size_t) 0;
+  char extra[128];
+  double seconds;
+  int i;
+  size_t j;
+
+  threads = make_threads(options, (size_t) (options->operations / BENCH_BATCH + 1));
+  states = (buffers_state_t *) bench_map(((size_t) options->threads) * sizeof(buffers_state_t));
+  for (i=0; i<options->threads; i++) {
+    threads[i].shared = &states[i];
+  }
+  seconds = run_threads(threads, options->threads, buffers_work);
+  merge_thread_samples(&all, threads, options->threads);
+  for (i=0; i<options->threads; i++) {
+    peak_live_bytes += states[i].peak_live_bytes;
+  }
+  snprintf(extra, sizeof(extra), ", \"peak_live_bytes\": %zu, \"peak_rss_per_live_byte\": %.3f",
+	   peak_live_bytes, ((double) peak_rss_kb()) * 1024.0 / ((double) peak_live_bytes));
+  report("buffers", options, ((double) options->operations) * options->threads, seconds, &all, extra);
+  for (i=0; i<options->threads; i++) {
+    for (j=(size_t) 0; j<BENCH_BUFFER_SLOTS; j++) {
+      free(states[i].ptrs[j]);
+    }
+  }
+}
+
+/* This function opens a counter of the perf event of the given type
+   and config for the calling thread, disabled for now.
+   - Returns its file descriptor, or -1 if perf events are not
+     available */
+static int open_event_counter(unsigned int type, unsigned long long config) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0ul);
+}
+
+static void start_event_counter(int fd) {
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+/* This function stops and closes the counter fd.
+   - Returns its value, or -1 if it is not available */
+static long long stop_event_counter(int fd) {
+  long long value = -1ll;
+
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &value, sizeof(value)) != (ssize_t) sizeof(value)) {
+      value = -1ll;
+    }
+    close(fd);
+  }
+  return value;
+}
+
+/* small: the objects form a list through their first word, in the
+   order in which they were allocated, so that a walk touches them
+   the way a program touches the nodes it has just built */
+static void *small_work(bench_thread_t *t) {
+  void **head = NULL, **tail = NULL, **object;
+  double start = 0.0;
+  long i;
+
+  for (i=0l; i<t->operations; i++) {
+    if ((i % BENCH_BATCH) == 0l) {
+      start = now_ns();
+    }
+    object = (void **) malloc((t->size != ((size_t) 0)) ? t->size : random_size(&t->random_state, 8, 32));
+    *object = NULL;
+    if (tail == NULL) {
+      head = object;
+    } else {
+      *tail = (void *) object;
+    }
+    tail = object;
+    if ((i % BENCH_BATCH) == BENCH_BATCH - 1) {
+      samples_add(&t->samples, (now_ns() - start) / BENCH_BATCH);
+    }
+  }
+  t->shared = (void *) head;
+  return NULL;
+}
+
+static void bench_small(bench_options_t *options) {
+  bench_thread_t *threads;
+  bench_samples_t all;
+  void **object, **next;
+  long rss_before_kb, rss_kb, i;
+  long long misses;
+  double seconds, walk_ns;
+  char extra[256];
+  int fd;
+
+  options->threads = 1;
+  threads = make_threads(options, (size_t) (options->operations / BENCH_BATCH + 1));
+  rss_before_kb = current_rss_kb();
+  seconds = run_threads(threads, 1, small_work);
+  rss_kb = current_rss_kb();
+  merge_thread_samples(&all, threads, 1);
+
+  /* Walks are timed, and their cache misses counted, as a whole */
+  fd = open_event_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  start_event_counter(fd);
+  walk_ns = now_ns();
+  for (i=0l; i<BENCH_SMALL_WALKS; i++) {
+    for (object = (void **) threads[0].shared; object != NULL; object = (void **) *object) {
+      BENCH_USE(object);
+    }
+  }
+  walk_ns = now_ns() - walk_ns;
+  misses = stop_event_counter(fd);
+
+  snprintf(extra, sizeof(extra), ", \"bytes_per_object\": %.2f, \"walk_ns_per_object\": %.2f, "
+	   "\"cache_misses_per_object\": %.3f",
+	   ((double) (rss_kb - rss_before_kb)) * 1024.0 / ((double) options->operations),
+	   walk_ns / ((double) options->operations * BENCH_SMALL_WALKS),
+	   (misses < 0ll) ? -1.0 : ((double) misses) / ((double) options->operations * BENCH_SMALL_WALKS));
+  report("small", options, (double) options->operations, seconds, &all, extra);
+  for (object = (void **) threads[0].shared; object != NULL; object = next) {
+    next = (void **) *object;
+    free(object);
+  }
+}
+
+/* chase: the nodes are allocated in order, then linked through their
+   first word in a random cycle, so that every hop lands on another
+   page */
+static void *chase_work(bench_thread_t *t) {
+  void **nodes = (void **) t->shared;
+  double start = 0.0;
+  long i;
+
+  for (i=0l; i<t->operations; i++) {
+    if ((i % BENCH_BATCH) == 0l) {
+      start = now_ns();
+    }
+    nodes[i] = malloc((t->size != ((size_t) 0)) ? t->size : BENCH_CHASE_SIZE);
+    if ((i % BENCH_BATCH) == BENCH_BATCH - 1) {
+      samples_add(&t->samples, (now_ns() - start) / BENCH_BATCH);
+    }
+  }
+  return NULL;
+}
+
+static void bench_chase(bench_options_t *options) {
+  bench_thread_t *threads;
+  bench_samples_t all;
+  void **nodes, **node, *swap;
+  unsigned long random_state = 42ul;
+  long i, j, hops;
+  long long misses;
+  double seconds, chase_ns;
+  char extra[256];
+  int fd;
+
+  options->threads = 1;
+  threads = make_threads(options, (size_t) (options->operations / BENCH_BATCH + 1));
+  nodes = (void **) bench_map(((size_t) options->operations) * sizeof(void *));
+  threads[0].shared = (void *) nodes;
+  seconds = run_threads(threads, 1, chase_work);
+  merge_thread_samples(&all, threads, 1);
+
+  /* Sattolo's shuffle makes a single cycle through all nodes */
+  for (i=options->operations - 1l; i>0l; i--) {
+    j = (long) (bench_random(&random_state) % ((unsigned long) i));
+    swap = nodes[i];
+    nodes[i] = nodes[j];
+    nodes[j] = swap;
+  }
+  for (i=0l; i<options->operations; i++) {
+    *((void **) nodes[i]) = nodes[(i + 1l) % options->operations];
+  }
+
+  hops = options->operations * BENCH_CHASE_LAPS;
+  fd = open_event_counter(PERF_TYPE_HW_CACHE,
+			  PERF_COUNT_HW_CACHE_DTLB |
+			  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+  start_event_counter(fd);
+  chase_ns = now_ns();
+  node = (void **) nodes[0];
+  for (i=0l; i<hops; i++) {
+    node = (void **) *node;
+  }
+  BENCH_USE(node);
+  chase_ns = now_ns() - chase_ns;
+  misses = stop_event_counter(fd);
+
+  snprintf(extra, sizeof(extra), ", \"ns_per_hop\": %.2f, \"dtlb_misses_per_hop\": %.3f",
+	   chase_ns / ((double) hops),
+	   (misses < 0ll) ? -1.0 : ((double) misses) / ((double) hops));
+  report("chase", options, (double) options->operations, seconds, &all, extra);
+  for (i=0l; i<options->operations; i++) {
+    free(nodes[i]);
+  }
+}
+
+/* batch: malloc_batch and free_batch are looked up at run time, as
+   glibc has neither; without them, these stand in */
+static size_t (*bench_malloc_batch)(size_t, size_t, void **);
+static void (*bench_free_batch)(void **, size_t);
+
+static size_t malloc_each(size_t size, size_t n, void **out) {
+  size_t i;
+
+  for (i=(size_t) 0; i<n; i++) {
+    out[i] = malloc(size);
+    if (out[i] == NULL) {
+      break;
+    }
+  }
+  return i;
+}
+
+static void free_each(void **ptrs, size_t n) {
+  size_t i;
+
+  for (i=(size_t) 0; i<n; i++) {
+    free(ptrs[i]);
+  }
+}
+
+/* This function allocates and frees the thread's nodes with
+   allocate and release, BENCH_BATCH_NODES at a time, and samples the
+   time per node of every round. */
+static void batch_rounds(bench_thread_t *t, size_t (*allocate)(size_t, size_t, void **),
+			 void (*release)(void **, size_t)) {
+  void *nodes[BENCH_BATCH_NODES];
+  double start;
+  size_t count, i;
+  long round;
+
+  for (round=0l; round<t->operations; round+=BENCH_BATCH_NODES) {
+    start = now_ns();
+    count = allocate(t->size, (size_t) BENCH_BATCH_NODES, nodes);
+    for (i=(size_t) 0; i<count; i++) {
+      *((char *) nodes[i]) = (char) i;
+    }
+    release(nodes, count);
+    samples_add(&t->samples, (now_ns() - start) / BENCH_BATCH_NODES);
+  }
+}
+
+static void *batch_work(bench_thread_t *t) {
+  batch_rounds(t, bench_malloc_batch, bench_free_batch);
+  return NULL;
+}
+
+static void *each_work(bench_thread_t *t) {
+  batch_rounds(t, malloc_each, free_each);
+  return NULL;
+}
+
+static void bench_batch(bench_options_t *options) {
+  bench_thread_t *threads;
+  bench_samples_t all;
+  double seconds, each_seconds, each_p50;
+  char extra[256];
+  int batched;
+
+  if (options->size == ((size_t) 0)) {
+    options->size = (size_t) 64;
+  }
+  bench_malloc_batch = (size_t (*)(size_t, size_t, void **)) dlsym(RTLD_DEFAULT, "malloc_batch");
+  bench_free_batch = (void (*)(void **, size_t)) dlsym(RTLD_DEFAULT, "free_batch");
+  batched = (bench_malloc_batch != NULL) && (bench_free_batch != NULL);
+  if (!batched) {
+    bench_malloc_batch = malloc_each;
+    bench_free_batch = free_each;
+  }
+
+  threads = make_threads(options, (size_t) (options->operations / BENCH_BATCH_NODES + 1));
+  each_seconds = run_threads(threads, options->threads, each_work);
+  merge_thread_samples(&all, threads, options->threads);
+  each_p50 = samples_percentile(&all, 50.0);
+
+  threads = make_threads(options, (size_t) (options->operations / BENCH_BATCH_NODES + 1));
+  seconds = run_threads(threads, options->threads, batch_work);
+  merge_thread_samples(&all, threads, options->threads);
+
+  snprintf(extra, sizeof(extra), ", \"batched\": %s, \"per_call_ops_per_sec\": %.0f, "
+	   "\"per_call_p50_ns\": %.1f",
+	   batched ? "true" : "false",
+	   2.0 * ((double) options->operations) * options->threads / each_seconds, each_p50);
+  report("batch", options, 2.0 * ((double) options->operations) * options->threads,
+	 seconds, &all, extra);
+}
+
+/* sized: free_sized is looked up at run time, like the batch calls */
+static void (*bench_free_sized)(void *, size_t);
+
+static void free_unsized(void *ptr, size_t size) {
+  free(ptr);
+}
+
+/* This function allocates the objects, shuffles them and frees them
+   with release, sampling the time per free of every BENCH_BATCH.
+   - Returns the time the frees took, in s */
+static double sized_round(bench_options_t *options, void **objects, size_t *sizes,
+			  bench_samples_t *samples, void (*release)(void *, size_t)) {
+  unsigned long random_state = 42ul;
+  double start, total = 0.0;
+  size_t swap_size;
+  void *swap;
+  long i, j;
+
+  for (i=0l; i<options->operations; i++) {
+    sizes[i] = (options->size != ((size_t) 0)) ? options->size : random_size(&random_state, 16, 256);
+    objects[i] = malloc(sizes[i]);
+    *((char *) objects[i]) = (char) i;
+  }
+  for (i=options->operations - 1l; i>0l; i--) {
+    j = (long) (bench_random(&random_state) % ((unsigned long) (i + 1l)));
+    swap = objects[i];
+    objects[i] = objects[j];
+    objects[j] = swap;
+    swap_size = sizes[i];
+    sizes[i] = sizes[j];
+    sizes[j] = swap_size;
+  }
+  for (i=0l; i+BENCH_BATCH<=options->operations; i+=BENCH_BATCH) {
+    start = now_ns();
+    for (j=i; j<i+BENCH_BATCH; j++) {
+      release(objects[j], sizes[j]);
+    }
+    start = now_ns() - start;
+    total += start;
+    samples_add(samples, start / BENCH_BATCH);
+  }
+  for (; i<options->operations; i++) {
+    release(objects[i], sizes[i]);
+  }
+  return total / 1e9;
+}
+
+static void bench_sized(bench_options_t *options) {
+  bench_samples_t samples;
+  void **objects;
+  size_t *sizes;
+  double seconds, unsized_seconds, unsized_p50;
+  char extra[256];
+  int sized;
+
+  options->threads = 1;
+  bench_free_sized = (void (*)(void *, size_t)) dlsym(RTLD_DEFAULT, "free_sized");
+  sized = (bench_free_sized != NULL);
+  if (!sized) {
+    bench_free_sized = free_unsized;
+  }
+  objects = (void **) bench_map(((size_t) options->operations) * sizeof(void *));
+  sizes = (size_t *) bench_map(((size_t) options->operations) * sizeof(size_t));
+
+  samples_init(&samples, (size_t) (options->operations / BENCH_BATCH + 1));
+  unsized_seconds = sized_round(options, objects, sizes, &samples, free_unsized);
+  unsized_p50 = samples_percentile(&samples, 50.0);
+  samples_init(&samples, (size_t) (options->operations / BENCH_BATCH + 1));
+  seconds = sized_round(options, objects, sizes, &samples, bench_free_sized);
+
+  snprintf(extra, sizeof(extra), ", \"free_sized\": %s, \"unsized_ops_per_sec\": %.0f, "
+	   "\"unsized_p50_ns\": %.1f",
+	   sized ? "true" : "false",
+	   ((double) options->operations) / unsized_seconds, unsized_p50);
+  report("sized", options, (double) options->operations, seconds, &samples, extra);
+}
+
+static void bench_decay(bench_options_t *options) {
+  bench_samples_t samples;
+  void **ptrs;
+  size_t *sizes, live_bytes = (size_t) 0, offset;
+  unsigned long random_state = 42ul;
+  struct timespec idle;
+  double start, total = 0.0;
+  long i, slot, rss_kb;
+  char extra[256];
+
+  options->threads = 1;
+  ptrs = (void **) bench_map(BENCH_DECAY_SLOTS * sizeof(void *));
+  sizes = (size_t *) bench_map(BENCH_DECAY_SLOTS * sizeof(size_t));
+  samples_init(&samples, (size_t) options->operations);
+  for (i=0l; i<options->operations; i++) {
+    slot = (long) (bench_random(&random_state) % BENCH_DECAY_SLOTS);
+    start = now_ns();
+    free(ptrs[slot]);
+    start = now_ns() - start;
+    total += start;
+    samples_add(&samples, start);
+    live_bytes -= sizes[slot];
+    sizes[slot] = random_size(&random_state, 4096, 65536);
+    ptrs[slot] = malloc(sizes[slot]);
+    for (offset=(size_t) 0; offset<sizes[slot]; offset+=(size_t) 4096) {
+      ((char *) ptrs[slot])[offset] = (char) i;
+    }
+    live_bytes += sizes[slot];
+  }
+
+  for (slot=0l; slot<BENCH_DECAY_SLOTS; slot++) {
+    if ((slot % 8l) != 0l) {
+      free(ptrs[slot]);
+      live_bytes -= sizes[slot];
+      ptrs[slot] = NULL;
+    }
+  }
+  idle.tv_sec = BENCH_DECAY_IDLE_MS / 1000;
+  idle.tv_nsec = (BENCH_DECAY_IDLE_MS % 1000) * 1000000l;
+  nanosleep(&idle, NULL);
+  rss_kb = current_rss_kb();
+
+  snprintf(extra, sizeof(extra), ", \"p999_ns\": %.1f, \"max_ns\": %.1f, "
+	   "\"idle_rss_kb\": %ld, \"idle_live_bytes\": %zu, \"idle_rss_per_live_byte\": %.3f",
+	   samples_percentile(&samples, 99.9), samples_percentile(&samples, 100.0),
+	   rss_kb, live_bytes, ((double) rss_kb) * 1024.0 / ((double) live_bytes));
+  report("decay", options, (double) options->operations, total / 1e9, &samples, extra);
+  for (slot=0l; slot<BENCH_DECAY_SLOTS; slot+=8l) {
+    free(ptrs[slot]);
+  }
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s latency|contention|prodcons|larson|realloc|frag|buffers|small|chase|batch|sized|decay "
+	  "[-t threads] [-n operations] [-s size]\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  bench_options_t options;
+  const char *workload;
+  int opt;
+
+  if (argc < 2) {
+    usage(argv[0]);
+  }
+  workload = argv[1];
+  options.threads = 1;
+  options.operations = 1000000l;
+  options.size = (size_t) 0;
+  optind = 2;
+  while ((opt = getopt(argc, argv, "t:n:s:")) != -1) {
+    switch (opt) {
+    case 't':
+      options.threads = atoi(optarg);
+      break;
+    case 'n':
+      options.operations = atol(optarg);
+      break;
+    case 's':
+      options.size = (size_t) atol(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if ((options.threads < 1) || (options.threads > BENCH_MAX_THREADS) ||
+      (options.operations < (long) BENCH_BATCH)) {
+    usage(argv[0]);
+  }
+
+  if (!strcmp(workload, "latency")) {
+    if (options.size == ((size_t) 0)) {
+      options.size = (size_t) 64;
+    }
+    options.threads = 1;
+    bench_malloc_free("latency", &options);
+  } else if (!strcmp(workload, "contention")) {
+    options.size = (size_t) 0;
+    bench_malloc_free("contention", &options);
+  } else if (!strcmp(workload, "prodcons")) {
+    bench_prodcons(&options);
+  } else if (!strcmp(workload, "larson")) {
+    bench_larson(&options);
+  } else if (!strcmp(workload, "realloc")) {
+    bench_realloc(&options);
+  } else if (!strcmp(workload, "frag")) {
+    bench_frag(&options);
+  } else if (!strcmp(workload, "buffers")) {
+    bench_buffers(&options);
+  } else if (!strcmp(workload, "small")) {
+    bench_small(&options);
+  } else if (!strcmp(workload, "chase")) {
+    bench_chase(&options);
+  } else if (!strcmp(workload, "batch")) {
+    bench_batch(&options);
+  } else if (!strcmp(workload, "sized")) {
+    bench_sized(&options);
+  } else if (!strcmp(workload, "decay")) {
+    bench_decay(&options);
+  } else {
+    usage(argv[0]);
+  }
+  return 0;
+}
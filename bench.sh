@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Runs every benchmark workload against glibc's malloc and against
+# memory.so and prints one line of JSON per run. Build first with
+# compile.sh. Scale all operation counts with BENCH_SCALE (default 1).
+#
+#   ./bench.sh > results.jsonl
+#
+# Run it from a shell where LD_PRELOAD is not set.
+
+cd "$(dirname "$0")" || exit 1
+unset LD_PRELOAD MEMORY_DEBUG MEMORY_TRACE MEMORY_STATS MEMORY_TUNE
+
+SCALE=${BENCH_SCALE:-1}
+MEMORY_SO=$(pwd)/memory.so
+
+run() {
+    ./bench "$@" || exit 1
+    LD_PRELOAD=$MEMORY_SO ./bench "$@" || exit 1
+}
+
+for size in 16 64 256 512 1024 4096 65536 262144; do
+    run latency -s $size -n $((1000000 * SCALE))
+done
+for threads in 1 2 4 8; do
+    run contention -t $threads -n $((1000000 * SCALE))
+done
+for threads in 1 2 4 8; do
+    run prodcons -t $threads -n $((500000 * SCALE))
+    run prodcons -t $threads -s 4096 -n $((200000 * SCALE))
+done
+for threads in 1 2 4 8; do
+    MEMORY_TUNE=percpu_cache=yes LD_PRELOAD=$MEMORY_SO ./bench contention -t $threads -n $((1000000 * SCALE)) || exit 1
+    MEMORY_TUNE=percpu_cache=yes LD_PRELOAD=$MEMORY_SO ./bench prodcons -t $threads -n $((500000 * SCALE)) || exit 1
+done
+run larson -t 4 -n $((1000000 * SCALE))
+run realloc -n $((200000 * SCALE))
+run frag -n $((50000 * SCALE))
+run buffers -n $((50000 * SCALE))
+run small -n $((1000000 * SCALE))
+run small -s 16 -n $((1000000 * SCALE))
+run chase -n $((400000 * SCALE))
+MEMORY_TUNE=huge_pages=thp LD_PRELOAD=$MEMORY_SO ./bench chase -n $((400000 * SCALE)) || exit 1
+for threads in 1 4; do
+    run batch -t $threads -n $((1000000 * SCALE))
+    run batch -t $threads -s 512 -n $((1000000 * SCALE))
+    run batch -t $threads -s 2048 -n $((500000 * SCALE))
+done
+run sized -n $((2000000 * SCALE))
+run sized -s 64 -n $((2000000 * SCALE))
+run decay -n $((200000 * SCALE))
+MEMORY_TUNE=background_thread=yes LD_PRELOAD=$MEMORY_SO ./bench decay -n $((200000 * SCALE)) || exit 1
+./bench_kernels
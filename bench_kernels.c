@@ -0,0 +1,78 @@
+/*
+
+    Bandwidth of the memset and memcpy kernels of implementation.c,
+    next to glibc's memset and memcpy.
+
+    Compile this file like that (compile.sh does it):
+
+    gcc -Wall -g -O2 -pthread -o bench_kernels bench_kernels.c
+
+    The kernels are static, so this file includes implementation.c
+    to reach them; the binary runs without LD_PRELOAD. It prints one
+    line of JSON per kernel and size, in the same format as bench.
+
+*/
+
+#include "implementation.c"
+
+#define BENCH_KERNELS_BYTES ((size_t) (1024 * 1024 * 1024))
+#define BENCH_KERNELS_MAX_SIZE ((size_t) (16 * 1024 * 1024))
+
+/* Calling glibc through pointers keeps the compiler from inlining
+   its own expansion of memset and memcpy in their place */
+static void *(*volatile glibc_memset)(void *, int, size_t) = memset;
+static void *(*volatile glibc_memcpy)(void *, const void *, size_t) = memcpy;
+
+static double now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((double) ts.tv_sec) * 1e9 + ((double) ts.tv_nsec);
+}
+
+static void report(const char *bench, const char *implementation,
+		   size_t size, size_t iterations, double seconds) {
+  printf("{\"bench\": \"%s\", \"allocator\": \"%s\", \"size\": %zu, "
+	 "\"ops\": %zu, \"seconds\": %.6f, \"ops_per_sec\": %.0f, \"gb_per_sec\": %.3f}\n",
+	 bench, implementation, size, iterations, seconds,
+	 ((double) iterations) / seconds,
+	 ((double) iterations) * ((double) size) / seconds / 1e9);
+}
+
+int main(int argc, char *argv[]) {
+  static const size_t sizes[] = { 64, 256, 4096, 65536, 1024 * 1024, BENCH_KERNELS_MAX_SIZE };
+  char *src, *dest;
+  size_t s, i, size, iterations;
+  double start;
+
+  src = (char *) mmap(NULL, BENCH_KERNELS_MAX_SIZE, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  dest = (char *) mmap(NULL, BENCH_KERNELS_MAX_SIZE, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if ((src == MAP_FAILED) || (dest == MAP_FAILED)) {
+    perror("mmap");
+    return 1;
+  }
+  glibc_memset(src, 1, BENCH_KERNELS_MAX_SIZE);
+  glibc_memset(dest, 2, BENCH_KERNELS_MAX_SIZE);
+
+  for (s=(size_t) 0; s<sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size = sizes[s];
+    iterations = BENCH_KERNELS_BYTES / size;
+
+    start = now_ns();
+    for (i=(size_t) 0; i<iterations; i++) __memset(dest, (int) i, size);
+    report("memset", "memory.so", size, iterations, (now_ns() - start) / 1e9);
+    start = now_ns();
+    for (i=(size_t) 0; i<iterations; i++) glibc_memset(dest, (int) i, size);
+    report("memset", "glibc", size, iterations, (now_ns() - start) / 1e9);
+
+    start = now_ns();
+    for (i=(size_t) 0; i<iterations; i++) __memcpy(dest, src, size);
+    report("memcpy", "memory.so", size, iterations, (now_ns() - start) / 1e9);
+    start = now_ns();
+    for (i=(size_t) 0; i<iterations; i++) glibc_memcpy(dest, src, size);
+    report("memcpy", "glibc", size, iterations, (now_ns() - start) / 1e9);
+  }
+  return 0;
+}
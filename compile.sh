@@ -3,6 +3,10 @@
 gcc -fPIC -Wall -g -O0 -c memory.c
 gcc -fPIC -Wall -g -O0 -c implementation.c
 gcc -fPIC -shared -o memory.so memory.o implementation.o -lpthread
+gcc -Wall -g -O0 -o memory_trace_decode memory_trace_decode.c
+gcc -Wall -g -O2 -pthread -o memory_replay memory_replay.c -ldl
+gcc -Wall -g -O2 -pthread -o bench bench.c -ldl
+gcc -Wall -g -O2 -pthread -o bench_kernels bench_kernels.c
  
 export LD_LIBARY_PATH=`pwd`:"$LD_LIBRARY_PATH"
 export LD_PRELOAD=`pwd`/memory.so
@@ -55,43 +55,286 @@
     
 */
 
+#define _GNU_SOURCE /* for mremap */
+
 #include <stddef.h>
 #include <sys/mman.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
 
 #include <string.h>
+#include <errno.h>
+#include <malloc.h>
 
 /* Predefined helper functions */
 
-static void *__memset(void *s, int c, size_t n) {
-  unsigned char *p;
-  size_t i;
+/* Memory set and copy kernels
+
+   __memset and __memcpy sit on the hot path of calloc and realloc,
+   so they work a word, or a whole vector register, at a time:
+
+   * Below MEMORY_SIMD_MIN_SIZE bytes, the portable word kernels run:
+     they handle the bytes up to the first word-aligned destination
+     address one by one, then whole words, then the remaining bytes.
+
+   * From MEMORY_SIMD_MIN_SIZE bytes on, the SSE2 or AVX2 kernel
+     picked by select_memory_kernels runs. It aligns the destination
+     to the vector size and moves four vectors per iteration.
+
+   * From MEMORY_NON_TEMPORAL_SIZE bytes on, the vector kernels use
+     non-temporal stores, which bypass the caches: a copy that large
+     would only evict everything else from them.
+
+   The kernel is picked once, at load time, from what CPUID reports.
+   Until then the word kernels are used, so a malloc call coming
+   from another library's constructor works as well.
 
-  if (n == ((size_t) 0)) return s;
-  for (i=(size_t) 0,p=(unsigned char *)s;
-       i<=(n-((size_t) 1));
-       i++,p++) {
+   None of them may call libc's memset or memcpy, so GCC must not
+   recognize the loops as such and replace them with calls.
+*/
+#define MEMORY_SIMD_MIN_SIZE ((size_t) 256)
+#define MEMORY_NON_TEMPORAL_SIZE ((size_t) (4 * 1024 * 1024))
+
+#define MEMORY_KERNEL __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+typedef size_t __attribute__((may_alias, aligned(1))) unaligned_word_t;
+
+MEMORY_KERNEL
+static void *__memset_words(void *s, int c, size_t n) {
+  unsigned char *p = (unsigned char *)s;
+  size_t *pw;
+  size_t pattern;
+
+  for (; (n > ((size_t) 0)) && (((size_t) p) & (sizeof(size_t) - ((size_t) 1))); n--, p++) {
+    *p = (unsigned char) c;
+  }
+  pattern = (((size_t) -1) / ((size_t) 255)) * ((size_t) ((unsigned char) c));
+  for (pw = (size_t *)p; n >= 4 * sizeof(size_t); n -= 4 * sizeof(size_t), pw += 4) {
+    pw[0] = pattern;
+    pw[1] = pattern;
+    pw[2] = pattern;
+    pw[3] = pattern;
+  }
+  for (; n >= sizeof(size_t); n -= sizeof(size_t), pw++) {
+    *pw = pattern;
+  }
+  for (p = (unsigned char *)pw; n > ((size_t) 0); n--, p++) {
     *p = (unsigned char) c;
   }
   return s;
 }
 
-static void *__memcpy(void *dest, const void *src, size_t n) {
-  unsigned char *pd;
-  const unsigned char *ps;
-  size_t i;
+MEMORY_KERNEL
+static void *__memcpy_words(void *dest, const void *src, size_t n) {
+  unsigned char *pd = (unsigned char *)dest;
+  const unsigned char *ps = (const unsigned char *)src;
+  size_t *pwd;
+  const unaligned_word_t *pws;
 
-  if (n == ((size_t) 0)) return dest;
-  for (i=(size_t) 0,pd=(unsigned char *)dest,ps=(const unsigned char *)src;
-       i<=(n-((size_t) 1));
-       i++,pd++,ps++) {
+  for (; (n > ((size_t) 0)) && (((size_t) pd) & (sizeof(size_t) - ((size_t) 1))); n--, pd++, ps++) {
+    *pd = *ps;
+  }
+  for (pwd = (size_t *)pd, pws = (const unaligned_word_t *)ps;
+       n >= 4 * sizeof(size_t);
+       n -= 4 * sizeof(size_t), pwd += 4, pws += 4) {
+    pwd[0] = pws[0];
+    pwd[1] = pws[1];
+    pwd[2] = pws[2];
+    pwd[3] = pws[3];
+  }
+  for (; n >= sizeof(size_t); n -= sizeof(size_t), pwd++, pws++) {
+    *pwd = *pws;
+  }
+  for (pd = (unsigned char *)pwd, ps = (const unsigned char *)pws; n > ((size_t) 0); n--, pd++, ps++) {
     *pd = *ps;
   }
   return dest;
 }
 
+static void *(*memset_kernel)(void *, int, size_t) = __memset_words;
+static void *(*memcpy_kernel)(void *, const void *, size_t) = __memcpy_words;
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+/* The SSE2 and AVX2 kernels below are only called with
+   n >= MEMORY_SIMD_MIN_SIZE, so aligning the destination never
+   consumes all of n. */
+
+MEMORY_KERNEL __attribute__((target("sse2")))
+static void *__memset_sse2(void *s, int c, size_t n) {
+  unsigned char *p = (unsigned char *)s;
+  size_t head;
+  __m128i v = _mm_set1_epi8((char) c);
+
+  head = (((size_t) 16) - (((size_t) p) & ((size_t) 15))) & ((size_t) 15);
+  _mm_storeu_si128((__m128i *)p, v);
+  p += head;
+  n -= head;
+  if (n >= MEMORY_NON_TEMPORAL_SIZE) {
+    for (; n >= (size_t) 64; n -= (size_t) 64, p += 64) {
+      _mm_stream_si128((__m128i *)p, v);
+      _mm_stream_si128((__m128i *)(p + 16), v);
+      _mm_stream_si128((__m128i *)(p + 32), v);
+      _mm_stream_si128((__m128i *)(p + 48), v);
+    }
+    _mm_sfence();
+  } else {
+    for (; n >= (size_t) 64; n -= (size_t) 64, p += 64) {
+      _mm_store_si128((__m128i *)p, v);
+      _mm_store_si128((__m128i *)(p + 16), v);
+      _mm_store_si128((__m128i *)(p + 32), v);
+      _mm_store_si128((__m128i *)(p + 48), v);
+    }
+  }
+  __memset_words(p, c, n);
+  return s;
+}
+
+MEMORY_KERNEL __attribute__((target("sse2")))
+static void *__memcpy_sse2(void *dest, const void *src, size_t n) {
+  unsigned char *pd = (unsigned char *)dest;
+  const unsigned char *ps = (const unsigned char *)src;
+  size_t head;
+  __m128i v0, v1, v2, v3;
+
+  head = (((size_t) 16) - (((size_t) pd) & ((size_t) 15))) & ((size_t) 15);
+  _mm_storeu_si128((__m128i *)pd, _mm_loadu_si128((const __m128i *)ps));
+  pd += head;
+  ps += head;
+  n -= head;
+  for (; n >= (size_t) 64; n -= (size_t) 64, pd += 64, ps += 64) {
+    v0 = _mm_loadu_si128((const __m128i *)ps);
+    v1 = _mm_loadu_si128((const __m128i *)(ps + 16));
+    v2 = _mm_loadu_si128((const __m128i *)(ps + 32));
+    v3 = _mm_loadu_si128((const __m128i *)(ps + 48));
+    if (n >= MEMORY_NON_TEMPORAL_SIZE) {
+      _mm_stream_si128((__m128i *)pd, v0);
+      _mm_stream_si128((__m128i *)(pd + 16), v1);
+      _mm_stream_si128((__m128i *)(pd + 32), v2);
+      _mm_stream_si128((__m128i *)(pd + 48), v3);
+    } else {
+      _mm_store_si128((__m128i *)pd, v0);
+      _mm_store_si128((__m128i *)(pd + 16), v1);
+      _mm_store_si128((__m128i *)(pd + 32), v2);
+      _mm_store_si128((__m128i *)(pd + 48), v3);
+    }
+  }
+  _mm_sfence();
+  __memcpy_words(pd, ps, n);
+  return dest;
+}
+
+MEMORY_KERNEL __attribute__((target("avx2")))
+static void *__memset_avx2(void *s, int c, size_t n) {
+  unsigned char *p = (unsigned char *)s;
+  size_t head;
+  __m256i v = _mm256_set1_epi8((char) c);
+
+  head = (((size_t) 32) - (((size_t) p) & ((size_t) 31))) & ((size_t) 31);
+  _mm256_storeu_si256((__m256i *)p, v);
+  p += head;
+  n -= head;
+  if (n >= MEMORY_NON_TEMPORAL_SIZE) {
+    for (; n >= (size_t) 128; n -= (size_t) 128, p += 128) {
+      _mm256_stream_si256((__m256i *)p, v);
+      _mm256_stream_si256((__m256i *)(p + 32), v);
+      _mm256_stream_si256((__m256i *)(p + 64), v);
+      _mm256_stream_si256((__m256i *)(p + 96), v);
+    }
+    _mm_sfence();
+  } else {
+    for (; n >= (size_t) 128; n -= (size_t) 128, p += 128) {
+      _mm256_store_si256((__m256i *)p, v);
+      _mm256_store_si256((__m256i *)(p + 32), v);
+      _mm256_store_si256((__m256i *)(p + 64), v);
+      _mm256_store_si256((__m256i *)(p + 96), v);
+    }
+  }
+  __memset_words(p, c, n);
+  return s;
+}
+
+MEMORY_KERNEL __attribute__((target("avx2")))
+static void *__memcpy_avx2(void *dest, const void *src, size_t n) {
+  unsigned char *pd = (unsigned char *)dest;
+  const unsigned char *ps = (const unsigned char *)src;
+  size_t head;
+  __m256i v0, v1, v2, v3;
+
+  head = (((size_t) 32) - (((size_t) pd) & ((size_t) 31))) & ((size_t) 31);
+  _mm256_storeu_si256((__m256i *)pd, _mm256_loadu_si256((const __m256i *)ps));
+  pd += head;
+  ps += head;
+  n -= head;
+  for (; n >= (size_t) 128; n -= (size_t) 128, pd += 128, ps += 128) {
+    v0 = _mm256_loadu_si256((const __m256i *)ps);
+    v1 = _mm256_loadu_si256((const __m256i *)(ps + 32));
+    v2 = _mm256_loadu_si256((const __m256i *)(ps + 64));
+    v3 = _mm256_loadu_si256((const __m256i *)(ps + 96));
+    if (n >= MEMORY_NON_TEMPORAL_SIZE) {
+      _mm256_stream_si256((__m256i *)pd, v0);
+      _mm256_stream_si256((__m256i *)(pd + 32), v1);
+      _mm256_stream_si256((__m256i *)(pd + 64), v2);
+      _mm256_stream_si256((__m256i *)(pd + 96), v3);
+    } else {
+      _mm256_store_si256((__m256i *)pd, v0);
+      _mm256_store_si256((__m256i *)(pd + 32), v1);
+      _mm256_store_si256((__m256i *)(pd + 64), v2);
+      _mm256_store_si256((__m256i *)(pd + 96), v3);
+    }
+  }
+  _mm_sfence();
+  __memcpy_words(pd, ps, n);
+  return dest;
+}
+
+/* Reads the extended control register 0, which tells whether the
+   operating system saves the AVX registers on context switches. */
+static unsigned long long __read_xcr0() {
+  unsigned int eax, edx;
+
+  __asm__ volatile ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+  return (((unsigned long long) edx) << 32) | ((unsigned long long) eax);
+}
+
+/* Picks the fastest memset and memcpy kernels the CPU supports. */
+__attribute__((constructor))
+static void select_memory_kernels() {
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return;
+  if (edx & bit_SSE2) {
+    memset_kernel = __memset_sse2;
+    memcpy_kernel = __memcpy_sse2;
+  }
+  if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX) ||
+      ((__read_xcr0() & 6ull) != 6ull)) return;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return;
+  if (ebx & bit_AVX2) {
+    memset_kernel = __memset_avx2;
+    memcpy_kernel = __memcpy_avx2;
+  }
+}
+
+#endif
+
+static void *__memset(void *s, int c, size_t n) {
+  if (n < MEMORY_SIMD_MIN_SIZE) return __memset_words(s, c, n);
+  return memset_kernel(s, c, n);
+}
+
+static void *__memcpy(void *dest, const void *src, size_t n) {
+  if (n < MEMORY_SIMD_MIN_SIZE) return __memcpy_words(dest, src, n);
+  return memcpy_kernel(dest, src, n);
+}
+
 /* Tries to multiply the two size_t arguments a and b.
 
    If the product holds on a size_t variable, sets the 
@@ -163,18 +406,582 @@ static int __try_size_t_multiply(size_t *c, size_t a, size_t b) {
 */
 
 
-/* Struct that represents memory blocks implemented as
-  a linked list.*/
+/* Struct that represents memory blocks.
+
+  Inside an arena, blocks follow each other without gaps: the next
+  block's header starts right after size bytes of payload. Each
+  arena ends with a fence, an allocated header of size 0, so the
+  last block's next block always exists. No real block has size 0.
+
+  prev_size is the boundary tag of the previous block: it holds that
+  block's size while it is free, and 0 while it is allocated or when
+  there is no previous block. Together with the next block's is_free,
+  this lets a block find both of its neighbours, and coalesce with
+  them, in constant time.
+
+  A block with is_mapped set is not part of any arena: it owns a
+  dedicated mapping of prev_size + sizeof(memory_block_header_t) +
+  size bytes, at whose start it sits prev_size bytes in, and has no
+  neighbours.
+
+  dirty_size is the number of bytes at the start of the payload that
+  may be non-zero; everything after them is known to be zero, as it
+  has not been written since the kernel handed it out. For free
+  blocks this covers at least the bin links. For allocated blocks it
+  is the state at the moment they were handed out, which is what
+  calloc needs to zero only the bytes that really are dirty.
+
+  The header is padded to a multiple of 16 bytes so that the memory
+  handed out right after it has the same alignment as glibc's.*/
 typedef struct memory_block_header {
+  size_t prev_size;
     size_t size;
     int is_free;
-  struct memory_block_header *next;
-} memory_block_header_t;
+    int is_mapped;
+  size_t dirty_size;
+} __attribute__((aligned(16))) memory_block_header_t;
+
+/* Struct that represents an arena, i.e. one chunk of memory
+   obtained with mmap and carved into blocks. The first block starts
+   at the beginning of the mapping; the arena struct sits at its very
+   end, right after the fence. So the last block of an arena finds
+   its arena through its next block, the fence.
+
+   is_free is set while the arena consists of one single free block,
+   i.e. could be unmapped; free_epoch then is the value of
+   purge_epoch at the moment it became free. page_size is the size
+   of the pages backing the arena, the granularity in which it is
+   purged. */
+typedef struct memory_arena {
+  size_t size;
+  size_t page_size;
+  struct memory_arena *next;
+  struct memory_arena *prev;
+  int is_free;
+  unsigned int free_epoch;
+} __attribute__((aligned(16))) memory_arena_t;
+
+/* Alignment of every pointer we return and granularity of every
+   block size we hand out. */
+#define MEMORY_ALIGNMENT ((size_t) 16)
+
+/* Arenas grow geometrically: the first one is ARENA_MIN_SIZE bytes
+   long and each new one is the arena_growth tunable times bigger
+   than the previous one, up to ARENA_MAX_SIZE. This keeps the number
+   of mmap calls logarithmic in the heap size for small heaps and
+   linear in steps of several MiB for big ones. */
+#define ARENA_MIN_SIZE ((size_t) (64 * 1024))
+#define ARENA_MAX_SIZE ((size_t) (4 * 1024 * 1024))
+#ifndef ARENA_GROWTH_FACTOR
+#define ARENA_GROWTH_FACTOR ((size_t) 2)
+#endif
+
+/* Requests of at least the mmap_threshold tunable, by default
+   MEMORY_MMAP_THRESHOLD bytes, do not go into an arena but get a
+   dedicated mapping, which is unmapped as soon as they are freed. */
+#ifndef MEMORY_MMAP_THRESHOLD
+#define MEMORY_MMAP_THRESHOLD ((size_t) (128 * 1024))
+#endif
+
+/* This global variable holds the start of the linked list of arenas */
+static memory_arena_t *arena_list = NULL;
+
+/* Size of the next arena we are going to map */
+static size_t next_arena_size = ARENA_MIN_SIZE;
+
+/* Huge pages
+
+   With the huge_pages tunable set to thp, arenas of at least
+   HUGE_PAGE_SIZE bytes are sized in multiples of HUGE_PAGE_SIZE,
+   aligned to it and advised with madvise(MADV_HUGEPAGE), so that the
+   kernel can back them with transparent huge pages. With hugetlb,
+   they are mapped with MAP_HUGETLB from the pool of reserved huge
+   pages first, and as with thp when the pool is exhausted. Either
+   way, a big heap then takes a fraction of the TLB entries and page
+   tables it would take with 4 KiB pages.
+
+   Such arenas are purged in whole huge pages only: giving back a
+   part of one would split it, and MAP_HUGETLB pages cannot be split
+   at all.
+*/
+#define HUGE_PAGE_SIZE ((size_t) (2 * 1024 * 1024))
+
+typedef enum huge_page_mode {
+  HUGE_PAGES_OFF = 0,
+  HUGE_PAGES_THP,
+  HUGE_PAGES_HUGETLB
+} huge_page_mode_t;
+
+/* Returning memory to the kernel
+
+   Memory that is free for long enough goes back to the kernel:
+
+   * An arena that is entirely free is unmapped. Up to the
+     trim_threshold tunable's bytes of such arenas are kept mapped for
+     at least one purge interval, so that a workload that keeps
+     freeing and reallocating the same amount does not thrash
+     mmap/munmap. Beyond that, they are unmapped right away.
+
+   * The whole pages inside big free blocks of arenas that are still
+     in use are released with madvise(MADV_DONTNEED). Unlike
+     MADV_FREE, this guarantees that they read back as zeros, so the
+     blocks' dirty_size shrinks accordingly and calloc does not need
+     to zero them again.
+
+   Both happen in a purge pass, run at most once every decay_ms
+   tunable milliseconds, when a free produces a free block of at
+   least a page. A pass unmaps the free arenas that were already free
+   at the previous pass, and purges all big free blocks. With
+   decay_ms set to 0, there are no passes: such a free purges the
+   block it produced, and only that one, right away, and free arenas
+   within the trim threshold stay mapped. malloc_trim runs a pass
+   right away, without any hysteresis.
+
+   With the background_thread tunable set, free does none of this,
+   and no system call at all but for unmapping dedicated mappings: a
+   background thread does it instead, see below.
+*/
+#ifndef MEMORY_TRIM_THRESHOLD
+#define MEMORY_TRIM_THRESHOLD ((size_t) (8 * 1024 * 1024))
+#endif
+#ifndef MEMORY_PURGE_INTERVAL_MS
+#define MEMORY_PURGE_INTERVAL_MS 1000
+#endif
+
+/* Number of bytes of entirely free arenas that are still mapped */
+static size_t free_arena_bytes = (size_t) 0;
+
+/* Number of purge passes so far, and time of the next one in ns */
+static unsigned int purge_epoch = 0u;
+static unsigned long long next_purge_time = 0ull;
+
+/* State of the background thread. It goes from off to wanted when
+   the tunable is set, and to running once the thread is up. */
+typedef enum background_thread_state {
+  BACKGROUND_THREAD_OFF = 0,
+  BACKGROUND_THREAD_WANTED,
+  BACKGROUND_THREAD_STARTING,
+  BACKGROUND_THREAD_RUNNING
+} background_thread_state_t;
+
+static int background_thread_state = BACKGROUND_THREAD_OFF;
+
+static void start_background_thread();
+
+/* This function tells whether the background thread purges, so that
+   free does not have to. */
+static int is_background_thread_running() {
+  return (__atomic_load_n(&background_thread_state, __ATOMIC_RELAXED) == BACKGROUND_THREAD_RUNNING);
+}
+
+#ifndef MEMORY_TCACHE_COUNT
+#define MEMORY_TCACHE_COUNT ((size_t) 64)
+#endif
+#ifndef MEMORY_TCACHE_BYTES
+#define MEMORY_TCACHE_BYTES ((size_t) (4 * 1024 * 1024))
+#endif
+
+#ifndef MEMORY_PROFILE_INTERVAL
+#define MEMORY_PROFILE_INTERVAL ((size_t) (512 * 1024))
+#endif
+
+/* Tunables
+
+   The policies below can be changed at run time with mallopt, or at
+   load time with the environment variable MEMORY_TUNE, a
+   comma-separated list of key=value pairs, such as
+   MEMORY_TUNE=mmap_threshold=1m,decay_ms=0,huge_pages=thp. Sizes
+   may end in k, m or g. The keys, their mallopt parameters and their
+   defaults are:
+
+   mmap_threshold  M_MMAP_THRESHOLD       MEMORY_MMAP_THRESHOLD
+   arena_growth    M_MEMORY_ARENA_GROWTH  ARENA_GROWTH_FACTOR, 1 to 16
+   trim_threshold  M_TRIM_THRESHOLD       MEMORY_TRIM_THRESHOLD
+   decay_ms        M_MEMORY_DECAY_MS      MEMORY_PURGE_INTERVAL_MS
+   tcache_count    M_MEMORY_TCACHE_COUNT  MEMORY_TCACHE_COUNT
+   tcache_bytes    M_MEMORY_TCACHE_BYTES  MEMORY_TCACHE_BYTES
+   huge_pages      M_MEMORY_HUGE_PAGES    off (0), thp (1) or hugetlb (2)
+   percpu_cache    M_MEMORY_PERCPU_CACHE  no (0) or yes (1)
+   background_thread M_MEMORY_BACKGROUND_THREAD  no (0) or yes (1)
+   profile_interval  M_MEMORY_PROFILE_INTERVAL   MEMORY_PROFILE_INTERVAL
+
+   tcache_count is the number of objects a thread cache bin may hold,
+   and tcache_bytes the number of bytes all thread caches together
+   should hold.
+   huge_pages only affects arenas mapped afterwards, and turning
+   percpu_cache off only affects threads that have not used the
+   per-CPU caches yet. The M_MEMORY_* parameters are ours; programs
+   that set them through mallopt define them with the values below.
+
+   The values are stored under memory_management_lock, but the fast
+   paths read them without it, at worst missing a change for a few
+   calls. MEMORY_TUNE is parsed in place: nothing may be allocated
+   while the heap is being configured. Malformed pairs are ignored.
+   The current values are part of the statistics.
+*/
+#define M_MEMORY_ARENA_GROWTH (-101)
+#define M_MEMORY_DECAY_MS (-102)
+#define M_MEMORY_TCACHE_COUNT (-103)
+#define M_MEMORY_HUGE_PAGES (-104)
+#define M_MEMORY_PERCPU_CACHE (-105)
+#define M_MEMORY_BACKGROUND_THREAD (-106)
+#define M_MEMORY_PROFILE_INTERVAL (-107)
+#define M_MEMORY_TCACHE_BYTES (-108)
+
+typedef enum memory_tunable {
+  TUNABLE_MMAP_THRESHOLD = 0,
+  TUNABLE_ARENA_GROWTH,
+  TUNABLE_TRIM_THRESHOLD,
+  TUNABLE_DECAY_MS,
+  TUNABLE_TCACHE_COUNT,
+  TUNABLE_HUGE_PAGES,
+  TUNABLE_PERCPU_CACHE,
+  TUNABLE_BACKGROUND_THREAD,
+  TUNABLE_PROFILE_INTERVAL,
+  TUNABLE_TCACHE_BYTES,
+  TUNABLE_COUNT
+} memory_tunable_t;
+
+static const char *const tunable_names[TUNABLE_COUNT] = {
+  "mmap_threshold",
+  "arena_growth",
+  "trim_threshold",
+  "decay_ms",
+  "tcache_count",
+  "huge_pages",
+  "percpu_cache",
+  "background_thread",
+  "profile_interval",
+  "tcache_bytes"
+};
+
+static size_t tunables[TUNABLE_COUNT] = {
+  MEMORY_MMAP_THRESHOLD,
+  ARENA_GROWTH_FACTOR,
+  MEMORY_TRIM_THRESHOLD,
+  (size_t) MEMORY_PURGE_INTERVAL_MS,
+  MEMORY_TCACHE_COUNT,
+  (size_t) HUGE_PAGES_OFF,
+  (size_t) 0,
+  (size_t) 0,
+  MEMORY_PROFILE_INTERVAL,
+  MEMORY_TCACHE_BYTES
+};
+
+
+/* Free block index
+
+   Free blocks of up to SMALL_BIN_MAX_SIZE bytes are linked into
+   exact bins: bin i holds the free blocks of exactly
+   i * MEMORY_ALIGNMENT bytes. A bitmap records which bins are
+   non-empty, so that the smallest non-empty bin that fits a request
+   is found with a couple of bit scans instead of a walk.
+
+   Bigger free blocks are kept in a tree ordered by size, then by
+   address, so that the best fit, i.e. the smallest block that is big
+   enough and, among blocks of that size, the lowest one, is found in
+   a single descent. Reusing the lowest addresses first leaves the
+   top of the arenas free for them to be given back. The tree is a
+   treap whose priorities are a hash of the blocks' addresses, which
+   keeps it balanced in expectation without any bookkeeping.
+
+   Sizes above SMALL_BIN_MAX_SIZE still fall into power-of-two
+   classes, for the statistics only: the first holds sizes in
+   ]1 KiB, 2 KiB[, the next [2 KiB, 4 KiB[ and so on.
+
+   The bin links, or the tree links, live in the first 16 bytes of
+   the free block's payload, which is always at least
+   MEMORY_ALIGNMENT bytes long.
+*/
+#define SMALL_BIN_MAX_SIZE ((size_t) 1024)
+#define SMALL_BIN_COUNT (SMALL_BIN_MAX_SIZE / MEMORY_ALIGNMENT)
+#define SMALL_BIN_MAX_SIZE_LOG2 10
+#define FREE_BIN_COUNT (SMALL_BIN_COUNT + ((size_t) 1) + \
+			((size_t) (8 * sizeof(size_t))) - SMALL_BIN_MAX_SIZE_LOG2)
+#define FREE_BIN_BITMAP_WORDS ((SMALL_BIN_COUNT + ((size_t) 64)) / ((size_t) 64))
+
+typedef struct free_block_links {
+  memory_block_header_t *prev_free;
+  memory_block_header_t *next_free;
+} free_block_links_t;
+
+/* Takes the place of free_block_links_t in the blocks of the tree,
+   and has the same size */
+typedef struct free_tree_links {
+  memory_block_header_t *left;
+  memory_block_header_t *right;
+} free_tree_links_t;
+
+static memory_block_header_t *free_bins[SMALL_BIN_COUNT + ((size_t) 1)];
+static unsigned long long free_bin_bitmap[FREE_BIN_BITMAP_WORDS];
+static memory_block_header_t *free_tree = NULL;
+
+/* This lock protects the arenas, the bins and every header in them.
+
+   The thread caches below take it only when they refill an empty
+   bin from the shared heap or flush an overfull bin back to it. */
+static pthread_mutex_t memory_management_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Arena blocks freed while memory_management_lock is busy, linked
+   through the first word of their payload. Any thread pushes onto
+   this list with a compare and swap; whoever holds the lock takes
+   all of it with an exchange when an allocation finds no free block
+   and when it frees a block itself. */
+static void *heap_remote_free = NULL;
+
+/* Allocator statistics
+
+   Every thread counts what it does in a shard of its own: calls per
+   function, bytes requested and handed out, system calls, the
+   contents of its cache and a histogram of the size classes it
+   allocates, using the bins' classes. Only the owning thread writes
+   to a shard, with plain relaxed atomic stores, so counting needs
+   neither a lock nor a locked instruction. Readers sum all shards
+   with relaxed atomic loads. Counters that are decremented by
+   another thread than the one that incremented them, such as the
+   bytes of dedicated mappings, wrap around in one shard but add up
+   correctly over all of them.
+
+   The shards are carved out of mappings of their own and linked
+   into stats_shard_list, never to be unlinked. A shard is the value
+   of stats_shard_key for its thread, whose destructor flushes the
+   thread's cache when it exits and puts the shard on
+   stats_shard_free_list, counters and all, for the next new thread
+   to take over. So the sums stay right, and a program that keeps
+   starting short-lived threads does not keep growing the list. A
+   thread that cannot get a shard, or that allocates after its
+   shard's destructor ran, counts in fallback_stats_shard, shared
+   and hence approximate.
 
+   Besides the counters, a shard holds the limit on the bytes in its
+   thread's cache, see the thread caches, and the thread's id for the
+   reports. The bytes themselves are those of the cached_bytes
+   counter, less its value when the thread took the shard over.
 
-/* This global variable holds the start of the linked list
-   of free memory blocks */
-static memory_block_header_t *free_block_list = NULL;
+   What describes the shared heap as a whole is kept in heap_stats,
+   under memory_management_lock.
+*/
+typedef enum memory_stats_counter {
+  STATS_MALLOC_CALLS = 0,
+  STATS_CALLOC_CALLS,
+  STATS_REALLOC_CALLS,
+  STATS_FREE_CALLS,
+  STATS_MALLOC_TRIM_CALLS,
+  STATS_ALIGNED_CALLS,
+  STATS_INVALID_POINTERS,
+  STATS_REQUESTED_BYTES,
+  STATS_ALLOCATED_BYTES,
+  STATS_FREED_BYTES,
+  STATS_CACHE_HITS,
+  STATS_CACHE_REFILLS,
+  STATS_CACHE_FLUSHES,
+  STATS_REMOTE_FREES,
+  STATS_CACHED_BLOCKS,
+  STATS_CACHED_BYTES,
+  STATS_MMAP_CALLS,
+  STATS_MUNMAP_CALLS,
+  STATS_MREMAP_CALLS,
+  STATS_MADVISE_CALLS,
+  STATS_MAPPED_BLOCKS,
+  STATS_MAPPED_BYTES,
+  STATS_COUNTER_COUNT
+} memory_stats_counter_t;
+
+static const char *const stats_counter_names[STATS_COUNTER_COUNT] = {
+  "malloc_calls",
+  "calloc_calls",
+  "realloc_calls",
+  "free_calls",
+  "malloc_trim_calls",
+  "aligned_calls",
+  "invalid_pointers",
+  "requested_bytes",
+  "allocated_bytes",
+  "freed_bytes",
+  "cache_hits",
+  "cache_refills",
+  "cache_flushes",
+  "remote_frees",
+  "cached_blocks",
+  "cached_bytes",
+  "mmap_calls",
+  "munmap_calls",
+  "mremap_calls",
+  "madvise_calls",
+  "mapped_blocks",
+  "mapped_bytes"
+};
+
+typedef struct memory_stats_shard {
+  size_t counters[STATS_COUNTER_COUNT];
+  size_t size_classes[FREE_BIN_COUNT];
+  size_t cache_base;
+  size_t cache_limit;
+  size_t activity_seen;
+  pid_t tid;
+  int live;
+  int percpu;
+  struct memory_stats_shard *next;
+  struct memory_stats_shard *next_free;
+} __attribute__((aligned(64))) memory_stats_shard_t;
+
+typedef struct memory_heap_stats {
+  size_t arena_count;
+  size_t arena_bytes;
+  size_t huge_arena_bytes;
+  size_t free_block_count;
+  size_t free_block_bytes;
+  size_t dirty_bytes;
+  size_t purged_bytes;
+  size_t background_wakeups;
+  size_t background_cpu_ns;
+} memory_heap_stats_t;
+
+#define STATS_SHARD_POOL_SIZE ((size_t) (64 * 1024))
+
+/* Value of malloc_info's options argument that asks for JSON
+   instead of XML. glibc only defines 0. */
+#define MEMORY_INFO_JSON 1
+
+static memory_stats_shard_t fallback_stats_shard;
+static memory_stats_shard_t *stats_shard_list = &fallback_stats_shard;
+static memory_stats_shard_t *stats_shard_free_list = NULL;
+static size_t stats_shard_count = (size_t) 1;
+static char *stats_shard_pool = NULL;
+static size_t stats_shard_pool_left = (size_t) 0;
+static pthread_key_t stats_shard_key;
+static pthread_once_t stats_shard_key_once = PTHREAD_ONCE_INIT;
+
+/* This lock protects the list, the free list and the pool, as well
+   as the cache limits and thread_cache_claimed, the sum of the
+   limits of all live shards. */
+static pthread_mutex_t stats_shard_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t thread_cache_claimed = (size_t) 0;
+
+static __thread memory_stats_shard_t *stats_shard
+  __attribute__((tls_model("initial-exec")));
+
+static memory_heap_stats_t heap_stats;
+
+static void release_thread_cache();
+
+/* This function puts shard, whose thread is gone, on the free list
+   and gives its cache limit back to the budget. The caller must
+   hold stats_shard_lock. */
+static void recycle_stats_shard(memory_stats_shard_t *shard) {
+  thread_cache_claimed -= shard->cache_limit;
+  __atomic_store_n(&shard->cache_limit, (size_t) 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&shard->percpu, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&shard->live, 0, __ATOMIC_RELAXED);
+  shard->next_free = stats_shard_free_list;
+  stats_shard_free_list = shard;
+}
+
+/* This function is the destructor of stats_shard_key: it runs when
+   a thread that has a shard exits, flushes the thread's cache while
+   the shard still counts it, and recycles the shard. */
+static void release_stats_shard(void *arg) {
+  memory_stats_shard_t *shard = (memory_stats_shard_t *) arg;
+
+  release_thread_cache();
+  stats_shard = &fallback_stats_shard;
+  pthread_mutex_lock(&stats_shard_lock);
+  recycle_stats_shard(shard);
+  pthread_mutex_unlock(&stats_shard_lock);
+}
+
+/* This function recycles, in the child of a fork, the shards of
+   all threads but the one that forked: they do not exist there.
+   What their caches held stays allocated in the child. */
+static void release_stats_shards_in_child() {
+  memory_stats_shard_t *shard;
+
+  pthread_mutex_init(&stats_shard_lock, NULL);
+  for (shard = stats_shard_list; shard != NULL; shard = shard->next) {
+    if (shard->live && (shard != stats_shard)) {
+      recycle_stats_shard(shard);
+    }
+  }
+}
+
+/* This function creates stats_shard_key, once. */
+static void create_stats_shard_key() {
+  if (pthread_key_create(&stats_shard_key, release_stats_shard) == 0) {
+    pthread_atfork(NULL, NULL, release_stats_shards_in_child);
+  }
+}
+
+/* This function hands out a shard for the calling thread, a recycled
+   one or a new, zeroed one, which it links into stats_shard_list.
+   The shard's cache limit starts at zero; the first refill of the
+   thread's cache raises it.
+   - Returns the shard
+   - Returns fallback_stats_shard if no memory could be mapped */
+static memory_stats_shard_t *register_stats_shard() {
+  memory_stats_shard_t *shard;
+  void *memory;
+
+  pthread_mutex_lock(&stats_shard_lock);
+  shard = stats_shard_free_list;
+  if (shard != NULL) {
+    stats_shard_free_list = shard->next_free;
+    shard->next_free = NULL;
+  } else {
+    if (stats_shard_pool_left < sizeof(memory_stats_shard_t)) {
+      memory = mmap(NULL, STATS_SHARD_POOL_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (memory == MAP_FAILED) {
+	pthread_mutex_unlock(&stats_shard_lock);
+	return &fallback_stats_shard;
+      }
+      stats_shard_pool = (char *)memory;
+      stats_shard_pool_left = STATS_SHARD_POOL_SIZE;
+    }
+    shard = (memory_stats_shard_t *)stats_shard_pool;
+    stats_shard_pool += sizeof(memory_stats_shard_t);
+    stats_shard_pool_left -= sizeof(memory_stats_shard_t);
+    shard->next = stats_shard_list;
+    stats_shard_count++;
+    __atomic_store_n(&stats_shard_list, shard, __ATOMIC_RELEASE);
+  }
+  shard->tid = gettid();
+  __atomic_store_n(&shard->cache_base, shard->counters[STATS_CACHED_BYTES], __ATOMIC_RELAXED);
+  __atomic_store_n(&shard->live, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&stats_shard_lock);
+
+  pthread_once(&stats_shard_key_once, create_stats_shard_key);
+  pthread_setspecific(stats_shard_key, shard);
+  return shard;
+}
+
+/* This function returns the calling thread's shard, registering
+   it on first use. */
+static inline memory_stats_shard_t *get_stats_shard() {
+  if (stats_shard == NULL) {
+    stats_shard = register_stats_shard();
+  }
+  return stats_shard;
+}
+
+/* This function adds value to the counter counter of the calling
+   thread's shard. Subtracting works by adding the two's complement. */
+static void stats_add(memory_stats_counter_t counter, size_t value) {
+  size_t *c = &(get_stats_shard()->counters[counter]);
+
+  __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+/* This function returns the bytes in the thread cache of the thread
+   that owns shard. A thread that caches per CPU has its cached_bytes
+   counter count what it moves in and out of the CPUs' caches
+   instead, and nothing in its thread cache. */
+static size_t get_thread_cache_bytes(memory_stats_shard_t *shard) {
+  if (__atomic_load_n(&shard->percpu, __ATOMIC_RELAXED)) {
+    return (size_t) 0;
+  }
+  return __atomic_load_n(&shard->counters[STATS_CACHED_BYTES], __ATOMIC_RELAXED) -
+    __atomic_load_n(&shard->cache_base, __ATOMIC_RELAXED);
+}
 
 
 /* This function writes len bytes from the buffer buf
@@ -224,276 +1031,3969 @@ int my_write(int fd, const void *buf) {
   return 0;
 }
 
+/* This function rounds size up to the next multiple of
+   MEMORY_ALIGNMENT.
+   - Returns the rounded size
+   - Returns 0 if rounding up would overflow a size_t
+*/
+static size_t round_up_to_alignment(size_t size) {
+  if (size > ((size_t) -1) - (MEMORY_ALIGNMENT - ((size_t) 1))) {
+    return (size_t) 0;
+  }
+  return (size + (MEMORY_ALIGNMENT - ((size_t) 1))) & ~(MEMORY_ALIGNMENT - ((size_t) 1));
+}
+
+/* This function returns the number of bytes ptr has to be moved
+   forward to be a multiple of alignment, a power of two. */
+static size_t get_alignment_padding(const void *ptr, size_t alignment) {
+  return (alignment - (((size_t) ptr) & (alignment - ((size_t) 1)))) & (alignment - ((size_t) 1));
+}
+
 /* This function checks that there is space left over
-   to at least create a header after the size of memory
-   the user wants is allocated.
+   to at least create a header (and a minimal payload) after
+   the size of memory the user wants is allocated.
    - Returns 1 if there is enough space for a header
    - Returns 0 if there is not enought space for a header
 */
 int check_enough_space_for_header_after_allocation(memory_block_header_t *ptr,
 						   size_t desired_size) {
-  return (ptr->size - desired_size - sizeof(memory_block_header_t) >= 0); 
+  return (ptr->size >= desired_size + sizeof(memory_block_header_t) + MEMORY_ALIGNMENT);
 }
 
 
-/* This function makes a header and allocates the memory the user wants.
-   We assume that there is enough space for the memory allocation
-   and for the header.
-   - Returns 1 if the making of the header and allocation was sucessful
-   - Returns 0 if unsuccessful */
-void make_header_and_allocate_memory(memory_block_header_t *start,
-				     size_t desired_size) {
-  memory_block_header_t *new_header;
-  /* Figure out where the new header goes */
-  new_header = start + sizeof(memory_block_header_t) + desired_size;
-
-  /* Initialize its attributes */
-  new_header->size = start->size - sizeof(memory_block_header_t) - desired_size;
-  new_header->is_free = 1;
-  if (start != NULL) {
-    new_header->next = start->next;
-  } else {
-    new_header->next = NULL;
+/* This function returns the bin links stored in the payload of
+   the free block described by header. */
+static free_block_links_t *get_free_block_links(memory_block_header_t *header) {
+  return (free_block_links_t *)((char *)header + sizeof(memory_block_header_t));
+}
+
+/* This function returns the header of the block that physically
+   follows the arena block described by header. */
+static memory_block_header_t *get_next_block(memory_block_header_t *header) {
+  return (memory_block_header_t *)((char *)header + sizeof(memory_block_header_t) + header->size);
+}
+
+/* This function returns the header of the block that physically
+   precedes the arena block described by header.
+   - Returns NULL if that block is not free (or does not exist) */
+static memory_block_header_t *get_prev_free_block(memory_block_header_t *header) {
+  if (header->prev_size == ((size_t) 0)) {
+    return NULL;
   }
-    
-  start->size = desired_size; // Update size
-  start->is_free = 0;
-  start->next = new_header;
+  return (memory_block_header_t *)((char *)header - header->prev_size - sizeof(memory_block_header_t));
 }
 
+/* This function returns the index of the bin that holds free
+   blocks of size bytes. size must be a non-zero multiple of
+   MEMORY_ALIGNMENT. */
+static size_t get_bin_index(size_t size) {
+  size_t log2_size;
 
-/* This function makes a new header and allocates spaces
-   when we haven't done it before for that chunk of memory.*/
-void make_header_and_allocate_memory_first_allocation(memory_block_header_t *start,
-						       size_t desired_size) {
-  size_t old_size = start->size;
-  memory_block_header_t *new_header;
-  
-  start->size = desired_size;
-  start->is_free = 0;
+  if (size <= SMALL_BIN_MAX_SIZE) {
+    return size / MEMORY_ALIGNMENT;
+  }
+  log2_size = ((size_t) (8 * sizeof(size_t) - 1)) - ((size_t) __builtin_clzl(size));
+  return SMALL_BIN_COUNT + ((size_t) 1) + (log2_size - SMALL_BIN_MAX_SIZE_LOG2);
+}
 
-  new_header = start + sizeof(memory_block_header_t) + desired_size;
-   /* Initialize its attributes */
-  new_header->size = old_size - sizeof(memory_block_header_t) -sizeof(memory_block_header_t);
-  new_header->is_free = 1;
-  
-  start->next = new_header;
+/* This function returns the tree links stored in the payload of
+   the free block described by header. */
+static free_tree_links_t *get_free_tree_links(memory_block_header_t *header) {
+  return (free_tree_links_t *)((char *)header + sizeof(memory_block_header_t));
+}
 
-  new_header->next = NULL; // Because we know it is first allocation
+/* This function returns the treap priority of the free block
+   described by header, a multiplicative hash of its address. */
+static size_t get_free_tree_priority(const memory_block_header_t *header) {
+  return (((size_t) header) >> 4) * ((size_t) 0x9e3779b97f4a7c15ull);
 }
 
-/*
-  This function returns a ptr to a block of memory
-  of size 'size'.
-   - It allocates new memory using mmap if there is
-     no more space in our linked list to store memory
-     of that size.
-   - If there is space in our linked list, it returns
-     a ptr to the first block in our list that is the
-     beginning of a chunk of at least the size requested.
-*/
-void *get_ptr_next_memory_fit(size_t size) {
-  void *memory;
-  memory_block_header_t *new_block;
-  memory_block_header_t *cur = free_block_list;
-
-  if (cur == NULL) {
-    my_write(1, "free_block_list is null, so this is our first time allocating memory");
-    /* First time allocating memory */
-    memory = mmap(NULL, getpagesize(), PROT_READ | PROT_WRITE,
-		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if(memory == MAP_FAILED) {
-      return NULL;
-    }
+/* This function tells whether the free block a comes before the
+   free block b in the tree's order: by size, then by address. */
+static int free_tree_less(const memory_block_header_t *a, const memory_block_header_t *b) {
+  return (a->size < b->size) || ((a->size == b->size) && (a < b));
+}
 
-    new_block = (memory_block_header_t *)memory;
-    new_block->size = getpagesize() - sizeof(memory_block_header_t);
-    new_block->is_free = 1;
-    new_block->next = NULL;
-    free_block_list = new_block;
+/* This function links the free block described by header into the
+   tree: it goes down to where its priority puts it, and splits the
+   subtree it displaces into the blocks before and after it. */
+static void insert_free_tree_block(memory_block_header_t *header) {
+  memory_block_header_t **link = &free_tree, **left_link, **right_link;
+  memory_block_header_t *node;
+  size_t priority = get_free_tree_priority(header);
 
-    if(check_enough_space_for_header_after_allocation(new_block, size)) {
-      make_header_and_allocate_memory_first_allocation(new_block, size);
-      return (void *)((char *)new_block + sizeof(memory_block_header_t)); 
-    }
-    return NULL;
-  }
-  
-  /* Iterate through memory blocks linked list */
-  while (cur != NULL) {
-    if (cur->is_free &&
-	check_enough_space_for_header_after_allocation(cur, size)) {
-      /* If the current block of memory is free and the size of the
-	 memory we were asked for is less than available memory, then
-	 we have found continuous memory block of the size we need.
-      */
-      make_header_and_allocate_memory(cur, size);
-      return (void *)((char *)cur + sizeof(memory_block_header_t)); // Do not include the header
-    }
-    // Go to next element in the linked list
-    cur = cur->next;
-  }
-
-  /* After iterating through the entire linked list we see that the size
-     of the memory we were asked for is more than the current available
-     memory,so we need to allocate a fresh chunk of memory.
-  */
-  cur = free_block_list;
-  memory = mmap(NULL, getpagesize(), PROT_READ | PROT_WRITE,
-		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if(memory == MAP_FAILED) {
-      return NULL;
+  while ((*link != NULL) && (get_free_tree_priority(*link) > priority)) {
+    link = free_tree_less(header, *link) ?
+      &get_free_tree_links(*link)->left : &get_free_tree_links(*link)->right;
   }
-  new_block = (memory_block_header_t *)memory;
-
-  while (cur != NULL) {
-    if (cur->next == NULL) {
-      /* We want to insert this new chunk after the last header in
-	 our current linked list.*/
-      make_header_and_allocate_memory_first_allocation(new_block, size);
-      cur->next = new_block;
-      return (void *)((char *)new_block + sizeof(memory_block_header_t)); 
+  node = *link;
+  *link = header;
+  left_link = &get_free_tree_links(header)->left;
+  right_link = &get_free_tree_links(header)->right;
+  while (node != NULL) {
+    if (free_tree_less(node, header)) {
+      *left_link = node;
+      left_link = &get_free_tree_links(node)->right;
+      node = *left_link;
+    } else {
+      *right_link = node;
+      right_link = &get_free_tree_links(node)->left;
+      node = *right_link;
     }
   }
-  
-  
-  return NULL;
+  *left_link = NULL;
+  *right_link = NULL;
 }
 
-/* End of your helper functions */
-
-/* Start of the actual malloc/calloc/realloc/free functions */
+/* This function unlinks the free block described by header from the
+   tree, merging its two subtrees in its place. */
+static void remove_free_tree_block(memory_block_header_t *header) {
+  memory_block_header_t **link = &free_tree;
+  memory_block_header_t *left, *right;
 
-void __free_impl(void *);
+  while (*link != header) {
+    link = free_tree_less(header, *link) ?
+      &get_free_tree_links(*link)->left : &get_free_tree_links(*link)->right;
+  }
+  left = get_free_tree_links(header)->left;
+  right = get_free_tree_links(header)->right;
+  while ((left != NULL) && (right != NULL)) {
+    if (get_free_tree_priority(left) > get_free_tree_priority(right)) {
+      *link = left;
+      link = &get_free_tree_links(left)->right;
+      left = *link;
+    } else {
+      *link = right;
+      link = &get_free_tree_links(right)->left;
+      right = *link;
+    }
+  }
+  *link = (left != NULL) ? left : right;
+}
 
+/* This function finds the best fit for size bytes in the tree.
+   - Returns the header of the smallest, then lowest, block of at
+     least size bytes
+   - Returns NULL if the tree holds no such block */
+static memory_block_header_t *find_free_tree_block(size_t size) {
+  memory_block_header_t *node = free_tree, *best = NULL;
 
-void *__malloc_impl(size_t size) {
-  my_write(1, "HELLOOOOOOOOOOOO\n");
-  if (size == 0) {
-    /* If the size we want to allocate is zero, do nothing*/
-    return NULL;
+  while (node != NULL) {
+    if (node->size >= size) {
+      best = node;
+      node = get_free_tree_links(node)->left;
+    } else {
+      node = get_free_tree_links(node)->right;
+    }
   }
-  
-  return get_ptr_next_memory_fit(size);
+  return best;
 }
 
+/* This function links the free block described by header into
+   the head of its bin, or into the tree, and sets its boundary tag
+   in the next block. */
+static void insert_free_block(memory_block_header_t *header) {
+  size_t bin = header->size / MEMORY_ALIGNMENT;
+  free_block_links_t *links = get_free_block_links(header);
 
-void *__calloc_impl(size_t nmemb, size_t size) {
-  void *allocated_block;
-  size_t multiplication_result;
-  
-  /* Get total space we need by multiplying nmmeb and size */
-  if (__try_size_t_multiply(&multiplication_result, nmemb, size) == 0) {
-    printf("Failed at multiplying numbers of that size.\n");
-    return NULL;  
+  get_next_block(header)->prev_size = header->size;
+  heap_stats.free_block_count++;
+  heap_stats.free_block_bytes += header->size;
+  if (header->size > SMALL_BIN_MAX_SIZE) {
+    heap_stats.dirty_bytes += header->dirty_size;
+    insert_free_tree_block(header);
+    return;
   }
-  /* Multiplication was sucessful, now we know how much space to allocate*/
-  allocated_block = __malloc_impl(multiplication_result);
-  
-  if (allocated_block == NULL) {
-    printf("Unable to allocate memory using malloc");
-    return NULL;
+  links->prev_free = NULL;
+  links->next_free = free_bins[bin];
+  if (free_bins[bin] != NULL) {
+    get_free_block_links(free_bins[bin])->prev_free = header;
   }
-
-  /* Initialize every byte to zero */
-  __memset(allocated_block, 0, size);
-  return allocated_block;
+  free_bins[bin] = header;
+  free_bin_bitmap[bin / 64] |= 1ull << (bin % 64);
 }
 
+/* This function unlinks the free block described by header from
+   its bin or from the tree. */
+static void remove_free_block(memory_block_header_t *header) {
+  size_t bin = header->size / MEMORY_ALIGNMENT;
+  free_block_links_t *links = get_free_block_links(header);
 
-void *__realloc_impl(void *ptr, size_t size) {
-  void *new_ptr;
-  memory_block_header_t *header;
-  
-  /* If ptr is NULL, behaves like malloc(size) */
-  if (ptr == NULL) {
-    return __malloc_impl(size);
+  heap_stats.free_block_count--;
+  heap_stats.free_block_bytes -= header->size;
+  if (header->size > SMALL_BIN_MAX_SIZE) {
+    heap_stats.dirty_bytes -= header->dirty_size;
+    remove_free_tree_block(header);
+    return;
   }
-  
-  /* If size is 0, behaves like free(ptr) and returns NULL */
-  if (size == 0) {
-    free(ptr);
-    return NULL;
+  if (links->prev_free != NULL) {
+    get_free_block_links(links->prev_free)->next_free = links->next_free;
+  } else {
+    free_bins[bin] = links->next_free;
+    if (free_bins[bin] == NULL) {
+      free_bin_bitmap[bin / 64] &= ~(1ull << (bin % 64));
+    }
   }
-  
-  /* Look at the header struct that controls the current
-     memory block we want to free. */
-  header = (memory_block_header_t *)((char *)ptr - sizeof(memory_block_header_t));
-
-  if(header->size == size) {
-    /* If the reallocation size is the same as before, return
-       then original pointer */
-    return ptr;
+  if (links->next_free != NULL) {
+    get_free_block_links(links->next_free)->prev_free = links->prev_free;
   }
+}
 
-  if (header->size > size) {
-    /* Allocate a new memory block of the requested size */
-    new_ptr = __malloc_impl(size);
-    if (new_ptr == NULL) {
+/* This function finds the first non-empty bin with an index of at
+   least bin, using the bitmap.
+   - Returns the index of that bin
+   - Returns a value above SMALL_BIN_COUNT if all those bins are
+     empty */
+static size_t find_non_empty_bin(size_t bin) {
+  size_t word;
+  unsigned long long bits;
+
+  for (word = bin / 64; word < FREE_BIN_BITMAP_WORDS; word++) {
+    bits = free_bin_bitmap[word];
+    if (word == bin / 64) {
+      bits &= ~0ull << (bin % 64);
+    }
+    if (bits != 0ull) {
+      return word * 64 + ((size_t) __builtin_ctzll(bits));
+    }
+  }
+  return SMALL_BIN_COUNT + ((size_t) 1);
+}
+
+/* This function finds the best fit among the free blocks for size
+   bytes. For small sizes, that is the head of the first non-empty
+   bin from the exact one on; only if they are all empty is the tree
+   searched.
+   - Returns the header of the block, still linked into its bin or
+     the tree
+   - Returns NULL if there is no such free block */
+static memory_block_header_t *find_free_block(size_t size) {
+  size_t bin;
+
+  if (size <= SMALL_BIN_MAX_SIZE) {
+    bin = find_non_empty_bin(size / MEMORY_ALIGNMENT);
+    if (bin <= SMALL_BIN_COUNT) {
+      return free_bins[bin];
+    }
+  }
+  return find_free_tree_block(size);
+}
+
+
+/* When a block absorbs a free neighbour, the neighbour's header
+   and dirty bytes end up in the middle of its payload. Up to this
+   many bytes, they are zeroed rather than making all the payload up
+   to them dirty, so that fresh memory stays known to be zero when it
+   is split and coalesced again. */
+#define CLEAN_MERGE_MAX_SIZE ((size_t) 128)
+
+/* This function makes the block described by header absorb the
+   free block next_header that physically follows it and updates
+   dirty_size. next_header must already be unlinked from its bin.
+   The caller must hold memory_management_lock. */
+static void absorb_next_block(memory_block_header_t *header,
+			      memory_block_header_t *next_header) {
+  size_t next_size = next_header->size;
+  size_t next_dirty_size = sizeof(memory_block_header_t) + next_header->dirty_size;
+
+  if ((header->dirty_size < header->size) &&
+      (next_dirty_size <= CLEAN_MERGE_MAX_SIZE)) {
+    __memset((void *)next_header, 0, next_dirty_size);
+  } else {
+    header->dirty_size = header->size + next_dirty_size;
+  }
+  header->size += sizeof(memory_block_header_t) + next_size;
+}
+
+/* This function marks the free block start, already unlinked
+   from its bin, as allocated for desired_size bytes. We assume that
+   start->size >= desired_size. If the rest of the block can hold
+   another header, the rest is split off into a new free block that
+   goes into its own bin. */
+void make_header_and_allocate_memory(memory_block_header_t *start,
+				     size_t desired_size) {
+  memory_block_header_t *new_header;
+
+  if (check_enough_space_for_header_after_allocation(start, desired_size)) {
+    /* Figure out where the new header goes */
+    new_header = (memory_block_header_t *)((char *)start +
+					   sizeof(memory_block_header_t) + desired_size);
+
+    /* Initialize its attributes */
+    new_header->size = start->size - sizeof(memory_block_header_t) - desired_size;
+    new_header->prev_size = (size_t) 0;
+    new_header->is_free = 1;
+    new_header->is_mapped = 0;
+    new_header->dirty_size = sizeof(free_block_links_t);
+    if (start->dirty_size > desired_size + sizeof(memory_block_header_t) + sizeof(free_block_links_t)) {
+      new_header->dirty_size = start->dirty_size - desired_size - sizeof(memory_block_header_t);
+    }
+
+    start->size = desired_size; // Update size
+    insert_free_block(new_header);
+  } else {
+    get_next_block(start)->prev_size = (size_t) 0;
+  }
+  if (start->dirty_size > start->size) {
+    start->dirty_size = start->size;
+  }
+  start->is_free = 0;
+}
+
+
+/* This function returns the system's page size, asking the
+   system only once. */
+static size_t get_page_size() {
+  static size_t page_size = (size_t) 0;
+
+  if (page_size == ((size_t) 0)) {
+    page_size = (size_t) getpagesize();
+  }
+  return page_size;
+}
+
+/* This function rounds size up to the next multiple of the page size.
+   - Returns the rounded size
+   - Returns 0 if rounding up would overflow a size_t
+*/
+static size_t round_up_to_page(size_t size) {
+  size_t page_size = get_page_size();
+
+  if (size > ((size_t) -1) - (page_size - ((size_t) 1))) {
+    return (size_t) 0;
+  }
+  return (size + (page_size - ((size_t) 1))) & ~(page_size - ((size_t) 1));
+}
+
+/* Page map
+
+   A radix tree keyed by page number maps every page of memory we got
+   from the kernel to its owner: the arena it is part of, the header
+   of the dedicated mapping it belongs to, or its slab. The 36 bits
+   of page number of a 48-bit address are split into three levels of
+   PAGE_MAP_LEVEL_BITS bits; the root is static, the other nodes are
+   mapped when first needed and never unmapped, so that lookups take
+   three loads and no lock.
+
+   An entry holds the owner's address with the kind of owner in its
+   low bits, which are free as all owners are 16-byte aligned. Owners
+   set the entries of their pages before they hand out any of them
+   and clear them before they give them back, under whatever
+   protects the owner itself; nodes are added with a compare and
+   swap. So free can tell, at the cost of a lookup, whether a pointer
+   is ours at all.
+*/
+#define PAGE_MAP_PAGE_SHIFT 12
+#define PAGE_MAP_LEVEL_BITS 12
+#define PAGE_MAP_FANOUT (((size_t) 1) << PAGE_MAP_LEVEL_BITS)
+#define PAGE_MAP_ADDRESS_BITS 48
+#define PAGE_OWNER_KIND_MASK ((size_t) 3)
+
+typedef enum page_owner_kind {
+  PAGE_OWNER_NONE = 0,
+  PAGE_OWNER_ARENA,
+  PAGE_OWNER_MAPPED,
+  PAGE_OWNER_SLAB
+} page_owner_kind_t;
+
+typedef struct page_map_leaf {
+  size_t entries[PAGE_MAP_FANOUT];
+} page_map_leaf_t;
+
+typedef struct page_map_node {
+  page_map_leaf_t *leaves[PAGE_MAP_FANOUT];
+} page_map_node_t;
+
+static page_map_node_t *page_map_root[PAGE_MAP_FANOUT];
+
+/* This function returns the slot of *parent, making a zeroed node
+   of size bytes for it if there is none yet and create is set.
+   - Returns the node
+   - Returns NULL if there is none, or it could not be made */
+static void *get_page_map_node(void **parent, size_t size, int create) {
+  void *node, *expected;
+
+  node = __atomic_load_n(parent, __ATOMIC_ACQUIRE);
+  if ((node != NULL) || !create) {
+    return node;
+  }
+  node = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  stats_add(STATS_MMAP_CALLS, (size_t) 1);
+  if (node == MAP_FAILED) {
+    return NULL;
+  }
+  expected = NULL;
+  if (!__atomic_compare_exchange_n(parent, &expected, node, 0,
+				   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    /* Another thread was faster */
+    munmap(node, size);
+    stats_add(STATS_MUNMAP_CALLS, (size_t) 1);
+    node = expected;
+  }
+  return node;
+}
+
+/* This function returns the leaf of the page map that holds the
+   entry of page, making the nodes on the way if create is set.
+   - Returns NULL if there is no such leaf, or it could not be made */
+static page_map_leaf_t *get_page_map_leaf(size_t page, int create) {
+  page_map_node_t *node;
+
+  if ((page >> (PAGE_MAP_ADDRESS_BITS - PAGE_MAP_PAGE_SHIFT)) != ((size_t) 0)) {
+    return NULL;
+  }
+  node = (page_map_node_t *) get_page_map_node((void **) &page_map_root[page >> (((size_t) 2) * PAGE_MAP_LEVEL_BITS)],
+					       sizeof(page_map_node_t), create);
+  if (node == NULL) {
+    return NULL;
+  }
+  return (page_map_leaf_t *) get_page_map_node((void **) &node->leaves[(page >> PAGE_MAP_LEVEL_BITS) & (PAGE_MAP_FANOUT - ((size_t) 1))],
+					       sizeof(page_map_leaf_t), create);
+}
+
+/* This function makes owner, of kind kind, the owner of all pages
+   that overlap the length bytes at start; with owner NULL, these
+   pages no longer have any owner.
+   - Returns 1 on success
+   - Returns 0 if the page map could not be extended */
+static int set_page_owner(const void *start, size_t length, const void *owner,
+			  page_owner_kind_t kind) {
+  size_t page, last_page, entry;
+  page_map_leaf_t *leaf = NULL;
+
+  entry = (owner == NULL) ? ((size_t) 0) : (((size_t) owner) | ((size_t) kind));
+  page = ((size_t) start) >> PAGE_MAP_PAGE_SHIFT;
+  last_page = (((size_t) start) + length - ((size_t) 1)) >> PAGE_MAP_PAGE_SHIFT;
+  for (; page <= last_page; page++) {
+    if ((leaf == NULL) || ((page & (PAGE_MAP_FANOUT - ((size_t) 1))) == ((size_t) 0))) {
+      leaf = get_page_map_leaf(page, owner != NULL);
+      if (leaf == NULL) {
+	if (owner != NULL) return 0;
+	/* Nothing to clear in this leaf */
+	page |= PAGE_MAP_FANOUT - ((size_t) 1);
+	continue;
+      }
+    }
+    __atomic_store_n(&leaf->entries[page & (PAGE_MAP_FANOUT - ((size_t) 1))], entry, __ATOMIC_RELAXED);
+  }
+  return 1;
+}
+
+/* This function looks up the owner of the page ptr is in.
+   - Returns the kind of owner, and stores the owner in *owner
+   - Returns PAGE_OWNER_NONE if the page is not ours */
+static page_owner_kind_t get_page_owner(const void *ptr, void **owner) {
+  page_map_leaf_t *leaf;
+  size_t page = ((size_t) ptr) >> PAGE_MAP_PAGE_SHIFT;
+  size_t entry;
+
+  leaf = get_page_map_leaf(page, 0);
+  if (leaf == NULL) {
+    return PAGE_OWNER_NONE;
+  }
+  entry = __atomic_load_n(&leaf->entries[page & (PAGE_MAP_FANOUT - ((size_t) 1))], __ATOMIC_RELAXED);
+  *owner = (void *) (entry & ~PAGE_OWNER_KIND_MASK);
+  return (page_owner_kind_t) (entry & PAGE_OWNER_KIND_MASK);
+}
+
+/* This function returns the arena struct that follows the fence
+   described by fence. */
+static memory_arena_t *get_arena_of_fence(memory_block_header_t *fence) {
+  return (memory_arena_t *)((char *)fence + sizeof(memory_block_header_t));
+}
+
+/* This function returns the header of the first block of arena. */
+static memory_block_header_t *get_arena_first_block(memory_arena_t *arena) {
+  return (memory_block_header_t *)((char *)arena + sizeof(memory_arena_t) - arena->size);
+}
+
+/* This function maps length bytes, a multiple of HUGE_PAGE_SIZE,
+   aligned to HUGE_PAGE_SIZE and backed by huge pages as the huge
+   page mode says.
+   - Returns the mapping
+   - Returns NULL if mmap fails */
+static void *map_huge_pages(size_t length) {
+  void *memory;
+  size_t excess;
+
+  if (tunables[TUNABLE_HUGE_PAGES] == (size_t) HUGE_PAGES_HUGETLB) {
+    memory = mmap(NULL, length, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    stats_add(STATS_MMAP_CALLS, (size_t) 1);
+    if (memory != MAP_FAILED) {
+      return memory;
+    }
+  }
+
+  /* Map a huge page more than needed and give back what lies
+     outside of the aligned range */
+  if (length + HUGE_PAGE_SIZE < length) {
+    return NULL;
+  }
+  memory = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  stats_add(STATS_MMAP_CALLS, (size_t) 1);
+  if (memory == MAP_FAILED) {
+    return NULL;
+  }
+  excess = get_alignment_padding(memory, HUGE_PAGE_SIZE);
+  if (excess != ((size_t) 0)) {
+    munmap(memory, excess);
+    stats_add(STATS_MUNMAP_CALLS, (size_t) 1);
+  }
+  /* excess is below a huge page, so there is always a tail */
+  munmap((char *)memory + excess + length, HUGE_PAGE_SIZE - excess);
+  stats_add(STATS_MUNMAP_CALLS, (size_t) 1);
+  memory = (void *)((char *)memory + excess);
+  /* Without THP support, this is merely a hint that did not help */
+  madvise(memory, length, MADV_HUGEPAGE);
+  stats_add(STATS_MADVISE_CALLS, (size_t) 1);
+  return memory;
+}
+
+/* This function maps a new arena that can hold a block of at least
+   min_size bytes and turns all of it into a single free block,
+   followed by the arena's fence and the arena struct. The
+   arena is next_arena_size bytes long unless min_size needs more,
+   after which next_arena_size grows. In a huge page mode, big
+   arenas are rounded up to whole huge pages. The caller must hold
+   memory_management_lock.
+   - Returns the header of that block
+   - Returns NULL if mmap fails */
+static memory_block_header_t *map_new_arena(size_t min_size) {
+  void *memory;
+  memory_arena_t *arena;
+  memory_block_header_t *new_block, *fence;
+  size_t arena_size, needed_size, page_size;
+
+  needed_size = min_size + sizeof(memory_arena_t) + ((size_t) 2) * sizeof(memory_block_header_t);
+  if (needed_size < min_size) {
+    return NULL;
+  }
+  arena_size = next_arena_size;
+  if (arena_size < needed_size) {
+    arena_size = round_up_to_page(needed_size);
+    if (arena_size == ((size_t) 0)) {
+      return NULL;
+    }
+  }
+
+  page_size = get_page_size();
+  if ((arena_size >= HUGE_PAGE_SIZE) && (tunables[TUNABLE_HUGE_PAGES] != (size_t) HUGE_PAGES_OFF)) {
+    page_size = HUGE_PAGE_SIZE;
+    arena_size = (arena_size + HUGE_PAGE_SIZE - ((size_t) 1)) & ~(HUGE_PAGE_SIZE - ((size_t) 1));
+    if (arena_size == ((size_t) 0)) {
+      return NULL;
+    }
+    memory = map_huge_pages(arena_size);
+    if (memory == NULL) {
+      return NULL;
+    }
+  } else {
+    memory = mmap(NULL, arena_size, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    stats_add(STATS_MMAP_CALLS, (size_t) 1);
+    if (memory == MAP_FAILED) {
+      return NULL;
+    }
+  }
+  new_block = (memory_block_header_t *)memory;
+  arena = (memory_arena_t *)((char *)memory + arena_size - sizeof(memory_arena_t));
+  if (!set_page_owner(memory, arena_size, arena, PAGE_OWNER_ARENA)) {
+    set_page_owner(memory, arena_size, NULL, PAGE_OWNER_NONE);
+    munmap(memory, arena_size);
+    stats_add(STATS_MUNMAP_CALLS, (size_t) 1);
+    return NULL;
+  }
+  heap_stats.arena_count++;
+  heap_stats.arena_bytes += arena_size;
+  if (page_size == HUGE_PAGE_SIZE) {
+    heap_stats.huge_arena_bytes += arena_size;
+  }
+
+  if (next_arena_size < ARENA_MAX_SIZE) {
+    next_arena_size *= tunables[TUNABLE_ARENA_GROWTH];
+    if (next_arena_size > ARENA_MAX_SIZE) {
+      next_arena_size = ARENA_MAX_SIZE;
+    }
+  }
+
+  new_block->prev_size = (size_t) 0;
+  new_block->size = arena_size - sizeof(memory_arena_t) - ((size_t) 2) * sizeof(memory_block_header_t);
+  new_block->is_free = 1;
+  new_block->is_mapped = 0;
+  new_block->dirty_size = sizeof(free_block_links_t);
+
+  fence = get_next_block(new_block);
+  fence->prev_size = new_block->size;
+  fence->size = (size_t) 0;
+  fence->is_free = 0;
+  fence->is_mapped = 0;
+  fence->dirty_size = (size_t) 0;
+
+  arena = get_arena_of_fence(fence);
+  arena->size = arena_size;
+  arena->page_size = page_size;
+  arena->is_free = 0;
+  arena->free_epoch = 0u;
+  arena->prev = NULL;
+  arena->next = arena_list;
+  if (arena_list != NULL) {
+    arena_list->prev = arena;
+  }
+  arena_list = arena;
+  return new_block;
+}
+
+/* This function unmaps arena, which must be entirely free and no
+   longer marked as such, after unlinking it from the list of arenas
+   and its only block from its bin. The arena struct lives inside the
+   mapping, so it must not be touched once munmap has succeeded. The
+   caller must hold memory_management_lock.
+   - Returns 1 if the arena has been unmapped
+   - Returns 0 if munmap failed, in which case nothing changed */
+static int unmap_arena(memory_arena_t *arena) {
+  memory_block_header_t *block = get_arena_first_block(arena);
+  size_t arena_size, page_size;
+
+  remove_free_block(block);
+  if (arena->prev != NULL) {
+    arena->prev->next = arena->next;
+  } else {
+    arena_list = arena->next;
+  }
+  if (arena->next != NULL) {
+    arena->next->prev = arena->prev;
+  }
+  arena_size = arena->size;
+  page_size = arena->page_size;
+  set_page_owner(block, arena_size, NULL, PAGE_OWNER_NONE);
+  stats_add(STATS_MUNMAP_CALLS, (size_t) 1);
+  if (munmap((void *)block, arena_size) == 0) {
+    heap_stats.arena_count--;
+    heap_stats.arena_bytes -= arena_size;
+    if (page_size == HUGE_PAGE_SIZE) {
+      heap_stats.huge_arena_bytes -= arena_size;
+    }
+    return 1;
+  }
+  set_page_owner(block, arena_size, arena, PAGE_OWNER_ARENA);
+
+  arena->prev = NULL;
+  arena->next = arena_list;
+  if (arena_list != NULL) {
+    arena_list->prev = arena;
+  }
+  arena_list = arena;
+  insert_free_block(block);
+  return 0;
+}
+
+/* This function returns the time of the monotonic clock in ns,
+   read with the cheap, coarse-grained variant as we only need
+   it to the millisecond. */
+static unsigned long long get_time_ns() {
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) != 0) {
+    return 0ull;
+  }
+  return ((unsigned long long) ts.tv_sec) * 1000000000ull + ((unsigned long long) ts.tv_nsec);
+}
+
+/* This function gives the whole dirty pages inside the free block
+   described by header back to the kernel with
+   madvise(MADV_DONTNEED), in pages of its arena's page size. The
+   pages holding the header and the bin links stay, as do the
+   partial pages at either end. The dirty bytes
+   after the last released page are zeroed by hand, so that
+   everything from the first released page on is known to be zero.
+   The caller must hold memory_management_lock.
+   - Returns the number of bytes released */
+static size_t purge_free_block(memory_block_header_t *header) {
+  char *payload = (char *)header + sizeof(memory_block_header_t);
+  size_t page_size = get_page_size();
+  size_t start, end, dirty_end;
+  void *arena;
+
+  if (get_page_owner(header, &arena) == PAGE_OWNER_ARENA) {
+    page_size = ((memory_arena_t *) arena)->page_size;
+  }
+
+  start = (((size_t) payload) + sizeof(free_block_links_t) + page_size - ((size_t) 1)) & ~(page_size - ((size_t) 1));
+  dirty_end = ((size_t) payload) + header->dirty_size;
+  end = (((size_t) payload) + header->size) & ~(page_size - ((size_t) 1));
+  if (dirty_end < end) {
+    end = (dirty_end + page_size - ((size_t) 1)) & ~(page_size - ((size_t) 1));
+  }
+  if (end <= start) {
+    return (size_t) 0;
+  }
+  stats_add(STATS_MADVISE_CALLS, (size_t) 1);
+  if (madvise((void *) start, end - start, MADV_DONTNEED) != 0) {
+    return (size_t) 0;
+  }
+  heap_stats.purged_bytes += end - start;
+  if (dirty_end > end) {
+    __memset((void *) end, 0, dirty_end - end);
+  }
+  heap_stats.dirty_bytes -= header->dirty_size - (start - ((size_t) payload));
+  header->dirty_size = start - ((size_t) payload);
+  return end - start;
+}
+
+/* This function purges the free blocks of at least a page in the
+   subtree of the tree rooted at node. Blocks on the left of a block
+   smaller than a page are smaller still, and are skipped. The
+   caller must hold memory_management_lock.
+   - Returns the number of bytes released */
+static size_t purge_free_tree(memory_block_header_t *node) {
+  size_t released = (size_t) 0;
+
+  for (; node != NULL; node = get_free_tree_links(node)->right) {
+    if (node->size >= get_page_size()) {
+      released += purge_free_tree(get_free_tree_links(node)->left);
+      released += purge_free_block(node);
+    }
+  }
+  return released;
+}
+
+/* This function purges the free blocks of at least a page in the
+   subtree of the tree rooted at node, biggest first, until at least
+   bytes bytes have been released. The caller must hold
+   memory_management_lock.
+   - Returns the number of bytes released */
+static size_t purge_free_tree_bytes(memory_block_header_t *node, size_t bytes) {
+  size_t released = (size_t) 0;
+
+  while ((node != NULL) && (released < bytes)) {
+    released += purge_free_tree_bytes(get_free_tree_links(node)->right, bytes - released);
+    if ((released >= bytes) || (node->size < get_page_size())) {
+      break;
+    }
+    released += purge_free_block(node);
+    node = get_free_tree_links(node)->left;
+  }
+  return released;
+}
+
+/* This function unmaps the entirely free arenas beyond keep_bytes
+   bytes of them: with force set, all of them, otherwise only those
+   that have been free since the previous pass. The caller must hold
+   memory_management_lock.
+   - Returns the number of bytes released */
+static size_t unmap_free_arenas(size_t keep_bytes, int force) {
+  memory_arena_t *arena, *next_arena;
+  size_t arena_size, released = (size_t) 0;
+
+  for (arena = arena_list; arena != NULL; arena = next_arena) {
+    next_arena = arena->next;
+    if (arena->is_free &&
+	(force || (arena->free_epoch != purge_epoch)) &&
+	(free_arena_bytes > keep_bytes)) {
+      arena_size = arena->size;
+      arena->is_free = 0;
+      free_arena_bytes -= arena_size;
+      if (unmap_arena(arena)) {
+	released += arena_size;
+      } else {
+	arena->is_free = 1;
+	free_arena_bytes += arena_size;
+      }
+    }
+  }
+  return released;
+}
+
+/* This function runs a purge pass, as described above. keep_bytes
+   and force are as for unmap_free_arenas. The caller must hold
+   memory_management_lock.
+   - Returns 1 if any memory was given back to the kernel
+   - Returns 0 otherwise */
+static int purge_dirty_memory(size_t keep_bytes, int force) {
+  size_t released;
+
+  released = unmap_free_arenas(keep_bytes, force);
+  released += purge_free_tree(free_tree);
+
+  purge_epoch++;
+  next_purge_time = get_time_ns() + ((unsigned long long) tunables[TUNABLE_DECAY_MS]) * 1000000ull;
+  return (released > ((size_t) 0));
+}
+
+/* This function is called when release_memory_block has produced
+   the free block described by header, at least a page long. If that
+   block now makes up its whole arena, the arena is marked as free,
+   and unmapped right away if that takes the free arenas beyond
+   the trim threshold. If the purge interval has elapsed, a purge
+   pass runs; without any interval, the block is purged. All of this
+   is left to the background thread if it runs. The caller must hold
+   memory_management_lock. */
+static void release_dirty_memory(memory_block_header_t *header) {
+  memory_block_header_t *fence = get_next_block(header);
+  memory_arena_t *arena;
+  int background = is_background_thread_running();
+
+  if ((fence->size == ((size_t) 0)) && (header->prev_size == ((size_t) 0))) {
+    arena = get_arena_of_fence(fence);
+    if (get_arena_first_block(arena) == header) {
+      if (background ||
+	  (free_arena_bytes + arena->size <= tunables[TUNABLE_TRIM_THRESHOLD]) ||
+	  !unmap_arena(arena)) {
+	arena->is_free = 1;
+	arena->free_epoch = purge_epoch;
+	free_arena_bytes += arena->size;
+      } else {
+	/* The block went with its arena */
+	header = NULL;
+      }
+    }
+  }
+  if (background) {
+    return;
+  }
+  if (tunables[TUNABLE_DECAY_MS] == ((size_t) 0)) {
+    if (header != NULL) {
+      purge_free_block(header);
+    }
+  } else if (get_time_ns() >= next_purge_time) {
+    purge_dirty_memory(tunables[TUNABLE_TRIM_THRESHOLD], 0);
+  }
+}
+
+/* This function is called when the free block described by header
+   is about to be allocated, or absorbed into an allocated block. If
+   it makes up its whole arena, that arena is no longer free. The
+   caller must hold memory_management_lock. */
+static void claim_free_block(memory_block_header_t *header) {
+  memory_block_header_t *fence = get_next_block(header);
+  memory_arena_t *arena;
+
+  if (fence->size == ((size_t) 0)) {
+    arena = get_arena_of_fence(fence);
+    if (arena->is_free) {
+      arena->is_free = 0;
+      free_arena_bytes -= arena->size;
+    }
+  }
+}
+
+/* This function gives a block of size bytes its own dedicated
+   mapping, with its payload aligned to alignment, a power of two. A
+   mapping starts on a page boundary, so for alignments up to the
+   page size, the header is just pushed forward from the start of the
+   mapping; the distance, its lead, is kept in prev_size. Larger
+   alignments are obtained by mapping alignment - page size bytes
+   more and unmapping the slack on both sides again, so they cost
+   address space only for a moment. The whole mapping minus the lead
+   and the header is usable. No lock is needed as such a block never
+   shares anything with the heap.
+   - Returns a ptr to the usable memory of the block
+   - Returns NULL if mmap fails */
+static void *map_large_block(size_t size, size_t alignment) {
+  void *memory;
+  memory_block_header_t *header;
+  size_t length, lead, slack, excess;
+  void *payload;
+
+  lead = (size_t) 0;
+  slack = (size_t) 0;
+  if (alignment > get_page_size()) {
+    lead = get_page_size() - sizeof(memory_block_header_t);
+    slack = alignment - get_page_size();
+  } else if (alignment > sizeof(memory_block_header_t)) {
+    lead = alignment - sizeof(memory_block_header_t);
+  }
+  if (size > ((size_t) -1) - sizeof(memory_block_header_t) - lead - slack) {
+    return NULL;
+  }
+  length = round_up_to_page(lead + sizeof(memory_block_header_t) + size);
+  if ((length == ((size_t) 0)) || (length + slack < length)) {
+    return NULL;
+  }
+
+  memory = mmap(NULL, length + slack, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  stats_add(STATS_MMAP_CALLS, (size_t) 1);
+  if (memory == MAP_FAILED) {
+    return NULL;
+  }
+  if (slack != ((size_t) 0)) {
+    /* Give back the slack in front of the first page whose payload
+       is aligned, and whatever is left behind the block. */
+    payload = (char *)memory + lead + sizeof(memory_block_header_t);
+    excess = get_alignment_padding(payload, alignment);
+    if (excess != ((size_t) 0)) {
+      munmap(memory, excess);
+      stats_add(STATS_MUNMAP_CALLS, (size_t) 1);
+    }
+    if (excess != slack) {
+      munmap((char *)memory + excess + length, slack - excess);
+      stats_add(STATS_MUNMAP_CALLS, (size_t) 1);
+    }
+    memory = (void *)((char *)memory + excess);
+  }
+  header = (memory_block_header_t *)((char *)memory + lead);
+  if (!set_page_owner(memory, length, header, PAGE_OWNER_MAPPED)) {
+    set_page_owner(memory, length, NULL, PAGE_OWNER_NONE);
+    munmap(memory, length);
+    stats_add(STATS_MUNMAP_CALLS, (size_t) 1);
+    return NULL;
+  }
+  stats_add(STATS_MAPPED_BLOCKS, (size_t) 1);
+  stats_add(STATS_MAPPED_BYTES, length);
+
+  header->size = length - lead - sizeof(memory_block_header_t);
+  header->is_free = 0;
+  header->is_mapped = 1;
+  header->prev_size = lead;
+  header->dirty_size = (size_t) 0;
+  return (void *)((char *)header + sizeof(memory_block_header_t));
+}
+
+/* This function unmaps the dedicated mapping of the block described
+   by header. If munmap fails, the mapping is simply leaked. */
+static void unmap_large_block(memory_block_header_t *header) {
+  size_t length = header->prev_size + sizeof(memory_block_header_t) + header->size;
+  void *memory = (void *)((char *)header - header->prev_size);
+
+  set_page_owner(memory, length, NULL, PAGE_OWNER_NONE);
+  stats_add(STATS_MUNMAP_CALLS, (size_t) 1);
+  if (munmap(memory, length) == 0) {
+    stats_add(STATS_MAPPED_BLOCKS, (size_t) -1);
+    stats_add(STATS_MAPPED_BYTES, -length);
+  }
+}
+
+/* This function pushes the allocated arena block at ptr onto
+   heap_remote_free, without any lock. */
+static void push_remote_block(void *ptr) {
+  void *head;
+
+  stats_add(STATS_REMOTE_FREES, (size_t) 1);
+  head = __atomic_load_n(&heap_remote_free, __ATOMIC_RELAXED);
+  do {
+    *((void **) ptr) = head;
+  } while (!__atomic_compare_exchange_n(&heap_remote_free, &head, ptr, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void release_memory_block(memory_block_header_t *header);
+
+/* This function frees all blocks on heap_remote_free. The caller
+   must hold memory_management_lock.
+   - Returns 1 if there were any, 0 otherwise */
+static int drain_remote_blocks() {
+  void *ptr, *next_ptr;
+
+  if (__atomic_load_n(&heap_remote_free, __ATOMIC_RELAXED) == NULL) {
+    return 0;
+  }
+  ptr = __atomic_exchange_n(&heap_remote_free, NULL, __ATOMIC_ACQUIRE);
+  for (; ptr != NULL; ptr = next_ptr) {
+    next_ptr = *((void **) ptr);
+    release_memory_block((memory_block_header_t *)((char *)ptr - sizeof(memory_block_header_t)));
+  }
+  return 1;
+}
+
+/*
+  This function returns a ptr to a block of memory
+  of size 'size'. The caller must hold memory_management_lock.
+   - It allocates new memory using mmap if no bin holds a free
+     block of that size.
+   - Otherwise, it returns a ptr to the free block found by
+     find_free_block, split down to the size requested.
+*/
+void *get_ptr_next_memory_fit(size_t size) {
+  memory_block_header_t *block;
+
+  block = find_free_block(size);
+  if ((block == NULL) && drain_remote_blocks()) {
+    block = find_free_block(size);
+  }
+  if (block == NULL) {
+    /* No bin holds a block of the size we were asked for, so
+       we need to allocate a fresh arena. */
+    block = map_new_arena(size);
+    if (block == NULL) {
+      return NULL;
+    }
+    if (block->size < size) {
+      /* The arena stays available as a free block */
+      insert_free_block(block);
+      return NULL;
+    }
+  } else {
+    remove_free_block(block);
+    claim_free_block(block);
+  }
+  make_header_and_allocate_memory(block, size);
+  return (void *)((char *)block + sizeof(memory_block_header_t)); // Do not include the header
+}
+
+/* This function marks the block described by header as free,
+   coalesces it with its physical neighbours when they are free, and
+   puts the result into its bin. Both neighbours are found through
+   the boundary tags, so this takes constant time. The caller must
+   hold memory_management_lock. */
+static void release_memory_block(memory_block_header_t *header) {
+  memory_block_header_t *prev_header, *next_header;
+
+  /* Free chunk of memory by setting its header is_free
+     attribute to 1. All of it may have been written to. */
+  header->is_free = 1;
+  header->dirty_size = header->size;
+
+  /* Check next header: if it is free, we must merge the two
+     blocks to create one big block. The fence at the end of the
+     arena is never free. */
+  next_header = get_next_block(header);
+  if (next_header->is_free) {
+    remove_free_block(next_header);
+    absorb_next_block(header, next_header);
+  }
+
+  /* Check previous header: its boundary tag tells whether it
+     is free and where it starts. */
+  prev_header = get_prev_free_block(header);
+  if (prev_header != NULL) {
+    remove_free_block(prev_header);
+    absorb_next_block(prev_header, header);
+    header = prev_header;
+  }
+  insert_free_block(header);
+
+  if (header->size >= get_page_size()) {
+    release_dirty_memory(header);
+  }
+}
+
+
+/* This function shrinks the allocated block described by header
+   to size bytes in place, by splitting off its tail as a new free
+   block that is coalesced with the following block if that one is
+   free. Nothing happens if the tail cannot hold a header. The
+   caller must hold memory_management_lock. */
+static void shrink_memory_block(memory_block_header_t *header, size_t size) {
+  memory_block_header_t *tail, *next_header;
+
+  if (!check_enough_space_for_header_after_allocation(header, size)) {
+    return;
+  }
+  tail = (memory_block_header_t *)((char *)header + sizeof(memory_block_header_t) + size);
+  tail->prev_size = (size_t) 0;
+  tail->size = header->size - sizeof(memory_block_header_t) - size;
+  tail->is_free = 1;
+  tail->is_mapped = 0;
+  tail->dirty_size = tail->size;
+  header->size = size;
+
+  next_header = get_next_block(tail);
+  if (next_header->is_free) {
+    remove_free_block(next_header);
+    absorb_next_block(tail, next_header);
+  }
+  insert_free_block(tail);
+}
+
+/* This function tries to grow the allocated block described by
+   header to size bytes in place, by absorbing the free block that
+   physically follows it. Whatever is absorbed beyond size is split
+   off again. The caller must hold memory_management_lock.
+   - Returns 1 if the block has been grown
+   - Returns 0 if the following block is not free or too small */
+static int grow_memory_block(memory_block_header_t *header, size_t size) {
+  memory_block_header_t *next_header = get_next_block(header);
+
+  if (!next_header->is_free ||
+      (header->size + sizeof(memory_block_header_t) + next_header->size < size)) {
+    return 0;
+  }
+  remove_free_block(next_header);
+  absorb_next_block(header, next_header);
+  get_next_block(header)->prev_size = (size_t) 0;
+  shrink_memory_block(header, size);
+  return 1;
+}
+
+/* This function returns a ptr to a block of memory of size bytes
+   whose payload is aligned to alignment, a power of two larger than
+   MEMORY_ALIGNMENT. A free block big enough for any placement of the
+   payload is taken; the bytes in front of the aligned payload are
+   split off as a free block of their own, and so is the tail behind
+   it, so nothing but headers is lost to the alignment. The caller
+   must hold memory_management_lock.
+   - Returns NULL if no memory could be obtained */
+static void *get_ptr_aligned_memory_fit(size_t size, size_t alignment) {
+  memory_block_header_t *header, *aligned_header;
+  size_t lead, padded_size;
+  void *ptr;
+
+  padded_size = size + alignment + sizeof(memory_block_header_t) + MEMORY_ALIGNMENT;
+  if (padded_size < size) {
+    return NULL;
+  }
+  ptr = get_ptr_next_memory_fit(padded_size);
+  if (ptr == NULL) {
+    return NULL;
+  }
+  header = (memory_block_header_t *)((char *)ptr - sizeof(memory_block_header_t));
+  if (get_alignment_padding(ptr, alignment) == ((size_t) 0)) {
+    shrink_memory_block(header, size);
+    return ptr;
+  }
+
+  /* The front part must be able to hold a free block, so the
+     aligned header goes at least one minimal block further. */
+  lead = sizeof(memory_block_header_t) + MEMORY_ALIGNMENT;
+  lead += get_alignment_padding((char *)ptr + lead, alignment);
+  aligned_header = (memory_block_header_t *)((char *)ptr + lead - sizeof(memory_block_header_t));
+  aligned_header->size = header->size - lead;
+  aligned_header->is_free = 0;
+  aligned_header->is_mapped = 0;
+  aligned_header->dirty_size = (size_t) 0;
+  if (header->dirty_size > lead) {
+    aligned_header->dirty_size = header->dirty_size - lead;
+  }
+
+  header->size = lead - sizeof(memory_block_header_t);
+  header->is_free = 1;
+  if (header->dirty_size > header->size) {
+    header->dirty_size = header->size;
+  }
+  if (header->dirty_size < sizeof(free_block_links_t)) {
+    header->dirty_size = sizeof(free_block_links_t);
+  }
+  insert_free_block(header);
+
+  shrink_memory_block(aligned_header, size);
+  return (void *)((char *)aligned_header + sizeof(memory_block_header_t));
+}
+
+/* This function resizes the dedicated mapping of the block
+   described by header so that it holds size bytes. The kernel may
+   move the mapping, but it does so by remapping pages, never by
+   copying them.
+   - Returns a ptr to the usable memory of the resized block
+   - Returns NULL if mremap fails, in which case the block is
+     left untouched */
+static void *remap_large_block(memory_block_header_t *header, size_t size) {
+  void *memory, *new_memory;
+  size_t lead, old_length, new_length;
+
+  lead = header->prev_size;
+  if (size > ((size_t) -1) - sizeof(memory_block_header_t) - lead) {
+    return NULL;
+  }
+  new_length = round_up_to_page(lead + sizeof(memory_block_header_t) + size);
+  if (new_length == ((size_t) 0)) {
+    return NULL;
+  }
+  old_length = lead + sizeof(memory_block_header_t) + header->size;
+  if (new_length != old_length) {
+    /* The pages are unowned while the kernel may move them */
+    memory = (void *)((char *)header - lead);
+    set_page_owner(memory, old_length, NULL, PAGE_OWNER_NONE);
+    new_memory = mremap(memory, old_length, new_length, MREMAP_MAYMOVE);
+    stats_add(STATS_MREMAP_CALLS, (size_t) 1);
+    if (new_memory == MAP_FAILED) {
+      set_page_owner(memory, old_length, header, PAGE_OWNER_MAPPED);
+      return NULL;
+    }
+    stats_add(STATS_MAPPED_BYTES, new_length - old_length);
+    header = (memory_block_header_t *)((char *)new_memory + lead);
+    header->size = new_length - lead - sizeof(memory_block_header_t);
+    /* Should this fail, free will not recognize the block and
+       leak it, but it can still be used */
+    set_page_owner(new_memory, new_length, header, PAGE_OWNER_MAPPED);
+  }
+  return (void *)((char *)header + sizeof(memory_block_header_t));
+}
+
+
+/* Slabs
+
+   Objects of up to SLAB_MAX_OBJECT_SIZE bytes do not live in
+   arenas but in slabs: SLAB_SIZE-byte runs of same-sized objects
+   without any per-object header. A 16-byte object thus takes 16
+   bytes instead of 48, and neighbouring objects share cache lines.
+
+   All slabs are carved out of one region of address space, reserved
+   with PROT_NONE at the first small allocation and made accessible
+   SLAB_COMMIT_SIZE bytes at a time as slabs are needed. Slabs are
+   aligned to SLAB_SIZE within it. So whether a pointer is an object
+   is decided by a range check, and its slab is found by masking the
+   pointer, without touching the object itself.
+
+   The memory_slab_t descriptor sits at the start of its slab. Its
+   bitmap has a set bit for every free object. The objects follow
+   the descriptor, starting at a multiple of the largest power of two
+   dividing the object size, so that the objects of a power-of-two
+   class are naturally aligned; aligned requests of up to
+   SLAB_MAX_OBJECT_SIZE bytes use this.
+
+   Slabs with free objects are linked into the partial list of their
+   class. A slab whose objects are all free goes onto the empty list,
+   from which any class can take it; beyond the trim_threshold
+   tunable's bytes of empty slabs, their pages but the first are
+   given back with madvise(MADV_DONTNEED).
+
+   Objects are not handed to the program directly: they go through
+   the thread caches below, which are refilled from the slabs under
+   slab_lock. If the region cannot be reserved or is exhausted, small
+   requests fall back to arena blocks.
+
+   Objects flushed from a per-CPU cache do not take slab_lock: they
+   are pushed onto their slab's remote_free list with a compare and
+   swap. The push that makes that list non-empty also pushes the slab
+   onto the pending list of its class. Whoever next refills a cache
+   of that class, or flushes a thread cache of it, holding slab_lock
+   and thus the only consumer, takes the whole pending list with an
+   exchange and gives every object on its slabs' lists back to the
+   bitmaps in one batch. As both lists are only ever pushed to or
+   taken as a whole, they need no protection against ABA.
+*/
+#define SLAB_SIZE ((size_t) (64 * 1024))
+#define SLAB_MAX_OBJECT_SIZE ((size_t) 512)
+#define SLAB_CLASS_COUNT (SLAB_MAX_OBJECT_SIZE / MEMORY_ALIGNMENT + ((size_t) 1))
+#define SLAB_BITMAP_WORDS (SLAB_SIZE / MEMORY_ALIGNMENT / ((size_t) 64))
+#define SLAB_REGION_SIZE (((size_t) 32) * ((size_t) 1024) * ((size_t) 1024) * ((size_t) 1024))
+#define SLAB_COMMIT_SIZE ((size_t) (1024 * 1024))
+
+typedef struct memory_slab {
+  size_t object_size;
+  size_t object_count;
+  size_t free_count;
+  size_t first_free_word;
+  char *objects;
+  struct memory_slab *next;
+  struct memory_slab *prev;
+  unsigned long long bitmap[SLAB_BITMAP_WORDS];
+  /* Written by other threads, hence on a cache line of their own */
+  void *remote_free __attribute__((aligned(64)));
+  struct memory_slab *next_pending;
+} memory_slab_t;
+
+/* Slab statistics, kept under slab_lock */
+typedef struct memory_slab_stats {
+  size_t slab_count;
+  size_t slab_bytes;
+  size_t empty_slab_count;
+  size_t free_object_count;
+  size_t free_object_bytes;
+  size_t purged_bytes;
+  size_t released_bytes;
+} memory_slab_stats_t;
+
+/* This lock protects the slabs, the partial and empty lists and
+   slab_stats. It is independent of memory_management_lock. */
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Start of the region, read without the lock, and how much of it
+   is carved into slabs and accessible */
+static char *slab_region = NULL;
+static size_t slab_region_used = (size_t) 0;
+static size_t slab_region_committed = (size_t) 0;
+static int slab_region_failed = 0;
+
+static memory_slab_t *slab_partial[SLAB_CLASS_COUNT];
+static memory_slab_t *slab_pending[SLAB_CLASS_COUNT];
+static memory_slab_t *slab_empty = NULL;
+static size_t slab_empty_dirty_bytes = (size_t) 0;
+static memory_slab_stats_t slab_stats;
+
+/* This function tells whether ptr points into the slab region.
+   - Returns 1 if ptr is a slab object, 0 otherwise */
+static int is_slab_object(const void *ptr) {
+  char *region = __atomic_load_n(&slab_region, __ATOMIC_RELAXED);
+
+  return ((region != NULL) &&
+	  (((size_t) ((const char *)ptr - region)) < SLAB_REGION_SIZE));
+}
+
+/* This function returns the slab the object at ptr belongs to. */
+static memory_slab_t *get_slab(const void *ptr) {
+  return (memory_slab_t *)(slab_region + ((((size_t) ((const char *)ptr - slab_region))) &
+					  ~(SLAB_SIZE - ((size_t) 1))));
+}
+
+/* This function unlinks slab from the list starting at *list. */
+static void unlink_slab(memory_slab_t **list, memory_slab_t *slab) {
+  if (slab->prev != NULL) {
+    slab->prev->next = slab->next;
+  } else {
+    *list = slab->next;
+  }
+  if (slab->next != NULL) {
+    slab->next->prev = slab->prev;
+  }
+}
+
+/* This function links slab into the head of the list starting at
+   *list. */
+static void link_slab(memory_slab_t **list, memory_slab_t *slab) {
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list != NULL) {
+    (*list)->prev = slab;
+  }
+  *list = slab;
+}
+
+/* This function reserves the slab region. The caller must hold
+   slab_lock.
+   - Returns 1 on success, 0 if no region could be reserved */
+static int reserve_slab_region() {
+  void *memory;
+  char *region;
+
+  if (slab_region != NULL) return 1;
+  if (slab_region_failed) return 0;
+  memory = mmap(NULL, SLAB_REGION_SIZE + SLAB_SIZE, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  stats_add(STATS_MMAP_CALLS, (size_t) 1);
+  if (memory == MAP_FAILED) {
+    slab_region_failed = 1;
+    return 0;
+  }
+  region = (char *)memory + get_alignment_padding(memory, SLAB_SIZE);
+  __atomic_store_n(&slab_region, region, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/* This function makes slab, whose memory is accessible, a slab of
+   objects of object_size bytes that are all free. */
+static void init_slab(memory_slab_t *slab, size_t object_size) {
+  size_t alignment, offset, i;
+
+  alignment = object_size & -object_size;
+  offset = (sizeof(memory_slab_t) + alignment - ((size_t) 1)) & ~(alignment - ((size_t) 1));
+  slab->object_size = object_size;
+  slab->object_count = (SLAB_SIZE - offset) / object_size;
+  slab->free_count = slab->object_count;
+  slab->first_free_word = (size_t) 0;
+  slab->objects = (char *)slab + offset;
+  for (i=(size_t) 0; i<SLAB_BITMAP_WORDS; i++) {
+    if (((i + ((size_t) 1)) * ((size_t) 64)) <= slab->object_count) {
+      slab->bitmap[i] = ~0ull;
+    } else if ((i * ((size_t) 64)) < slab->object_count) {
+      slab->bitmap[i] = (1ull << (slab->object_count % ((size_t) 64))) - 1ull;
+    } else {
+      slab->bitmap[i] = 0ull;
+    }
+  }
+  slab_stats.free_object_count += slab->object_count;
+  slab_stats.free_object_bytes += slab->object_count * object_size;
+}
+
+/* This function gets a slab for objects of object_size bytes, from
+   the empty list or else from the region. The caller must hold
+   slab_lock.
+   - Returns the slab, linked into the partial list of its class
+   - Returns NULL if no slab could be made */
+static memory_slab_t *new_slab(size_t object_size) {
+  memory_slab_t *slab;
+
+  if (slab_empty != NULL) {
+    slab = slab_empty;
+    unlink_slab(&slab_empty, slab);
+    slab_stats.empty_slab_count--;
+    if (slab->object_size != ((size_t) 0)) {
+      slab_empty_dirty_bytes -= SLAB_SIZE;
+    } else {
+      slab_stats.released_bytes -= SLAB_SIZE - get_page_size();
+    }
+    slab_stats.free_object_count -= slab->free_count;
+    slab_stats.free_object_bytes -= slab->free_count * slab->object_size;
+  } else {
+    if (!reserve_slab_region() || (slab_region_used == SLAB_REGION_SIZE)) {
+      return NULL;
+    }
+    if (slab_region_used == slab_region_committed) {
+      if (mprotect(slab_region + slab_region_committed, SLAB_COMMIT_SIZE,
+		   PROT_READ | PROT_WRITE) != 0) {
+	return NULL;
+      }
+      slab_region_committed += SLAB_COMMIT_SIZE;
+    }
+    slab = (memory_slab_t *)(slab_region + slab_region_used);
+    if (!set_page_owner(slab, SLAB_SIZE, slab, PAGE_OWNER_SLAB)) {
+      return NULL;
+    }
+    slab_region_used += SLAB_SIZE;
+    slab_stats.slab_count++;
+    slab_stats.slab_bytes += SLAB_SIZE;
+  }
+  init_slab(slab, object_size);
+  link_slab(&slab_partial[object_size / MEMORY_ALIGNMENT], slab);
+  return slab;
+}
+
+/* This function takes up to count free objects of object_size
+   bytes out of the slabs and stores them in objects. The caller
+   must hold slab_lock.
+   - Returns the number of objects taken */
+static size_t take_slab_objects(size_t object_size, void **objects, size_t count) {
+  memory_slab_t *slab;
+  size_t taken = (size_t) 0, word, bit;
+
+  while (taken < count) {
+    slab = slab_partial[object_size / MEMORY_ALIGNMENT];
+    if (slab == NULL) {
+      slab = new_slab(object_size);
+      if (slab == NULL) break;
+    }
+    while ((taken < count) && (slab->free_count > ((size_t) 0))) {
+      word = slab->first_free_word;
+      while (slab->bitmap[word] == 0ull) word++;
+      bit = (size_t) __builtin_ctzll(slab->bitmap[word]);
+      slab->bitmap[word] &= slab->bitmap[word] - 1ull;
+      slab->first_free_word = word;
+      slab->free_count--;
+      objects[taken++] = slab->objects + (word * ((size_t) 64) + bit) * object_size;
+    }
+    if (slab->free_count == ((size_t) 0)) {
+      unlink_slab(&slab_partial[object_size / MEMORY_ALIGNMENT], slab);
+    }
+  }
+  slab_stats.free_object_count -= taken;
+  slab_stats.free_object_bytes -= taken * object_size;
+  return taken;
+}
+
+/* This function gives the pages of the empty slab back to the
+   kernel, all but the first, which holds the descriptor and thus
+   the links of the empty list. Until the slab is used again, those
+   pages count in released_bytes rather than as part of the heap.
+   The caller must hold slab_lock.
+   - Returns 1 if the pages were given back, 0 otherwise */
+static int purge_empty_slab(memory_slab_t *slab) {
+  size_t page_size = get_page_size();
+
+  stats_add(STATS_MADVISE_CALLS, (size_t) 1);
+  if (madvise((char *)slab + page_size, SLAB_SIZE - page_size, MADV_DONTNEED) != 0) {
+    return 0;
+  }
+  slab_stats.purged_bytes += SLAB_SIZE - page_size;
+  slab_stats.released_bytes += SLAB_SIZE - page_size;
+  /* An object size of 0 marks the slab as purged */
+  slab_stats.free_object_count -= slab->free_count;
+  slab_stats.free_object_bytes -= slab->free_count * slab->object_size;
+  slab->free_count = (size_t) 0;
+  slab->object_size = (size_t) 0;
+  slab_empty_dirty_bytes -= SLAB_SIZE;
+  return 1;
+}
+
+/* This function gives the object at ptr back to its slab. The
+   caller must hold slab_lock. */
+static void release_slab_object(void *ptr) {
+  memory_slab_t *slab = get_slab(ptr);
+  size_t index, class;
+
+  index = ((size_t) ((char *)ptr - slab->objects)) / slab->object_size;
+  slab->bitmap[index / ((size_t) 64)] |= 1ull << (index % ((size_t) 64));
+  if (index / ((size_t) 64) < slab->first_free_word) {
+    slab->first_free_word = index / ((size_t) 64);
+  }
+  slab->free_count++;
+  slab_stats.free_object_count++;
+  slab_stats.free_object_bytes += slab->object_size;
+
+  class = slab->object_size / MEMORY_ALIGNMENT;
+  if (slab->free_count == ((size_t) 1)) {
+    link_slab(&slab_partial[class], slab);
+  }
+  if ((slab->free_count == slab->object_count) &&
+      ((slab->prev != NULL) || (slab->next != NULL))) {
+    /* Empty, and not the only slab of its class with free objects:
+       keeping one avoids bouncing a slab between the lists. */
+    unlink_slab(&slab_partial[class], slab);
+    link_slab(&slab_empty, slab);
+    slab_stats.empty_slab_count++;
+    slab_empty_dirty_bytes += SLAB_SIZE;
+    if ((slab_empty_dirty_bytes > tunables[TUNABLE_TRIM_THRESHOLD]) &&
+	!is_background_thread_running()) {
+      purge_empty_slab(slab);
+    }
+  }
+}
+
+/* This function pushes the object at ptr onto the remote_free list
+   of its slab, without any lock. */
+static void push_remote_slab_object(void *ptr) {
+  memory_slab_t *slab = get_slab(ptr);
+  memory_slab_t **pending;
+  memory_slab_t *pending_head;
+  void *head;
+
+  stats_add(STATS_REMOTE_FREES, (size_t) 1);
+  head = __atomic_load_n(&slab->remote_free, __ATOMIC_RELAXED);
+  do {
+    *((void **) ptr) = head;
+  } while (!__atomic_compare_exchange_n(&slab->remote_free, &head, ptr, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  if (head != NULL) {
+    /* The slab already is on its pending list */
+    return;
+  }
+  pending = &slab_pending[slab->object_size / MEMORY_ALIGNMENT];
+  pending_head = __atomic_load_n(pending, __ATOMIC_RELAXED);
+  do {
+    slab->next_pending = pending_head;
+  } while (!__atomic_compare_exchange_n(pending, &pending_head, slab, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* This function gives all objects that have been pushed onto the
+   remote_free lists of the slabs of class back to their slabs. The
+   caller must hold slab_lock. */
+static void drain_remote_slab_objects(size_t class) {
+  memory_slab_t *slab, *next_slab;
+  void *ptr, *next_ptr;
+
+  slab = __atomic_exchange_n(&slab_pending[class], NULL, __ATOMIC_ACQUIRE);
+  for (; slab != NULL; slab = next_slab) {
+    /* Once the list is taken, the slab may be pushed again */
+    next_slab = slab->next_pending;
+    ptr = __atomic_exchange_n(&slab->remote_free, NULL, __ATOMIC_ACQUIRE);
+    for (; ptr != NULL; ptr = next_ptr) {
+      next_ptr = *((void **) ptr);
+      release_slab_object(ptr);
+    }
+  }
+}
+
+/* This function gives the pages of all empty slabs back to the
+   kernel, as far as they have not been yet. The caller must hold
+   slab_lock.
+   - Returns 1 if any memory was given back, 0 otherwise */
+static int purge_empty_slabs() {
+  memory_slab_t *slab;
+  int res = 0;
+
+  for (slab = slab_empty; slab != NULL; slab = slab->next) {
+    if (slab->object_size != ((size_t) 0)) {
+      res |= purge_empty_slab(slab);
+    }
+  }
+  return res;
+}
+
+
+/* Heap profiler
+
+   With the environment variable MEMORY_PROFILE set to a file name
+   prefix, allocations are sampled, one per profile_interval tunable
+   bytes allocated on average. Each thread counts down the bytes it
+   allocates; when its count runs out, the allocation is sampled and
+   the count drawn anew from an exponential distribution, so that the
+   samples form a Poisson process over the bytes allocated and every
+   byte has the same chance of being sampled. Allocations that are
+   not sampled only pay for the decrement and its branch.
+
+   A sampled block is allocated like any other, and only recorded in
+   a hash table of the live samples. So that a free need not take
+   profile_lock to look for its block there, each slot of a larger
+   table, profile_sample_filter, counts the samples whose address
+   hashes to it; only a free whose slot is not empty looks further.
+   Without the profiler, a free just checks profile_prefix.
+
+   The call stack of a sampled allocation is taken with glibc's
+   backtrace, without our own frames, and the allocation is counted
+   in the bucket of that stack, as is its free. backtrace is called
+   once at load time, so that it loads the unwinder then rather than
+   while allocating; allocations the unwinder makes while a sample is
+   taken are never sampled.
+
+   Profiles are written to <prefix>.<pid>.<n>.heap at exit, and after
+   the process gets the signal whose number is in
+   MEMORY_PROFILE_SIGNAL, if set. Writing a profile is not
+   async-signal-safe, so the handler only posts a semaphore, on which
+   a watcher thread waits to write it; should the thread not start,
+   the next sample does. The handler is only installed if the program
+   has none for that signal at load time, and a handler the program
+   installs later takes the signal over.
+
+   Profiles are in the text format of gperftools' heap profiles,
+   heap_v2, which pprof reads: per stack, the objects and bytes
+   sampled that are still live, then those sampled since the start,
+   followed by the process's mappings so that pprof can symbolize
+   the addresses. pprof scales the samples back to estimates of the
+   whole heap, for instance
+
+   pprof -sample_index=inuse_space <program> <prefix>.<pid>.<n>.heap
+*/
+#include <execinfo.h>
+#include <fcntl.h>
+#include <semaphore.h>
+
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_SKIP_DEPTH 8
+#define PROFILE_TABLE_SIZE ((size_t) 4096)
+#define PROFILE_FILTER_SIZE ((size_t) 65536)
+#define PROFILE_POOL_SIZE ((size_t) (256 * 1024))
+
+/* The allocations with one call stack */
+typedef struct profile_bucket {
+  struct profile_bucket *next;
+  size_t hash;
+  size_t depth;
+  void *stack[PROFILE_MAX_DEPTH];
+  size_t alloc_count;
+  size_t alloc_bytes;
+  size_t free_count;
+  size_t free_bytes;
+} profile_bucket_t;
+
+/* A sampled block that is still live */
+typedef struct profile_sample {
+  struct profile_sample *next;
+  void *ptr;
+  size_t size;
+  profile_bucket_t *bucket;
+} profile_sample_t;
+
+/* Start and end of memory.so, whose frames are left out of the
+   stacks */
+extern const char __ehdr_start[] __attribute__((visibility("hidden")));
+extern const char _end[] __attribute__((visibility("hidden")));
+
+/* This lock protects the tables, the pool and the free samples */
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static profile_bucket_t *profile_buckets[PROFILE_TABLE_SIZE];
+static profile_sample_t *profile_samples[PROFILE_TABLE_SIZE];
+static unsigned int profile_sample_filter[PROFILE_FILTER_SIZE];
+static profile_sample_t *profile_free_samples = NULL;
+static char *profile_pool = NULL;
+static size_t profile_pool_left = (size_t) 0;
+static unsigned int profile_dump_count = 0u;
+
+static const char *profile_prefix = NULL;
+static int profile_dump_requested = 0;
+
+/* Posted by the signal handler, for the watcher thread */
+static sem_t profile_signal_sem;
+static int profile_watcher_running = 0;
+
+/* Bytes the thread may still allocate before its next sample, the
+   state of its random numbers and whether it is taking a sample */
+static __thread long long profile_countdown
+  __attribute__((tls_model("initial-exec")));
+static __thread unsigned long long profile_random
+  __attribute__((tls_model("initial-exec")));
+static __thread int profile_busy
+  __attribute__((tls_model("initial-exec")));
+
+/* This function draws the number of bytes until the thread's next
+   sample from an exponential distribution whose mean is the
+   profile_interval tunable. The logarithm is approximated linearly
+   between powers of two, which is good enough for sampling and does
+   not need libm.
+   - Returns the number of bytes */
+static long long draw_profile_countdown() {
+  size_t interval = tunables[TUNABLE_PROFILE_INTERVAL];
+  unsigned long long q;
+  double log2_q;
+  int e;
+
+  if ((profile_prefix == NULL) || (interval == ((size_t) 0))) {
+    /* Never, or at least not for a very long time */
+    return (long long) (((unsigned long long) -1) >> 2);
+  }
+  if (profile_random == 0ull) {
+    profile_random = ((unsigned long long) (size_t) &profile_random) ^ get_time_ns() ^ 88172645463325252ull;
+  }
+  profile_random ^= profile_random << 13;
+  profile_random ^= profile_random >> 7;
+  profile_random ^= profile_random << 17;
+  q = (profile_random >> 38) + 1ull;
+  e = 63 - __builtin_clzll(q);
+  log2_q = ((double) e) + ((double) q) / ((double) (1ull << e)) - 1.0;
+  return ((long long) ((26.0 - log2_q) * 0.6931471805599453 * ((double) interval))) + 1ll;
+}
+
+/* This function hashes the call stack stack of depth frames. */
+static size_t hash_profile_stack(void *const *stack, size_t depth) {
+  size_t hash = (size_t) 14695981039346656037ull, i;
+
+  for (i=(size_t) 0; i<depth; i++) {
+    hash = (hash ^ ((size_t) stack[i])) * ((size_t) 1099511628211ull);
+  }
+  return hash;
+}
+
+/* This function hashes the address ptr of a sample. */
+static inline size_t hash_profile_sample(const void *ptr) {
+  return (size_t) ((((unsigned long long) (size_t) ptr) >> 4) * 11400714819323198485ull >> 32);
+}
+
+/* This function carves size bytes out of the profiler's pool. The
+   caller must hold profile_lock.
+   - Returns NULL if no memory could be mapped */
+static void *take_profile_memory(size_t size) {
+  void *memory;
+
+  if (profile_pool_left < size) {
+    memory = mmap(NULL, PROFILE_POOL_SIZE, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    stats_add(STATS_MMAP_CALLS, (size_t) 1);
+    if (memory == MAP_FAILED) {
+      return NULL;
+    }
+    profile_pool = (char *) memory;
+    profile_pool_left = PROFILE_POOL_SIZE;
+  }
+  memory = (void *) profile_pool;
+  profile_pool += size;
+  profile_pool_left -= size;
+  return memory;
+}
+
+/* This function finds the bucket of the call stack stack of depth
+   frames, or adds it. The caller must hold profile_lock.
+   - Returns NULL if no memory could be mapped */
+static profile_bucket_t *get_profile_bucket(void *const *stack, size_t depth) {
+  size_t hash = hash_profile_stack(stack, depth);
+  profile_bucket_t *bucket;
+
+  for (bucket = profile_buckets[hash % PROFILE_TABLE_SIZE]; bucket != NULL; bucket = bucket->next) {
+    if ((bucket->hash == hash) && (bucket->depth == depth) &&
+	(!memcmp(bucket->stack, stack, depth * sizeof(void *)))) {
+      return bucket;
+    }
+  }
+  bucket = (profile_bucket_t *) take_profile_memory(sizeof(profile_bucket_t));
+  if (bucket == NULL) {
+    return NULL;
+  }
+  bucket->hash = hash;
+  bucket->depth = depth;
+  __memcpy(bucket->stack, stack, depth * sizeof(void *));
+  bucket->next = profile_buckets[hash % PROFILE_TABLE_SIZE];
+  profile_buckets[hash % PROFILE_TABLE_SIZE] = bucket;
+  return bucket;
+}
+
+/* This function writes the len bytes at buf to fd, all of them. */
+static void write_all(int fd, const char *buf, size_t len) {
+  ssize_t res;
+
+  while (len > ((size_t) 0)) {
+    res = write(fd, buf, len);
+    if (res <= 0) {
+      if ((res < 0) && (errno == EINTR)) continue;
+      return;
+    }
+    buf += res;
+    len -= (size_t) res;
+  }
+}
+
+/* This function writes a profile to the next file, as described
+   above. It does not allocate, as it may run while taking a sample.
+   The caller must hold profile_lock. */
+static void write_profile() {
+  size_t alloc_count = (size_t) 0, alloc_bytes = (size_t) 0;
+  size_t live_count = (size_t) 0, live_bytes = (size_t) 0, i, j;
+  profile_bucket_t *bucket;
+  char buf[4096];
+  ssize_t res;
+  int len, fd, maps_fd, saved_errno = errno;
+
+  snprintf(buf, sizeof(buf), "%s.%d.%u.heap", profile_prefix, (int) getpid(), profile_dump_count++);
+  fd = open(buf, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    errno = saved_errno;
+    return;
+  }
+  for (i=(size_t) 0; i<PROFILE_TABLE_SIZE; i++) {
+    for (bucket = profile_buckets[i]; bucket != NULL; bucket = bucket->next) {
+      alloc_count += bucket->alloc_count;
+      alloc_bytes += bucket->alloc_bytes;
+      live_count += bucket->alloc_count - bucket->free_count;
+      live_bytes += bucket->alloc_bytes - bucket->free_bytes;
+    }
+  }
+  len = snprintf(buf, sizeof(buf), "heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%zu\n",
+		 live_count, live_bytes, alloc_count, alloc_bytes, tunables[TUNABLE_PROFILE_INTERVAL]);
+  write_all(fd, buf, (size_t) len);
+  for (i=(size_t) 0; i<PROFILE_TABLE_SIZE; i++) {
+    for (bucket = profile_buckets[i]; bucket != NULL; bucket = bucket->next) {
+      len = snprintf(buf, sizeof(buf), "%6zu: %8zu [%6zu: %8zu] @",
+		     bucket->alloc_count - bucket->free_count, bucket->alloc_bytes - bucket->free_bytes,
+		     bucket->alloc_count, bucket->alloc_bytes);
+      for (j=(size_t) 0; j<bucket->depth; j++) {
+	len += snprintf(buf + len, sizeof(buf) - (size_t) len, " %p", bucket->stack[j]);
+      }
+      buf[len++] = '\n';
+      write_all(fd, buf, (size_t) len);
+    }
+  }
+
+  len = snprintf(buf, sizeof(buf), "\nMAPPED_LIBRARIES:\n");
+  write_all(fd, buf, (size_t) len);
+  maps_fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (maps_fd >= 0) {
+    while (((res = read(maps_fd, buf, sizeof(buf))) > 0) || ((res < 0) && (errno == EINTR))) {
+      if (res > 0) write_all(fd, buf, (size_t) res);
+    }
+    close(maps_fd);
+  }
+  close(fd);
+  errno = saved_errno;
+}
+
+/* This function writes a profile now if one has been asked for by
+   signal since the last one. */
+static void write_requested_profile() {
+  if (__atomic_exchange_n(&profile_dump_requested, 0, __ATOMIC_RELAXED)) {
+    pthread_mutex_lock(&profile_lock);
+    write_profile();
+    pthread_mutex_unlock(&profile_lock);
+  }
+}
+
+/* This function records the block at ptr, of size bytes, that has
+   just been handed out, as a sample when the thread's countdown has
+   run out, as described above. The caller must not hold any of our
+   locks, as backtrace may allocate. The first time a thread gets
+   here, it only draws its countdown. */
+static void take_profile_sample(void *ptr, size_t size) {
+  void *stack[PROFILE_MAX_DEPTH + PROFILE_SKIP_DEPTH];
+  profile_sample_t *sample;
+  profile_bucket_t *bucket;
+  size_t hash;
+  int depth, first, i;
+
+  if (profile_busy) {
+    /* The unwinder allocates: leave the countdown alone */
+    return;
+  }
+  first = (profile_random == 0ull);
+  profile_countdown = draw_profile_countdown();
+  if (first || (profile_prefix == NULL)) {
+    return;
+  }
+  write_requested_profile();
+
+  profile_busy = 1;
+  depth = backtrace(stack, PROFILE_MAX_DEPTH + PROFILE_SKIP_DEPTH);
+  profile_busy = 0;
+  for (first = 0; (first < depth) &&
+	 ((const char *) stack[first] >= __ehdr_start) && ((const char *) stack[first] < _end);
+       first++);
+  depth -= first;
+  if (depth > PROFILE_MAX_DEPTH) {
+    depth = PROFILE_MAX_DEPTH;
+  }
+  for (i=0; i<depth; i++) {
+    stack[i] = stack[first + i];
+  }
+
+  hash = hash_profile_sample(ptr);
+  pthread_mutex_lock(&profile_lock);
+  bucket = get_profile_bucket(stack, (size_t) depth);
+  sample = profile_free_samples;
+  if (sample != NULL) {
+    profile_free_samples = sample->next;
+  } else {
+    sample = (profile_sample_t *) take_profile_memory(sizeof(profile_sample_t));
+  }
+  if ((bucket != NULL) && (sample != NULL)) {
+    bucket->alloc_count++;
+    bucket->alloc_bytes += size;
+    sample->ptr = ptr;
+    sample->size = size;
+    sample->bucket = bucket;
+    sample->next = profile_samples[hash % PROFILE_TABLE_SIZE];
+    profile_samples[hash % PROFILE_TABLE_SIZE] = sample;
+    __atomic_store_n(&profile_sample_filter[hash % PROFILE_FILTER_SIZE],
+		     profile_sample_filter[hash % PROFILE_FILTER_SIZE] + 1u, __ATOMIC_RELAXED);
+  } else if (sample != NULL) {
+    sample->next = profile_free_samples;
+    profile_free_samples = sample;
+  }
+  pthread_mutex_unlock(&profile_lock);
+}
+
+/* This function counts the free of the sampled block at ptr in the
+   bucket of its stack and forgets the sample, if the block is one. */
+static void forget_profile_sample(void *ptr) {
+  profile_sample_t **link, *sample;
+  size_t hash = hash_profile_sample(ptr);
+
+  pthread_mutex_lock(&profile_lock);
+  for (link = &profile_samples[hash % PROFILE_TABLE_SIZE];
+       (*link != NULL) && ((*link)->ptr != ptr);
+       link = &(*link)->next);
+  sample = *link;
+  if (sample != NULL) {
+    *link = sample->next;
+    sample->bucket->free_count++;
+    sample->bucket->free_bytes += sample->size;
+    sample->next = profile_free_samples;
+    profile_free_samples = sample;
+    __atomic_store_n(&profile_sample_filter[hash % PROFILE_FILTER_SIZE],
+		     profile_sample_filter[hash % PROFILE_FILTER_SIZE] - 1u, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&profile_lock);
+}
+
+/* This function forgets the block at ptr, which is being freed or
+   moved, if it may be a sample. */
+static inline void drop_profile_sample(void *ptr) {
+  if ((profile_prefix != NULL) &&
+      (__atomic_load_n(&profile_sample_filter[hash_profile_sample(ptr) % PROFILE_FILTER_SIZE],
+		       __ATOMIC_RELAXED) != 0u)) {
+    forget_profile_sample(ptr);
+  }
+}
+
+/* The profile is left to the watcher thread, as neither the lock
+   nor the formatting is safe in a signal handler */
+static void handle_profile_signal(int signo) {
+  int saved_errno = errno;
+
+  __atomic_store_n(&profile_dump_requested, 1, __ATOMIC_RELAXED);
+  sem_post(&profile_signal_sem);
+  errno = saved_errno;
+}
+
+static void *profile_watcher_main(void *arg) {
+  sigset_t signals;
+
+  /* Signals are for the program's threads */
+  sigfillset(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  for (;;) {
+    if (sem_wait(&profile_signal_sem) == 0) {
+      write_requested_profile();
+    }
+  }
+  return NULL;
+}
+
+/* This function starts the thread that writes the profiles asked
+   for by signal. */
+static void start_profile_watcher() {
+  pthread_attr_t attr;
+  pthread_t thread;
+  int res;
+
+  res = pthread_attr_init(&attr);
+  if (res == 0) {
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    res = pthread_create(&thread, &attr, profile_watcher_main, NULL);
+    pthread_attr_destroy(&attr);
+  }
+  profile_watcher_running = (res == 0);
+}
+
+/* In a child process, the watcher is gone: start another one. The
+   caller must not hold any of our locks, as pthread_create
+   allocates. */
+static void restart_profile_watcher_in_child() {
+  if (profile_watcher_running) {
+    sem_init(&profile_signal_sem, 0, 0u);
+    start_profile_watcher();
+  }
+}
+
+/* This function turns the profiler on at load time if
+   MEMORY_PROFILE is set. */
+__attribute__((constructor))
+static void init_profiler() {
+  struct sigaction action, previous;
+  void *stack[1];
+  char *env_var;
+  int signo;
+
+  env_var = getenv("MEMORY_PROFILE");
+  if ((env_var == NULL) || (env_var[0] == '\0')) {
+    return;
+  }
+  profile_busy = 1;
+  backtrace(stack, 1);
+  profile_busy = 0;
+  profile_prefix = env_var;
+
+  env_var = getenv("MEMORY_PROFILE_SIGNAL");
+  if (env_var != NULL) {
+    signo = atoi(env_var);
+    /* Leave the program's own handler alone */
+    if ((signo > 0) && (sigaction(signo, NULL, &previous) == 0) &&
+	!(previous.sa_flags & SA_SIGINFO) && (previous.sa_handler == SIG_DFL) &&
+	(sem_init(&profile_signal_sem, 0, 0u) == 0)) {
+      start_profile_watcher();
+      __memset(&action, 0, sizeof(action));
+      action.sa_handler = handle_profile_signal;
+      action.sa_flags = SA_RESTART;
+      sigemptyset(&action.sa_mask);
+      sigaction(signo, &action, NULL);
+    }
+  }
+}
+
+/* This function writes the last profile at exit. */
+__attribute__((destructor))
+static void write_exit_profile() {
+  if (profile_prefix != NULL) {
+    __atomic_store_n(&profile_dump_requested, 0, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&profile_lock);
+    write_profile();
+    pthread_mutex_unlock(&profile_lock);
+  }
+}
+
+/* Thread-local allocation caches
+
+   Each thread keeps, per size class, a stack of slab objects that
+   are allocated as far as the slabs are concerned but not in use by
+   the program. malloc and free of small sizes push and pop on that
+   stack without any lock. slab_lock is only taken to refill an empty
+   bin with a batch of objects, and to give half of a bin that has
+   grown past the tcache_count tunable back to the slabs in one
+   batch. A flush also drains what other threads left on the
+   remote_free lists of the bin's class, so that a class the thread
+   stops using does not keep its slabs.
+
+   Bin i holds objects of i * THREAD_CACHE_GRANULE bytes. Cached
+   objects are linked through their first word.
+
+   The bytes a thread may keep cached are also limited, by the
+   cache_limit of its stats shard, so that threads that are busy get
+   to cache more than those that are not. The limits of all threads
+   share a budget, the tcache_bytes tunable. A thread whose cache
+   goes over its limit on free, or has no room left under it for a
+   refill, raises the limit by THREAD_CACHE_LIMIT_STEP, from what is
+   left of the budget, or else from the limit of another thread that
+   has not used its cache since it was last looked at. Up to
+   THREAD_CACHE_MIN_LIMIT is granted whatever the budget. A thread
+   that is still over its limit then, for instance because another
+   thread took part of it, flushes half of every bin. Another
+   thread's cache cannot be touched without a lock on the fast paths,
+   so what an idle thread holds is flushed once it runs again, or
+   once it exits: the destructor of its shard flushes all of it.
+
+   The cache uses initial-exec TLS: the general dynamic model goes
+   through __tls_get_addr, which may itself call malloc.
+*/
+#define THREAD_CACHE_GRANULE MEMORY_ALIGNMENT
+#define THREAD_CACHE_MAX_SIZE SLAB_MAX_OBJECT_SIZE
+#define THREAD_CACHE_BINS (THREAD_CACHE_MAX_SIZE / THREAD_CACHE_GRANULE + ((size_t) 1))
+#define THREAD_CACHE_REFILL_BYTES ((size_t) 2048)
+#define THREAD_CACHE_MAX_REFILL ((size_t) 16)
+#define THREAD_CACHE_MIN_LIMIT ((size_t) (64 * 1024))
+#define THREAD_CACHE_LIMIT_STEP ((size_t) (64 * 1024))
+
+typedef struct thread_cache_bin {
+  void *head;
+  size_t count;
+} thread_cache_bin_t;
+
+static __thread thread_cache_bin_t thread_cache[THREAD_CACHE_BINS]
+  __attribute__((tls_model("initial-exec")));
+
+/* Where grow_thread_cache_limit looks for a limit to steal next */
+static memory_stats_shard_t *thread_cache_steal_cursor = NULL;
+
+/* This function pushes the object at ptr onto the thread cache bin tb. */
+static void thread_cache_push(thread_cache_bin_t *tb, void *ptr) {
+  *((void **) ptr) = tb->head;
+  tb->head = ptr;
+  tb->count++;
+  stats_add(STATS_CACHED_BLOCKS, (size_t) 1);
+  stats_add(STATS_CACHED_BYTES, ((size_t) (tb - thread_cache)) * THREAD_CACHE_GRANULE);
+}
+
+/* This function pops an object from the thread cache bin tb.
+   - Returns NULL if the bin is empty */
+static void *thread_cache_pop(thread_cache_bin_t *tb) {
+  void *ptr;
+
+  ptr = tb->head;
+  if (ptr != NULL) {
+    tb->head = *((void **) ptr);
+    tb->count--;
+    stats_add(STATS_CACHED_BLOCKS, (size_t) -1);
+    stats_add(STATS_CACHED_BYTES, -(((size_t) (tb - thread_cache)) * THREAD_CACHE_GRANULE));
+  }
+  return ptr;
+}
+
+/* This function raises the cache limit of shard, the calling
+   thread's, by THREAD_CACHE_LIMIT_STEP, as described above, if there
+   is anything to take. Threads that count in fallback_stats_shard
+   do not cache. */
+static void grow_thread_cache_limit(memory_stats_shard_t *shard) {
+  memory_stats_shard_t *victim;
+  size_t activity, i;
+
+  if (shard == &fallback_stats_shard) {
+    return;
+  }
+  pthread_mutex_lock(&stats_shard_lock);
+  if ((shard->cache_limit < THREAD_CACHE_MIN_LIMIT) ||
+      (thread_cache_claimed + THREAD_CACHE_LIMIT_STEP <= tunables[TUNABLE_TCACHE_BYTES])) {
+    thread_cache_claimed += THREAD_CACHE_LIMIT_STEP;
+    __atomic_store_n(&shard->cache_limit, shard->cache_limit + THREAD_CACHE_LIMIT_STEP, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&stats_shard_lock);
+    return;
+  }
+  for (i=(size_t) 0; i<stats_shard_count; i++) {
+    victim = thread_cache_steal_cursor;
+    if (victim == NULL) {
+      victim = stats_shard_list;
+    }
+    thread_cache_steal_cursor = victim->next;
+    if ((victim == shard) || !victim->live) {
+      continue;
+    }
+    activity = __atomic_load_n(&victim->counters[STATS_CACHE_HITS], __ATOMIC_RELAXED) +
+      __atomic_load_n(&victim->counters[STATS_CACHE_REFILLS], __ATOMIC_RELAXED);
+    if (activity != victim->activity_seen) {
+      victim->activity_seen = activity;
+      continue;
+    }
+    if (victim->cache_limit >= THREAD_CACHE_MIN_LIMIT + THREAD_CACHE_LIMIT_STEP) {
+      __atomic_store_n(&victim->cache_limit, victim->cache_limit - THREAD_CACHE_LIMIT_STEP, __ATOMIC_RELAXED);
+      __atomic_store_n(&shard->cache_limit, shard->cache_limit + THREAD_CACHE_LIMIT_STEP, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&stats_shard_lock);
+}
+
+/* This function refills the empty thread cache bin with index bin
+   with a batch of objects taken from the slabs under a single
+   acquisition of slab_lock.
+   - Returns one object of the bin's size
+   - Returns NULL if the slabs could not provide any object */
+static void *thread_cache_refill(size_t bin) {
+  thread_cache_bin_t *tb = &thread_cache[bin];
+  memory_stats_shard_t *shard = get_stats_shard();
+  size_t object_size = bin * THREAD_CACHE_GRANULE;
+  void *objects[THREAD_CACHE_MAX_REFILL];
+  size_t count, cached, room, i;
+
+  count = THREAD_CACHE_REFILL_BYTES / object_size;
+  if (count > THREAD_CACHE_MAX_REFILL) count = THREAD_CACHE_MAX_REFILL;
+
+  /* Stay within the limit, raising it if need be */
+  cached = get_thread_cache_bytes(shard);
+  room = (shard->cache_limit > cached) ? shard->cache_limit - cached : (size_t) 0;
+  if (room < count * object_size) {
+    grow_thread_cache_limit(shard);
+    room = (shard->cache_limit > cached) ? shard->cache_limit - cached : (size_t) 0;
+  }
+  if (count > room / object_size) count = room / object_size;
+  if (count < ((size_t) 1)) count = (size_t) 1;
+
+  stats_add(STATS_CACHE_REFILLS, (size_t) 1);
+  pthread_mutex_lock(&slab_lock);
+  drain_remote_slab_objects(bin);
+  count = take_slab_objects(object_size, objects, count);
+  pthread_mutex_unlock(&slab_lock);
+
+  for (i=(size_t) 0; i<count; i++) {
+    thread_cache_push(tb, objects[i]);
+  }
+  return thread_cache_pop(tb);
+}
+
+/* This function returns objects from the thread cache bin tb to
+   the slabs until only keep objects are left in it, under a single
+   acquisition of slab_lock. */
+static void thread_cache_flush(thread_cache_bin_t *tb, size_t keep) {
+  stats_add(STATS_CACHE_FLUSHES, (size_t) 1);
+  pthread_mutex_lock(&slab_lock);
+  drain_remote_slab_objects((size_t) (tb - thread_cache));
+  while (tb->count > keep) {
+    release_slab_object(thread_cache_pop(tb));
+  }
+  pthread_mutex_unlock(&slab_lock);
+}
+
+/* This function gives the whole cache of the calling thread back to
+   the slabs under a single acquisition of slab_lock, along with what
+   other threads left on the remote lists, so that slabs that become
+   empty go onto the empty list and get purged. */
+static void release_thread_cache() {
+  size_t bin;
+
+  stats_add(STATS_CACHE_FLUSHES, (size_t) 1);
+  pthread_mutex_lock(&slab_lock);
+  for (bin=(size_t) 1; bin<THREAD_CACHE_BINS; bin++) {
+    drain_remote_slab_objects(bin);
+    while (thread_cache[bin].count > ((size_t) 0)) {
+      release_slab_object(thread_cache_pop(&thread_cache[bin]));
+    }
+  }
+  pthread_mutex_unlock(&slab_lock);
+}
+
+/* This function flushes half of every bin of the calling thread's
+   cache, and the rest too if that does not bring it within its
+   limit. */
+static void thread_cache_shrink() {
+  memory_stats_shard_t *shard = get_stats_shard();
+  size_t bin;
+
+  for (bin=(size_t) 1; bin<THREAD_CACHE_BINS; bin++) {
+    if (thread_cache[bin].count > ((size_t) 0)) {
+      thread_cache_flush(&thread_cache[bin], thread_cache[bin].count / ((size_t) 2));
+    }
+  }
+  if (get_thread_cache_bytes(shard) > __atomic_load_n(&shard->cache_limit, __ATOMIC_RELAXED)) {
+    release_thread_cache();
+  }
+}
+
+/* Per-CPU allocation caches
+
+   With the percpu_cache tunable set, small objects are cached per
+   CPU rather than per thread, in the style of tcmalloc: the memory
+   held in caches then grows with the number of cores, not with the
+   number of threads. Each CPU has, per size class, an array of up to
+   PERCPU_CACHE_CAPACITY objects and a count.
+
+   The fast paths are restartable sequences (rseq): the kernel aborts
+   a sequence whenever the thread is preempted, migrated or signalled
+   before its final, committing store, and resumes it at its abort
+   handler, which simply starts over. Such a sequence can therefore
+   use the current CPU's cache with plain loads and stores, without
+   atomics and without locks. Misses are handled like those of the
+   thread caches: refills come from the slabs under slab_lock, and
+   half of a full array goes back to the slabs' remote_free lists.
+
+   We use the rseq area glibc registered for the thread, if any, and
+   register one of our own otherwise. Threads for which neither works,
+   and builds for other architectures, keep using the thread caches.
+
+   The caches of all possible CPUs are reserved in one mapping up
+   front; only the pages of the CPUs the program runs on are touched.
+   malloc_trim cannot reach into the caches of other CPUs and leaves
+   them alone.
+*/
+#define PERCPU_CACHE_CAPACITY ((size_t) 63)
+#define PERCPU_CACHE_MAX_CPUS ((size_t) 1024)
+
+typedef struct percpu_cache_bin {
+  unsigned int count;
+  unsigned int pad;
+  void *slots[PERCPU_CACHE_CAPACITY];
+} percpu_cache_bin_t;
+
+#define PERCPU_CACHE_STRIDE (sizeof(percpu_cache_bin_t) * THREAD_CACHE_BINS)
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/syscall.h>
+#include <linux/rseq.h>
+
+#define PERCPU_RSEQ_SIG 0x53053053
+
+/* Set by glibc 2.35 and later when it registered an rseq area */
+extern const ptrdiff_t __rseq_offset __attribute__((weak));
+extern const unsigned int __rseq_size __attribute__((weak));
+
+static char *percpu_caches = NULL;
+
+static __thread struct rseq percpu_rseq_own
+  __attribute__((tls_model("initial-exec"), aligned(32)));
+static __thread struct rseq *percpu_rseq
+  __attribute__((tls_model("initial-exec")));
+static __thread int percpu_rseq_state
+  __attribute__((tls_model("initial-exec")));
+
+/* This function reserves the per-CPU caches, the first time it is
+   called.
+   - Returns 1 if they are reserved
+   - Returns 0 if mmap failed */
+static int init_percpu_caches() {
+  void *caches;
+
+  pthread_mutex_lock(&slab_lock);
+  if (percpu_caches == NULL) {
+    stats_add(STATS_MMAP_CALLS, (size_t) 1);
+    caches = mmap(NULL, PERCPU_CACHE_STRIDE * PERCPU_CACHE_MAX_CPUS,
+		  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+		  -1, (off_t) 0);
+    if (caches != MAP_FAILED) {
+      percpu_caches = (char *) caches;
+    }
+  }
+  pthread_mutex_unlock(&slab_lock);
+  return (percpu_caches != NULL);
+}
+
+/* This function finds the rseq area of the calling thread, using
+   glibc's registration or making one of our own.
+   - Returns the area
+   - Returns NULL if the kernel does not support rseq */
+static struct rseq *register_percpu_rseq() {
+  struct rseq *area;
+  char *thread_pointer;
+
+  if ((&__rseq_size != NULL) && (&__rseq_offset != NULL) && (__rseq_size != 0u)) {
+    __asm__ ("movq %%fs:0, %0" : "=r" (thread_pointer));
+    area = (struct rseq *)(thread_pointer + __rseq_offset);
+    if (((int) area->cpu_id) >= 0) {
+      return area;
+    }
+    return NULL;
+  }
+  if (syscall(SYS_rseq, &percpu_rseq_own, (unsigned int) sizeof(percpu_rseq_own),
+	      0, PERCPU_RSEQ_SIG) != 0) {
+    return NULL;
+  }
+  return &percpu_rseq_own;
+}
+
+/* This function returns the rseq area of the calling thread if small
+   objects are to be cached per CPU.
+   - Returns NULL if they go to the thread caches instead */
+static inline struct rseq *get_percpu_rseq() {
+  if (percpu_rseq_state > 0) {
+    return percpu_rseq;
+  }
+  if ((percpu_rseq_state < 0) || (tunables[TUNABLE_PERCPU_CACHE] == ((size_t) 0))) {
+    return NULL;
+  }
+  percpu_rseq_state = -1;
+  if (init_percpu_caches()) {
+    percpu_rseq = register_percpu_rseq();
+    if (percpu_rseq != NULL) {
+      percpu_rseq_state = 1;
+      __atomic_store_n(&get_stats_shard()->percpu, 1, __ATOMIC_RELAXED);
+    }
+  }
+  return percpu_rseq;
+}
+
+/* The sequences below share their layout. Label 3 is the rseq_cs
+   descriptor of the sequence, which runs from label 1 to its commit
+   at label 2. Label 5 arms the descriptor, and the abort handler at
+   label 4, which must follow the signature, jumps back there. Label 6
+   is the miss exit. The CPU number is checked against the CPUs we
+   reserved caches for. */
+#define PERCPU_RSEQ_PROLOGUE						\
+  ".pushsection __rseq_cs, \"aw\"\n\t"					\
+  ".balign 32\n\t"							\
+  "3:\n\t"								\
+  ".long 0, 0\n\t"							\
+  ".quad 1f, 2f - 1f, 4f\n\t"						\
+  ".popsection\n\t"							\
+  "5:\n\t"								\
+  "leaq 3b(%%rip), %%rax\n\t"						\
+  "movq %%rax, %c[cs_offset](%[rseq])\n\t"				\
+  "1:\n\t"								\
+  "movl %c[cpu_offset](%[rseq]), %%eax\n\t"				\
+  "cmpl %[max_cpus], %%eax\n\t"						\
+  "jae 6f\n\t"								\
+  "imulq %[stride], %%rax\n\t"						\
+  "addq %[base], %%rax\n\t"						\
+  "movl (%%rax), %%ecx\n\t"
+
+#define PERCPU_RSEQ_EPILOGUE						\
+  ".pushsection __rseq_failure, \"ax\"\n\t"				\
+  ".byte 0x0f, 0xb9, 0x3d\n\t"						\
+  ".long 0x53053053\n\t"						\
+  "4:\n\t"								\
+  "jmp 5b\n\t"								\
+  ".popsection\n\t"
+
+#define PERCPU_RSEQ_OPERANDS(bin)					\
+  [rseq] "r" (rseq),							\
+  [base] "r" (percpu_caches + (bin) * sizeof(percpu_cache_bin_t)),	\
+  [stride] "i" (PERCPU_CACHE_STRIDE),					\
+  [max_cpus] "i" (PERCPU_CACHE_MAX_CPUS),				\
+  [capacity] "i" (PERCPU_CACHE_CAPACITY),				\
+  [cs_offset] "i" (offsetof(struct rseq, rseq_cs)),			\
+  [cpu_offset] "i" (offsetof(struct rseq, cpu_id))
+
+/* This function pops an object from the current CPU's cache bin
+   with index bin.
+   - Returns NULL if the bin is empty */
+static inline void *percpu_cache_pop(struct rseq *rseq, size_t bin) {
+  void *ptr;
+
+  __asm__ __volatile__ (PERCPU_RSEQ_PROLOGUE
+			"testl %%ecx, %%ecx\n\t"
+			"jz 6f\n\t"
+			"subl $1, %%ecx\n\t"
+			"movq 8(%%rax, %%rcx, 8), %[ptr]\n\t"
+			"movl %%ecx, (%%rax)\n\t"
+			"2:\n\t"
+			"jmp 7f\n\t"
+			"6:\n\t"
+			"xorl %k[ptr], %k[ptr]\n\t"
+			"7:\n\t"
+			PERCPU_RSEQ_EPILOGUE
+			: [ptr] "=&r" (ptr)
+			: PERCPU_RSEQ_OPERANDS(bin)
+			: "rax", "rcx", "memory", "cc");
+  if (ptr != NULL) {
+    stats_add(STATS_CACHED_BLOCKS, (size_t) -1);
+    stats_add(STATS_CACHED_BYTES, -(bin * THREAD_CACHE_GRANULE));
+  }
+  return ptr;
+}
+
+/* This function pushes the object at ptr onto the current CPU's
+   cache bin with index bin.
+   - Returns 1 on success
+   - Returns 0 if the bin is full */
+static inline int percpu_cache_push(struct rseq *rseq, size_t bin, void *ptr) {
+  int res;
+
+  __asm__ __volatile__ (PERCPU_RSEQ_PROLOGUE
+			"cmpl %[capacity], %%ecx\n\t"
+			"jae 6f\n\t"
+			"movq %[ptr], 8(%%rax, %%rcx, 8)\n\t"
+			"addl $1, %%ecx\n\t"
+			"movl %%ecx, (%%rax)\n\t"
+			"2:\n\t"
+			"movl $1, %[res]\n\t"
+			"jmp 7f\n\t"
+			"6:\n\t"
+			"xorl %[res], %[res]\n\t"
+			"7:\n\t"
+			PERCPU_RSEQ_EPILOGUE
+			: [res] "=&r" (res)
+			: PERCPU_RSEQ_OPERANDS(bin), [ptr] "r" (ptr)
+			: "rax", "rcx", "memory", "cc");
+  if (res) {
+    stats_add(STATS_CACHED_BLOCKS, (size_t) 1);
+    stats_add(STATS_CACHED_BYTES, bin * THREAD_CACHE_GRANULE);
+  }
+  return res;
+}
+
+/* This function refills the current CPU's empty cache bin with index
+   bin from the slabs, like thread_cache_refill. Objects that no
+   longer fit, because another thread got to the bin first, go back
+   to the slabs.
+   - Returns one object of the bin's size
+   - Returns NULL if the slabs could not provide any object */
+static void *percpu_cache_refill(struct rseq *rseq, size_t bin) {
+  size_t object_size = bin * THREAD_CACHE_GRANULE;
+  void *objects[THREAD_CACHE_MAX_REFILL];
+  size_t count, i;
+
+  count = THREAD_CACHE_REFILL_BYTES / object_size;
+  if (count > THREAD_CACHE_MAX_REFILL) count = THREAD_CACHE_MAX_REFILL;
+  if (count < ((size_t) 1)) count = (size_t) 1;
+
+  stats_add(STATS_CACHE_REFILLS, (size_t) 1);
+  pthread_mutex_lock(&slab_lock);
+  drain_remote_slab_objects(bin);
+  count = take_slab_objects(object_size, objects, count);
+  pthread_mutex_unlock(&slab_lock);
+
+  if (count == ((size_t) 0)) {
+    return NULL;
+  }
+  for (i=(size_t) 1; i<count; i++) {
+    if (!percpu_cache_push(rseq, bin, objects[i])) {
+      push_remote_slab_object(objects[i]);
+    }
+  }
+  return objects[0];
+}
+
+/* This function returns the object at ptr, which did not fit into
+   the current CPU's full cache bin with index bin, to the slabs,
+   together with half of the bin. */
+static void percpu_cache_flush(struct rseq *rseq, size_t bin, void *ptr) {
+  size_t i;
+
+  stats_add(STATS_CACHE_FLUSHES, (size_t) 1);
+  push_remote_slab_object(ptr);
+  for (i=(size_t) 0; i<PERCPU_CACHE_CAPACITY / ((size_t) 2); i++) {
+    ptr = percpu_cache_pop(rseq, bin);
+    if (ptr == NULL) {
+      break;
+    }
+    push_remote_slab_object(ptr);
+  }
+}
+
+#else
+
+struct rseq;
+
+static inline struct rseq *get_percpu_rseq() {
+  return NULL;
+}
+
+static inline void *percpu_cache_pop(struct rseq *rseq, size_t bin) {
+  return NULL;
+}
+
+static inline int percpu_cache_push(struct rseq *rseq, size_t bin, void *ptr) {
+  return 0;
+}
+
+static void *percpu_cache_refill(struct rseq *rseq, size_t bin) {
+  return NULL;
+}
+
+static void percpu_cache_flush(struct rseq *rseq, size_t bin, void *ptr) {
+}
+
+#endif
+
+/* This function returns the usable size of the block or slab object
+   at ptr. */
+static size_t get_usable_size(void *ptr) {
+  if (is_slab_object(ptr)) {
+    return get_slab(ptr)->object_size;
+  }
+  return ((memory_block_header_t *)((char *)ptr - sizeof(memory_block_header_t)))->size;
+}
+
+/* This function uses the page map to check that ptr is something we
+   handed out: the payload of an allocated arena block or dedicated
+   mapping, or a slab object. Pointers into the middle of a block, or
+   into memory that is not ours, are found out without touching
+   anything but our own metadata; a pointer to the payload of a free
+   arena block is, too, as far as its header still reads free.
+   - Returns the kind of owner of ptr
+   - Returns PAGE_OWNER_NONE if ptr is not something we handed out */
+static page_owner_kind_t get_block_owner(const void *ptr) {
+  memory_block_header_t *header;
+  memory_arena_t *arena;
+  memory_slab_t *slab;
+  size_t object_size, offset;
+  page_owner_kind_t kind;
+  void *owner;
+
+  if ((((size_t) ptr) & (MEMORY_ALIGNMENT - ((size_t) 1))) != ((size_t) 0)) {
+    return PAGE_OWNER_NONE;
+  }
+  kind = get_page_owner(ptr, &owner);
+  header = (memory_block_header_t *)((char *)ptr - sizeof(memory_block_header_t));
+  switch (kind) {
+  case PAGE_OWNER_SLAB:
+    slab = (memory_slab_t *) owner;
+    object_size = slab->object_size;
+    if ((object_size == ((size_t) 0)) || ((const char *)ptr < slab->objects)) {
+      return PAGE_OWNER_NONE;
+    }
+    offset = (size_t) ((const char *)ptr - slab->objects);
+    if (((offset % object_size) != ((size_t) 0)) ||
+	(offset / object_size >= slab->object_count)) {
+      return PAGE_OWNER_NONE;
+    }
+    break;
+  case PAGE_OWNER_MAPPED:
+    if (owner != (void *) header) {
+      return PAGE_OWNER_NONE;
+    }
+    break;
+  case PAGE_OWNER_ARENA:
+    arena = (memory_arena_t *) owner;
+    if ((header < get_arena_first_block(arena)) ||
+	header->is_free || header->is_mapped || (header->size == ((size_t) 0)) ||
+	(header->size > (size_t) ((char *)arena - sizeof(memory_block_header_t) - (const char *)ptr))) {
+      return PAGE_OWNER_NONE;
+    }
+    break;
+  default:
+    break;
+  }
+  return kind;
+}
+
+/* This function counts the block at ptr, if any, as handed out to
+   the program, in the calling thread's shard, and now and then
+   samples it for the heap profiler. The caller must not hold any of
+   our locks.
+   - Returns ptr */
+static void *count_allocation(void *ptr) {
+  size_t size, *c;
+
+  if (ptr != NULL) {
+    size = get_usable_size(ptr);
+    stats_add(STATS_ALLOCATED_BYTES, size);
+    c = &(get_stats_shard()->size_classes[get_bin_index(size)]);
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + ((size_t) 1), __ATOMIC_RELAXED);
+    if ((profile_countdown -= (long long) size) < 0ll) {
+      take_profile_sample(ptr, size);
+    }
+  }
+  return ptr;
+}
+
+/* This function counts the block at ptr as given back by the
+   program, in the calling thread's shard. */
+static void count_release(void *ptr) {
+  stats_add(STATS_FREED_BYTES, get_usable_size(ptr));
+  drop_profile_sample(ptr);
+}
+
+/* This function allocates a block of at least size bytes, which is
+   what malloc does without counting the call itself. calloc and
+   realloc allocate through it, too.
+   - Returns a ptr to the usable memory of the block
+   - Returns NULL if no memory could be obtained */
+static void *allocate_memory(size_t size) {
+  struct rseq *rseq;
+  void *ptr;
+  size_t bin;
+
+  if (size == 0) {
+    /* If the size we want to allocate is zero, hand out a minimal
+       block anyway: like glibc, we return a unique pointer, which
+       programs such as gnulib's xmalloc users rely on. */
+    size = MEMORY_ALIGNMENT;
+  }
+  size = round_up_to_alignment(size);
+  if (size == 0) {
+    /* The size cannot even be rounded up */
+    return NULL;
+  }
+
+  /* Small sizes are served by the thread cache without a lock. If
+     the slabs cannot refill it, they come from the arenas. */
+  if (size <= THREAD_CACHE_MAX_SIZE) {
+    bin = size / THREAD_CACHE_GRANULE;
+    rseq = get_percpu_rseq();
+    if (rseq != NULL) {
+      ptr = percpu_cache_pop(rseq, bin);
+    } else {
+      ptr = thread_cache_pop(&thread_cache[bin]);
+    }
+    if (ptr != NULL) {
+      stats_add(STATS_CACHE_HITS, (size_t) 1);
+      return count_allocation(ptr);
+    }
+    if (rseq != NULL) {
+      ptr = percpu_cache_refill(rseq, bin);
+    } else {
+      ptr = thread_cache_refill(bin);
+    }
+    if (ptr != NULL) {
+      return count_allocation(ptr);
+    }
+  }
+
+  /* Large sizes get a mapping of their own */
+  if (size >= tunables[TUNABLE_MMAP_THRESHOLD]) {
+    return count_allocation(map_large_block(size, MEMORY_ALIGNMENT));
+  }
+
+  pthread_mutex_lock(&memory_management_lock);
+  ptr = get_ptr_next_memory_fit(size);
+  pthread_mutex_unlock(&memory_management_lock);
+  return count_allocation(ptr);
+}
+
+/* This function puts the slab object at ptr, of thread cache bin
+   bin, into the CPU's or the thread's cache, flushing the cache to
+   the slabs if it overflows. */
+static void release_cached_object(void *ptr, size_t bin) {
+  thread_cache_bin_t *tb;
+  struct rseq *rseq;
+
+  rseq = get_percpu_rseq();
+  if (rseq != NULL) {
+    if (!percpu_cache_push(rseq, bin, ptr)) {
+      percpu_cache_flush(rseq, bin, ptr);
+    }
+    return;
+  }
+  tb = &thread_cache[bin];
+  thread_cache_push(tb, ptr);
+  if (tb->count > tunables[TUNABLE_TCACHE_COUNT]) {
+    thread_cache_flush(tb, tunables[TUNABLE_TCACHE_COUNT] / ((size_t) 2));
+  } else if (get_thread_cache_bytes(stats_shard) > __atomic_load_n(&stats_shard->cache_limit, __ATOMIC_RELAXED)) {
+    grow_thread_cache_limit(stats_shard);
+    if (get_thread_cache_bytes(stats_shard) > __atomic_load_n(&stats_shard->cache_limit, __ATOMIC_RELAXED)) {
+      thread_cache_shrink();
+    }
+  }
+}
+
+/* This function gives the block at ptr back, which is what free
+   does without counting the call itself. ptr must not be NULL. */
+static void release_memory(void *ptr) {
+  memory_block_header_t *header;
+
+  count_release(ptr);
+
+  /* Slab objects go back to the CPU's or the thread's cache without
+     a lock */
+  if (is_slab_object(ptr)) {
+    release_cached_object(ptr, get_slab(ptr)->object_size / THREAD_CACHE_GRANULE);
+    return;
+  }
+
+  /* Look at the header struct that controls the current
+     memory block we want to free. */
+  header = (memory_block_header_t *)((char *)ptr - sizeof(memory_block_header_t));
+
+  if (header->is_mapped) {
+    unmap_large_block(header);
+    return;
+  }
+
+  /* Rather than wait for the lock, leave the block to its holder */
+  if (pthread_mutex_trylock(&memory_management_lock) != 0) {
+    push_remote_block(ptr);
+    return;
+  }
+  drain_remote_blocks();
+  release_memory_block(header);
+  pthread_mutex_unlock(&memory_management_lock);
+  start_background_thread();
+}
+
+/* This function returns the size of the slab class a block of size
+   bytes aligned to alignment is allocated from, the way
+   allocate_aligned_memory picks it, or the size rounded up to the
+   alignment of the heap if it is too big for the slabs.
+   - Returns 0 if the size cannot be rounded up */
+static size_t get_size_class(size_t alignment, size_t size) {
+  size_t class_size;
+
+  if (size == 0) {
+    size = MEMORY_ALIGNMENT;
+  }
+  size = round_up_to_alignment(size);
+  if ((alignment <= MEMORY_ALIGNMENT) || (size == 0) ||
+      (size > SLAB_MAX_OBJECT_SIZE) || (alignment > SLAB_MAX_OBJECT_SIZE)) {
+    return size;
+  }
+  for (class_size = alignment; class_size < size; class_size <<= 1);
+  return class_size;
+}
+
+/* This function frees the block at ptr, which was allocated with
+   size bytes aligned to alignment, like free. A slab object goes
+   back to its cache with the class computed from the size, without
+   reading its slab's descriptor or checking the pointer against the
+   page map: the size is trusted, as it is by the sized delete the
+   C++ compiler emits. realloc keeps a slab object only as long as
+   its class stays the same, so that the size it was last given
+   names the class. Any other block is freed like free does it, as
+   its header is read anyway. ptr must not be NULL. */
+static void release_sized_memory(void *ptr, size_t alignment, size_t size) {
+  size_t class_size = get_size_class(alignment, size);
+
+  if (is_slab_object(ptr) && (class_size != ((size_t) 0)) &&
+      (class_size <= THREAD_CACHE_MAX_SIZE)) {
+    stats_add(STATS_FREED_BYTES, class_size);
+    drop_profile_sample(ptr);
+    release_cached_object(ptr, class_size / THREAD_CACHE_GRANULE);
+    return;
+  }
+  if (get_block_owner(ptr) == PAGE_OWNER_NONE) {
+    stats_add(STATS_INVALID_POINTERS, (size_t) 1);
+    return;
+  }
+  release_memory(ptr);
+}
+
+/* This function allocates a block of at least size bytes whose
+   payload is aligned to alignment, a power of two, which is what
+   the aligned allocation functions share. Alignments the heap gives
+   anyway are served like malloc. Small requests take an object of a
+   power-of-two slab class, which is naturally aligned. Everything
+   else is carved out of an arena, or out of a dedicated mapping for
+   large blocks.
+   - Returns a ptr to the usable memory of the block
+   - Returns NULL if no memory could be obtained */
+static void *allocate_aligned_memory(size_t alignment, size_t size) {
+  void *ptr;
+  size_t class_size;
+
+  if (alignment <= MEMORY_ALIGNMENT) {
+    return allocate_memory(size);
+  }
+  if (size == 0) {
+    size = MEMORY_ALIGNMENT;
+  }
+  size = round_up_to_alignment(size);
+  if (size == 0) {
+    return NULL;
+  }
+
+  if ((size <= SLAB_MAX_OBJECT_SIZE) && (alignment <= SLAB_MAX_OBJECT_SIZE)) {
+    for (class_size = alignment; class_size < size; class_size <<= 1);
+    ptr = allocate_memory(class_size);
+    if ((ptr == NULL) || (get_alignment_padding(ptr, alignment) == ((size_t) 0))) {
+      return ptr;
+    }
+    /* The slabs could not provide it: carve it out of an arena */
+    release_memory(ptr);
+  }
+
+  if ((size >= tunables[TUNABLE_MMAP_THRESHOLD]) ||
+      (alignment >= tunables[TUNABLE_MMAP_THRESHOLD] - size)) {
+    return count_allocation(map_large_block(size, alignment));
+  }
+
+  pthread_mutex_lock(&memory_management_lock);
+  ptr = get_ptr_aligned_memory_fit(size, alignment);
+  pthread_mutex_unlock(&memory_management_lock);
+  return count_allocation(ptr);
+}
+
+/* Batches
+
+   malloc_batch hands out a whole run of blocks of one size under a
+   single acquisition of the lock that guards them. Small sizes come
+   straight from the slabs, which hand out the free objects of a slab
+   in address order, so a batch from a fresh slab is one contiguous
+   run. Sizes served by the arenas are carved out of one free block
+   big enough for the run, as a sequence of adjacent blocks; runs are
+   capped at BATCH_MAX_RUN_SIZE bytes so that they fit an arena of
+   ordinary size. free_batch sorts the pointers it gets by owner and
+   gives back all slab objects under one acquisition of slab_lock and
+   all arena blocks under one of memory_management_lock.
+*/
+#define BATCH_MAX_RUN_SIZE (ARENA_MAX_SIZE / ((size_t) 2))
+
+/* This function splits the allocated block described by header,
+   which is at least count blocks of size bytes long, headers in
+   between included, into that many adjacent blocks. The last one
+   keeps whatever is left. Their payloads go into out. The caller
+   must hold memory_management_lock. */
+static void split_memory_run(memory_block_header_t *header, size_t size, size_t count,
+			     void **out) {
+  memory_block_header_t *next;
+  size_t i;
+
+  for (i=(size_t) 0; i<count; i++) {
+    out[i] = (void *)((char *)header + sizeof(memory_block_header_t));
+    if (i == count - ((size_t) 1)) {
+      break;
+    }
+    next = (memory_block_header_t *)((char *)header + sizeof(memory_block_header_t) + size);
+    next->prev_size = (size_t) 0;
+    next->size = header->size - sizeof(memory_block_header_t) - size;
+    next->is_free = 0;
+    next->is_mapped = 0;
+    next->dirty_size = (size_t) 0;
+    if (header->dirty_size > size + sizeof(memory_block_header_t)) {
+      next->dirty_size = header->dirty_size - size - sizeof(memory_block_header_t);
+    }
+    header->size = size;
+    if (header->dirty_size > size) {
+      header->dirty_size = size;
+    }
+    header = next;
+  }
+}
+
+/* This function allocates up to n blocks of at least size bytes and
+   stores their addresses in out, as described above.
+   - Returns the number of blocks allocated, less than n only if
+     memory ran out */
+static size_t allocate_memory_batch(size_t size, size_t n, void **out) {
+  memory_block_header_t *header;
+  size_t done = (size_t) 0, count, i;
+  void *ptr;
+
+  if (size == 0) {
+    size = MEMORY_ALIGNMENT;
+  }
+  size = round_up_to_alignment(size);
+  if ((size == 0) || (n == ((size_t) 0))) {
+    return (size_t) 0;
+  }
+
+  if (size <= SLAB_MAX_OBJECT_SIZE) {
+    pthread_mutex_lock(&slab_lock);
+    drain_remote_slab_objects(size / MEMORY_ALIGNMENT);
+    done = take_slab_objects(size, out, n);
+    pthread_mutex_unlock(&slab_lock);
+  } else if (size < tunables[TUNABLE_MMAP_THRESHOLD]) {
+    pthread_mutex_lock(&memory_management_lock);
+    while (done < n) {
+      count = BATCH_MAX_RUN_SIZE / (size + sizeof(memory_block_header_t));
+      if (count > n - done) count = n - done;
+      if (count < ((size_t) 1)) count = (size_t) 1;
+      ptr = get_ptr_next_memory_fit(count * (size + sizeof(memory_block_header_t)) -
+				    sizeof(memory_block_header_t));
+      if (ptr == NULL) {
+	break;
+      }
+      header = (memory_block_header_t *)((char *)ptr - sizeof(memory_block_header_t));
+      split_memory_run(header, size, count, &out[done]);
+      done += count;
+    }
+    pthread_mutex_unlock(&memory_management_lock);
+  } else {
+    for (; done < n; done++) {
+      out[done] = map_large_block(size, MEMORY_ALIGNMENT);
+      if (out[done] == NULL) {
+	break;
+      }
+    }
+  }
+
+  for (i=(size_t) 0; i<done; i++) {
+    count_allocation(out[i]);
+  }
+  return done;
+}
+
+/* This function frees the n blocks at ptrs, skipping NULL and
+   rejecting pointers that are not ours, as described above. Large
+   blocks are unmapped last, so that no pointer of the batch can name
+   memory that was mapped again in the meantime. */
+static void release_memory_batch(void **ptrs, size_t n) {
+  size_t i, slab_count = (size_t) 0, arena_count = (size_t) 0, mapped_count = (size_t) 0;
+  page_owner_kind_t kind;
+
+  for (i=(size_t) 0; i<n; i++) {
+    if (ptrs[i] == NULL) {
+      continue;
+    }
+    kind = get_block_owner(ptrs[i]);
+    if (kind == PAGE_OWNER_NONE) {
+      stats_add(STATS_INVALID_POINTERS, (size_t) 1);
+    } else if (kind == PAGE_OWNER_SLAB) {
+      slab_count++;
+    } else if (kind == PAGE_OWNER_ARENA) {
+      arena_count++;
+    } else {
+      mapped_count++;
+    }
+  }
+
+  if (slab_count > ((size_t) 0)) {
+    pthread_mutex_lock(&slab_lock);
+    for (i=(size_t) 0; i<n; i++) {
+      if ((ptrs[i] != NULL) && (get_block_owner(ptrs[i]) == PAGE_OWNER_SLAB)) {
+	count_release(ptrs[i]);
+	release_slab_object(ptrs[i]);
+      }
+    }
+    pthread_mutex_unlock(&slab_lock);
+  }
+
+  if (arena_count > ((size_t) 0)) {
+    pthread_mutex_lock(&memory_management_lock);
+    drain_remote_blocks();
+    for (i=(size_t) 0; i<n; i++) {
+      if ((ptrs[i] != NULL) && (get_block_owner(ptrs[i]) == PAGE_OWNER_ARENA)) {
+	count_release(ptrs[i]);
+	release_memory_block((memory_block_header_t *)((char *)ptrs[i] - sizeof(memory_block_header_t)));
+      }
+    }
+    pthread_mutex_unlock(&memory_management_lock);
+  }
+
+  if (mapped_count > ((size_t) 0)) {
+    for (i=(size_t) 0; i<n; i++) {
+      if ((ptrs[i] != NULL) && (get_block_owner(ptrs[i]) == PAGE_OWNER_MAPPED)) {
+	count_release(ptrs[i]);
+	unmap_large_block((memory_block_header_t *)((char *)ptrs[i] - sizeof(memory_block_header_t)));
+      }
+    }
+  }
+}
+
+/* Background thread
+
+   With the background_thread tunable set, a thread of ours gives
+   memory back to the kernel in the place of free. It wakes up
+   DECAY_STEPS times per decay_ms window. Each time, it notes how
+   many bytes of free tree blocks have been dirtied since its last
+   wakeup, and purges the biggest blocks until what is left dirty is
+   no more than what the last window's worth of wakeups dirtied,
+   each wakeup's share weighted by a smoothstep curve that falls from
+   1 to 0 over the window. Memory freed just now thus stays, for a
+   program that allocates it again soon, while memory that stays
+   free is given back over decay_ms, and the resident set of an idle
+   program converges to what it uses. Once per window, the thread
+   also unmaps the arenas that have been free for a whole window, as
+   a purge pass does, gives the objects left on the slabs' remote
+   lists back to their slabs and purges the empty slabs.
+
+   The thread is started lazily, by the first free of an arena block
+   after the tunable has been set, once memory_management_lock has
+   been released: pthread_create allocates. A child process starts
+   its own. The thread's CPU time is part of the statistics.
+*/
+#define DECAY_STEPS 20
+#define DECAY_WEIGHT_ONE ((size_t) (DECAY_STEPS * DECAY_STEPS * DECAY_STEPS))
+
+/* Bytes of free tree blocks dirtied in each of the last DECAY_STEPS
+   wakeups, the most recent first, and the dirty bytes the last
+   wakeup left. Protected by memory_management_lock. */
+static size_t decay_backlog[DECAY_STEPS];
+static size_t decay_dirty_bytes = (size_t) 0;
+static int decay_stalled = 0;
+
+/* This function returns the weight of the bytes dirtied age
+   wakeups ago, out of DECAY_WEIGHT_ONE: 1 - smoothstep(age /
+   DECAY_STEPS). */
+static size_t get_decay_weight(size_t age) {
+  size_t steps = (size_t) DECAY_STEPS;
+
+  return DECAY_WEIGHT_ONE - ((size_t) 3) * age * age * steps + ((size_t) 2) * age * age * age;
+}
+
+/* This function purges the dirty bytes of the free tree blocks
+   beyond what the decay curve allows, as described above. The
+   caller must hold memory_management_lock. */
+static void decay_dirty_memory() {
+  size_t dirty = heap_stats.dirty_bytes, limit = (size_t) 0, fresh, i;
+
+  fresh = (dirty > decay_dirty_bytes) ? dirty - decay_dirty_bytes : (size_t) 0;
+  for (i=(size_t) (DECAY_STEPS - 1); i>(size_t) 0; i--) {
+    decay_backlog[i] = decay_backlog[i - ((size_t) 1)];
+  }
+  decay_backlog[0] = fresh;
+  for (i=(size_t) 0; i<(size_t) DECAY_STEPS; i++) {
+    limit += (decay_backlog[i] / DECAY_WEIGHT_ONE) * get_decay_weight(i) +
+      ((decay_backlog[i] % DECAY_WEIGHT_ONE) * get_decay_weight(i)) / DECAY_WEIGHT_ONE;
+  }
+  /* What cannot be purged, the partial pages at the ends of the
+     blocks, is not looked for again until something new is dirtied */
+  if ((dirty > limit) && (!decay_stalled || (fresh > ((size_t) 0)))) {
+    decay_stalled = (purge_free_tree_bytes(free_tree, dirty - limit) == ((size_t) 0));
+  }
+  decay_dirty_bytes = heap_stats.dirty_bytes;
+}
+
+/* This function returns the CPU time of the calling thread in ns. */
+static unsigned long long get_thread_cpu_time_ns() {
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+    return 0ull;
+  }
+  return ((unsigned long long) ts.tv_sec) * 1000000000ull + ((unsigned long long) ts.tv_nsec);
+}
+
+static void *background_thread_main(void *arg) {
+  unsigned long long start;
+  unsigned int wakeup = 0u;
+  struct timespec ts;
+  size_t tick_ms, class;
+  sigset_t signals;
+
+  /* Signals are for the program's threads */
+  sigfillset(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  for (;;) {
+    tick_ms = tunables[TUNABLE_DECAY_MS] / ((size_t) DECAY_STEPS);
+    if (tick_ms == ((size_t) 0)) {
+      tick_ms = (size_t) 1;
+    }
+    ts.tv_sec = (time_t) (tick_ms / ((size_t) 1000));
+    ts.tv_nsec = ((long) (tick_ms % ((size_t) 1000))) * 1000000l;
+    nanosleep(&ts, NULL);
+
+    start = get_thread_cpu_time_ns();
+    pthread_mutex_lock(&memory_management_lock);
+    if (!tunables[TUNABLE_BACKGROUND_THREAD]) {
+      __atomic_store_n(&background_thread_state, BACKGROUND_THREAD_OFF, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&memory_management_lock);
       return NULL;
     }
-    
-    /* Copy the contents from the old memory block to the new memory block
-       The minimum size to copy is the minimum of the old and new sizes
-    */
-    __memcpy(new_ptr, ptr, size);
+    drain_remote_blocks();
+    decay_dirty_memory();
+    if (++wakeup >= (unsigned int) DECAY_STEPS) {
+      unmap_free_arenas(tunables[TUNABLE_TRIM_THRESHOLD], 0);
+      purge_epoch++;
+    }
+    pthread_mutex_unlock(&memory_management_lock);
 
-    /* Free the old memory block */
-    free(ptr);
+    if (wakeup >= (unsigned int) DECAY_STEPS) {
+      wakeup = 0u;
+      pthread_mutex_lock(&slab_lock);
+      for (class=(size_t) 1; class<SLAB_CLASS_COUNT; class++) {
+	drain_remote_slab_objects(class);
+      }
+      purge_empty_slabs();
+      pthread_mutex_unlock(&slab_lock);
+    }
 
-    return new_ptr;
+    __atomic_fetch_add(&heap_stats.background_wakeups, (size_t) 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&heap_stats.background_cpu_ns,
+		       (size_t) (get_thread_cpu_time_ns() - start), __ATOMIC_RELAXED);
   }
   return NULL;
 }
 
-void __free_impl(void *ptr) {
-  memory_block_header_t *header, *prev_header, *next_header;
+/* This function starts the background thread if it is wanted and
+   not started yet. The caller must not hold any of our locks. */
+static void start_background_thread() {
+  pthread_attr_t attr;
+  pthread_t thread;
+  int expected = BACKGROUND_THREAD_WANTED, res;
 
-  if (ptr != NULL) {
-    /* Nothing to free */
-    return; 
+  if (__atomic_load_n(&background_thread_state, __ATOMIC_RELAXED) != BACKGROUND_THREAD_WANTED) {
+    return;
+  }
+  if (!__atomic_compare_exchange_n(&background_thread_state, &expected, BACKGROUND_THREAD_STARTING,
+				   0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    return;
+  }
+  res = pthread_attr_init(&attr);
+  if (res == 0) {
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    res = pthread_create(&thread, &attr, background_thread_main, NULL);
+    pthread_attr_destroy(&attr);
+  }
+  /* If there is no thread, free keeps purging by itself */
+  __atomic_store_n(&background_thread_state,
+		   (res == 0) ? BACKGROUND_THREAD_RUNNING : BACKGROUND_THREAD_OFF, __ATOMIC_RELAXED);
+}
+
+/* Fork handlers
+
+   The child of a fork has only the thread that forked, so a lock
+   that another thread, such as the background thread, held at that
+   moment would stay held there forever. Before a fork, the parent
+   thus takes memory_management_lock, slab_lock and profile_lock,
+   which never nest elsewhere, in this order; both processes release
+   them afterwards. stats_shard_lock is reinitialised in the child
+   instead, along with the shards of the threads that are gone. */
+
+/* This function takes our locks before a fork. */
+static void lock_before_fork() {
+  pthread_mutex_lock(&memory_management_lock);
+  pthread_mutex_lock(&slab_lock);
+  pthread_mutex_lock(&profile_lock);
+}
+
+/* This function releases our locks in the parent after a fork. */
+static void unlock_after_fork_in_parent() {
+  pthread_mutex_unlock(&profile_lock);
+  pthread_mutex_unlock(&slab_lock);
+  pthread_mutex_unlock(&memory_management_lock);
+}
+
+/* This function releases our locks in the child after a fork. The
+   background thread is gone there: it is started again by the next
+   free, if it was running. The profile watcher is started again
+   right away. */
+static void unlock_after_fork_in_child() {
+  pthread_mutex_unlock(&profile_lock);
+  pthread_mutex_unlock(&slab_lock);
+  pthread_mutex_unlock(&memory_management_lock);
+  if (__atomic_load_n(&background_thread_state, __ATOMIC_RELAXED) != BACKGROUND_THREAD_OFF) {
+    __atomic_store_n(&background_thread_state, BACKGROUND_THREAD_WANTED, __ATOMIC_RELAXED);
+  }
+  restart_profile_watcher_in_child();
+}
+
+/* This function registers the fork handlers, once, at load time. */
+__attribute__((constructor))
+static void register_fork_handlers() {
+  pthread_atfork(lock_before_fork, unlock_after_fork_in_parent, unlock_after_fork_in_child);
+}
+
+/* This function sets the tunable tunable to value, if value is in
+   its range. The caller must hold memory_management_lock.
+   - Returns 1 on success
+   - Returns 0 if value is out of range */
+static int set_tunable(memory_tunable_t tunable, size_t value) {
+  switch (tunable) {
+  case TUNABLE_ARENA_GROWTH:
+    if ((value < ((size_t) 1)) || (value > ((size_t) 16))) return 0;
+    break;
+  case TUNABLE_DECAY_MS:
+    if (value > (size_t) (24 * 3600 * 1000)) return 0;
+    break;
+  case TUNABLE_HUGE_PAGES:
+    if (value > (size_t) HUGE_PAGES_HUGETLB) return 0;
+    break;
+  case TUNABLE_PERCPU_CACHE:
+  case TUNABLE_BACKGROUND_THREAD:
+    if (value > ((size_t) 1)) return 0;
+    break;
+  default:
+    break;
+  }
+  tunables[tunable] = value;
+  if ((tunable == TUNABLE_BACKGROUND_THREAD) && (value != ((size_t) 0))) {
+    /* A thread that is about to stop sees the tunable set again */
+    int expected = BACKGROUND_THREAD_OFF;
+    __atomic_compare_exchange_n(&background_thread_state, &expected, BACKGROUND_THREAD_WANTED,
+				0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  }
+  if (tunable == TUNABLE_DECAY_MS) {
+    /* Do not wait out the old interval */
+    next_purge_time = 0ull;
+  }
+  return 1;
+}
+
+/* This function parses the value of the tunable tunable, the len
+   bytes at value: a decimal number, with a k, m or g suffix, or one
+   of the names of the modes.
+   - Returns 1 on success, storing the value in *result
+   - Returns 0 if value is malformed */
+static int parse_tunable_value(memory_tunable_t tunable, const char *value, size_t len,
+			       size_t *result) {
+  static const char *const mode_names[] = { "off", "thp", "hugetlb", "no", "yes" };
+  static const size_t mode_values[] = { 0, 1, 2, 0, 1 };
+  size_t i, number, shift;
+
+  if ((tunable == TUNABLE_HUGE_PAGES) || (tunable == TUNABLE_PERCPU_CACHE) ||
+      (tunable == TUNABLE_BACKGROUND_THREAD)) {
+    for (i=(size_t) 0; i<sizeof(mode_values) / sizeof(mode_values[0]); i++) {
+      if ((strlen(mode_names[i]) == len) && (!strncmp(mode_names[i], value, len))) {
+	*result = mode_values[i];
+	return 1;
+      }
+    }
+  }
+  if (len == ((size_t) 0)) {
+    return 0;
+  }
+  shift = (size_t) 0;
+  switch (value[len - ((size_t) 1)]) {
+  case 'g': case 'G': shift += (size_t) 10; /* fall through */
+  case 'm': case 'M': shift += (size_t) 10; /* fall through */
+  case 'k': case 'K': shift += (size_t) 10;
+    len--;
+    break;
+  }
+  if (len == ((size_t) 0)) {
+    return 0;
+  }
+  number = (size_t) 0;
+  for (i=(size_t) 0; i<len; i++) {
+    if ((value[i] < '0') || (value[i] > '9') ||
+	(number > (((size_t) -1) - ((size_t) 9)) / ((size_t) 10))) {
+      return 0;
+    }
+    number = number * ((size_t) 10) + ((size_t) (value[i] - '0'));
+  }
+  if ((number << shift) >> shift != number) {
+    return 0;
+  }
+  *result = number << shift;
+  return 1;
+}
+
+/* This function applies the key=value pairs of the environment
+   variable MEMORY_TUNE, once, at load time. */
+__attribute__((constructor))
+static void load_tunables() {
+  const char *pair, *equals, *end;
+  size_t i, key_len, value;
+  char *env_var;
+
+  env_var = getenv("MEMORY_TUNE");
+  if (env_var == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&memory_management_lock);
+  for (pair = env_var; *pair != '\0'; pair = (*end == ',') ? end + 1 : end) {
+    end = strchr(pair, ',');
+    if (end == NULL) {
+      end = pair + strlen(pair);
+    }
+    equals = memchr(pair, '=', (size_t) (end - pair));
+    if (equals == NULL) {
+      continue;
+    }
+    key_len = (size_t) (equals - pair);
+    for (i=(size_t) 0; i<TUNABLE_COUNT; i++) {
+      if ((strlen(tunable_names[i]) == key_len) && (!strncmp(tunable_names[i], pair, key_len))) {
+	if (parse_tunable_value((memory_tunable_t) i, equals + 1,
+				(size_t) (end - equals - 1), &value)) {
+	  set_tunable((memory_tunable_t) i, value);
+	}
+	break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&memory_management_lock);
+}
+
+/* A consistent enough view of the statistics: the sum of all
+   shards, which may be slightly out of date with respect to each
+   other, and a copy of heap_stats taken under the lock. */
+typedef struct memory_stats_snapshot {
+  size_t counters[STATS_COUNTER_COUNT];
+  size_t size_classes[FREE_BIN_COUNT];
+  memory_heap_stats_t heap;
+  memory_slab_stats_t slabs;
+  size_t free_arena_bytes;
+  size_t tunables[TUNABLE_COUNT];
+  size_t thread_count;
+  size_t thread_cache_claimed;
+  size_t in_use_bytes;
+  size_t reserved_bytes;
+  double fragmentation;
+} memory_stats_snapshot_t;
+
+/* This function fills snapshot with the current statistics. */
+static void take_stats_snapshot(memory_stats_snapshot_t *snapshot) {
+  memory_stats_shard_t *shard;
+  size_t i;
+
+  __memset(snapshot, 0, sizeof(memory_stats_snapshot_t));
+  for (shard = __atomic_load_n(&stats_shard_list, __ATOMIC_ACQUIRE);
+       shard != NULL;
+       shard = shard->next) {
+    if (__atomic_load_n(&shard->live, __ATOMIC_RELAXED)) {
+      snapshot->thread_count++;
+    }
+    for (i=(size_t) 0; i<STATS_COUNTER_COUNT; i++) {
+      snapshot->counters[i] += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+    }
+    for (i=(size_t) 0; i<FREE_BIN_COUNT; i++) {
+      snapshot->size_classes[i] += __atomic_load_n(&shard->size_classes[i], __ATOMIC_RELAXED);
+    }
+  }
+
+  pthread_mutex_lock(&memory_management_lock);
+  snapshot->heap = heap_stats;
+  snapshot->free_arena_bytes = free_arena_bytes;
+  for (i=(size_t) 0; i<TUNABLE_COUNT; i++) {
+    snapshot->tunables[i] = tunables[i];
+  }
+  pthread_mutex_unlock(&memory_management_lock);
+  pthread_mutex_lock(&slab_lock);
+  snapshot->slabs = slab_stats;
+  pthread_mutex_unlock(&slab_lock);
+  pthread_mutex_lock(&stats_shard_lock);
+  snapshot->thread_cache_claimed = thread_cache_claimed;
+  pthread_mutex_unlock(&stats_shard_lock);
+
+  /* Fragmentation is the share of the memory we got from the kernel,
+     and have not given back, that does not hold anything the program
+     asked for: free blocks and objects, cached objects, headers and
+     rounding. */
+  snapshot->in_use_bytes = snapshot->counters[STATS_ALLOCATED_BYTES] - snapshot->counters[STATS_FREED_BYTES];
+  snapshot->reserved_bytes = snapshot->heap.arena_bytes + snapshot->slabs.slab_bytes -
+    snapshot->slabs.released_bytes + snapshot->counters[STATS_MAPPED_BYTES];
+  if ((snapshot->reserved_bytes > ((size_t) 0)) &&
+      (snapshot->in_use_bytes <= snapshot->reserved_bytes)) {
+    snapshot->fragmentation = 1.0 - ((double) snapshot->in_use_bytes) / ((double) snapshot->reserved_bytes);
+  }
+}
+
+/* This function returns the next shard after shard, or the first
+   one if shard is NULL, that belongs to a live thread. The reports
+   walk the threads with it, outside of any snapshot: a thread may
+   come or go while they do.
+   - Returns NULL after the last one */
+static memory_stats_shard_t *get_next_live_shard(memory_stats_shard_t *shard) {
+  shard = (shard == NULL) ? __atomic_load_n(&stats_shard_list, __ATOMIC_ACQUIRE) : shard->next;
+  while ((shard != NULL) && !__atomic_load_n(&shard->live, __ATOMIC_RELAXED)) {
+    shard = shard->next;
+  }
+  return shard;
+}
+
+/* This function computes the smallest and the largest block size
+   counted in the size class histogram under index bin. */
+static void get_bin_bounds(size_t bin, size_t *from, size_t *to) {
+  size_t power;
+
+  if (bin <= SMALL_BIN_COUNT) {
+    *from = bin * MEMORY_ALIGNMENT;
+    *to = *from;
+    return;
+  }
+  power = SMALL_BIN_MAX_SIZE << (bin - SMALL_BIN_COUNT - ((size_t) 1));
+  *from = (bin == SMALL_BIN_COUNT + ((size_t) 1)) ? power + MEMORY_ALIGNMENT : power;
+  *to = (power << 1) - MEMORY_ALIGNMENT;
+}
+
+/* This function writes snapshot to fp as XML, in the spirit of
+   glibc's malloc_info. */
+static void write_stats_xml(FILE *fp, const memory_stats_snapshot_t *snapshot) {
+  memory_stats_shard_t *shard;
+  size_t i, from, to;
+
+  fprintf(fp, "<malloc version=\"1\">\n");
+  fprintf(fp, "<counters>\n");
+  for (i=(size_t) 0; i<STATS_COUNTER_COUNT; i++) {
+    fprintf(fp, "<counter name=\"%s\" value=\"%zu\"/>\n",
+	    stats_counter_names[i], snapshot->counters[i]);
+  }
+  fprintf(fp, "</counters>\n");
+  fprintf(fp, "<tunables>\n");
+  for (i=(size_t) 0; i<TUNABLE_COUNT; i++) {
+    fprintf(fp, "<tunable name=\"%s\" value=\"%zu\"/>\n",
+	    tunable_names[i], snapshot->tunables[i]);
+  }
+  fprintf(fp, "</tunables>\n");
+  fprintf(fp, "<heap threads=\"%zu\" arenas=\"%zu\" arena_bytes=\"%zu\" "
+	  "huge_arena_bytes=\"%zu\" free_arena_bytes=\"%zu\" free_blocks=\"%zu\" free_bytes=\"%zu\" "
+	  "dirty_bytes=\"%zu\" purged_bytes=\"%zu\"/>\n",
+	  snapshot->thread_count, snapshot->heap.arena_count, snapshot->heap.arena_bytes,
+	  snapshot->heap.huge_arena_bytes, snapshot->free_arena_bytes, snapshot->heap.free_block_count,
+	  snapshot->heap.free_block_bytes, snapshot->heap.dirty_bytes, snapshot->heap.purged_bytes);
+  fprintf(fp, "<background wakeups=\"%zu\" cpu_ns=\"%zu\"/>\n",
+	  snapshot->heap.background_wakeups, snapshot->heap.background_cpu_ns);
+  fprintf(fp, "<thread_caches budget=\"%zu\" claimed=\"%zu\">\n",
+	  snapshot->tunables[TUNABLE_TCACHE_BYTES], snapshot->thread_cache_claimed);
+  for (shard = get_next_live_shard(NULL); shard != NULL; shard = get_next_live_shard(shard)) {
+    fprintf(fp, "<thread tid=\"%d\" cached_bytes=\"%zu\" limit=\"%zu\"/>\n", (int) shard->tid,
+	    get_thread_cache_bytes(shard),
+	    __atomic_load_n(&shard->cache_limit, __ATOMIC_RELAXED));
+  }
+  fprintf(fp, "</thread_caches>\n");
+  fprintf(fp, "<slabs count=\"%zu\" bytes=\"%zu\" empty=\"%zu\" "
+	  "free_objects=\"%zu\" free_bytes=\"%zu\" purged_bytes=\"%zu\" released_bytes=\"%zu\"/>\n",
+	  snapshot->slabs.slab_count, snapshot->slabs.slab_bytes,
+	  snapshot->slabs.empty_slab_count, snapshot->slabs.free_object_count,
+	  snapshot->slabs.free_object_bytes, snapshot->slabs.purged_bytes,
+	  snapshot->slabs.released_bytes);
+  fprintf(fp, "<total type=\"in_use\" size=\"%zu\"/>\n", snapshot->in_use_bytes);
+  fprintf(fp, "<total type=\"reserved\" size=\"%zu\"/>\n", snapshot->reserved_bytes);
+  fprintf(fp, "<fragmentation ratio=\"%.4f\"/>\n", snapshot->fragmentation);
+  fprintf(fp, "<sizes>\n");
+  for (i=(size_t) 1; i<FREE_BIN_COUNT; i++) {
+    if (snapshot->size_classes[i] > ((size_t) 0)) {
+      get_bin_bounds(i, &from, &to);
+      fprintf(fp, "<size from=\"%zu\" to=\"%zu\" count=\"%zu\"/>\n",
+	      from, to, snapshot->size_classes[i]);
+    }
+  }
+  fprintf(fp, "</sizes>\n");
+  fprintf(fp, "</malloc>\n");
+}
+
+/* This function writes snapshot to fp as a JSON object with the
+   same contents as the XML variant. */
+static void write_stats_json(FILE *fp, const memory_stats_snapshot_t *snapshot) {
+  memory_stats_shard_t *shard;
+  size_t i, from, to;
+  const char *sep;
+
+  fprintf(fp, "{\n  \"counters\": {");
+  for (i=(size_t) 0; i<STATS_COUNTER_COUNT; i++) {
+    fprintf(fp, "%s\n    \"%s\": %zu", (i == ((size_t) 0)) ? "" : ",",
+	    stats_counter_names[i], snapshot->counters[i]);
+  }
+  fprintf(fp, "\n  },\n");
+  fprintf(fp, "  \"tunables\": {");
+  for (i=(size_t) 0; i<TUNABLE_COUNT; i++) {
+    fprintf(fp, "%s\n    \"%s\": %zu", (i == ((size_t) 0)) ? "" : ",",
+	    tunable_names[i], snapshot->tunables[i]);
+  }
+  fprintf(fp, "\n  },\n");
+  fprintf(fp, "  \"heap\": {\"threads\": %zu, \"arenas\": %zu, \"arena_bytes\": %zu, "
+	  "\"huge_arena_bytes\": %zu, \"free_arena_bytes\": %zu, \"free_blocks\": %zu, \"free_bytes\": %zu, "
+	  "\"dirty_bytes\": %zu, \"purged_bytes\": %zu},\n",
+	  snapshot->thread_count, snapshot->heap.arena_count, snapshot->heap.arena_bytes,
+	  snapshot->heap.huge_arena_bytes, snapshot->free_arena_bytes, snapshot->heap.free_block_count,
+	  snapshot->heap.free_block_bytes, snapshot->heap.dirty_bytes, snapshot->heap.purged_bytes);
+  fprintf(fp, "  \"background\": {\"wakeups\": %zu, \"cpu_ns\": %zu},\n",
+	  snapshot->heap.background_wakeups, snapshot->heap.background_cpu_ns);
+  fprintf(fp, "  \"thread_caches\": {\"budget\": %zu, \"claimed\": %zu, \"threads\": [",
+	  snapshot->tunables[TUNABLE_TCACHE_BYTES], snapshot->thread_cache_claimed);
+  sep = "";
+  for (shard = get_next_live_shard(NULL); shard != NULL; shard = get_next_live_shard(shard)) {
+    fprintf(fp, "%s\n    {\"tid\": %d, \"cached_bytes\": %zu, \"limit\": %zu}", sep, (int) shard->tid,
+	    get_thread_cache_bytes(shard),
+	    __atomic_load_n(&shard->cache_limit, __ATOMIC_RELAXED));
+    sep = ",";
+  }
+  fprintf(fp, "\n  ]},\n");
+  fprintf(fp, "  \"slabs\": {\"count\": %zu, \"bytes\": %zu, \"empty\": %zu, "
+	  "\"free_objects\": %zu, \"free_bytes\": %zu, \"purged_bytes\": %zu, \"released_bytes\": %zu},\n",
+	  snapshot->slabs.slab_count, snapshot->slabs.slab_bytes,
+	  snapshot->slabs.empty_slab_count, snapshot->slabs.free_object_count,
+	  snapshot->slabs.free_object_bytes, snapshot->slabs.purged_bytes,
+	  snapshot->slabs.released_bytes);
+  fprintf(fp, "  \"in_use_bytes\": %zu,\n", snapshot->in_use_bytes);
+  fprintf(fp, "  \"reserved_bytes\": %zu,\n", snapshot->reserved_bytes);
+  fprintf(fp, "  \"fragmentation\": %.4f,\n", snapshot->fragmentation);
+  fprintf(fp, "  \"sizes\": [");
+  sep = "";
+  for (i=(size_t) 1; i<FREE_BIN_COUNT; i++) {
+    if (snapshot->size_classes[i] > ((size_t) 0)) {
+      get_bin_bounds(i, &from, &to);
+      fprintf(fp, "%s\n    {\"from\": %zu, \"to\": %zu, \"count\": %zu}",
+	      sep, from, to, snapshot->size_classes[i]);
+      sep = ",";
+    }
+  }
+  fprintf(fp, "\n  ]\n}\n");
+}
+
+/* End of your helper functions */
+
+/* Start of the actual malloc/calloc/realloc/free functions */
+
+void *__malloc_impl(size_t size) {
+  stats_add(STATS_MALLOC_CALLS, (size_t) 1);
+  stats_add(STATS_REQUESTED_BYTES, size);
+  return allocate_memory(size);
+}
+
+
+void *__calloc_impl(size_t nmemb, size_t size) {
+  void *allocated_block;
+  size_t multiplication_result;
+  size_t dirty_size;
+  
+  stats_add(STATS_CALLOC_CALLS, (size_t) 1);
+
+  /* Get total space we need by multiplying nmmeb and size */
+  if (__try_size_t_multiply(&multiplication_result, nmemb, size) == 0) {
+    return NULL;  
+  }
+  stats_add(STATS_REQUESTED_BYTES, multiplication_result);
+
+  /* Multiplication was sucessful, now we know how much space to allocate*/
+  allocated_block = allocate_memory(multiplication_result);
+  
+  if (allocated_block == NULL) {
+    return NULL;
+  }
+
+  /* Initialize every byte to zero. Only the bytes that may have
+     been written to since the kernel handed them out need it: none
+     for a dedicated mapping or fresh arena memory, all of them for
+     a recycled block. Slab objects are small and always zeroed. */
+  if (is_slab_object(allocated_block)) {
+    dirty_size = multiplication_result;
+  } else {
+    dirty_size = ((memory_block_header_t *)((char *)allocated_block -
+					    sizeof(memory_block_header_t)))->dirty_size;
+  }
+  if (dirty_size > multiplication_result) {
+    dirty_size = multiplication_result;
+  }
+  __memset(allocated_block, 0, dirty_size);
+  return allocated_block;
+}
+
+
+void *__realloc_impl(void *ptr, size_t size) {
+  void *new_ptr;
+  memory_block_header_t *header;
+  size_t new_size, old_size;
+  page_owner_kind_t kind;
+  int grown;
+  
+  stats_add(STATS_REALLOC_CALLS, (size_t) 1);
+  stats_add(STATS_REQUESTED_BYTES, size);
+
+  /* If ptr is NULL, behaves like malloc(size) */
+  if (ptr == NULL) {
+    return allocate_memory(size);
+  }
+  
+  /* A pointer that is not ours is left alone, and so is the
+     program's data: we cannot know how much of it there is. */
+  kind = get_block_owner(ptr);
+  if (kind == PAGE_OWNER_NONE) {
+    stats_add(STATS_INVALID_POINTERS, (size_t) 1);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  /* If size is 0, behaves like free(ptr) and returns NULL */
+  if (size == 0) {
+    release_memory(ptr);
+    return NULL;
+  }
+  new_size = round_up_to_alignment(size);
+  if (new_size == 0) {
+    return NULL;
   }
+  old_size = get_usable_size(ptr);
   
   /* Look at the header struct that controls the current
-     memory block we want to free. */
+     memory block we want to resize. */
   header = (memory_block_header_t *)((char *)ptr - sizeof(memory_block_header_t));
 
-  /* Free chunk of memory by setting its header is_free
-     attribute to 1 */
-  header->is_free = 1;
-
-  /* Handle the case where we need to coalesce either the now free
-     memory block with the previous memory block if it is free
-     or the consequent block if it is free */
+  if (kind == PAGE_OWNER_SLAB) {
+    /* A slab object cannot change size; it is kept as long as its
+       class stays the same, see release_sized_memory. */
+    if (new_size == old_size) {
+      return ptr;
+    }
+  } else if (kind == PAGE_OWNER_MAPPED) {
+    /* A block with a dedicated mapping that stays large is
+       resized by the kernel, without copying anything. */
+    if (new_size >= tunables[TUNABLE_MMAP_THRESHOLD]) {
+      new_ptr = remap_large_block(header, new_size);
+      if (new_ptr == NULL) {
+	return NULL;
+      }
+      stats_add(STATS_FREED_BYTES, old_size);
+      drop_profile_sample(ptr);
+      return count_allocation(new_ptr);
+    }
+  } else if (new_size <= header->size) {
+    /* Shrink in place by splitting off the tail, if it is big
+       enough to make a block of its own. */
+    if (check_enough_space_for_header_after_allocation(header, new_size)) {
+      count_release(ptr);
+      pthread_mutex_lock(&memory_management_lock);
+      shrink_memory_block(header, new_size);
+      pthread_mutex_unlock(&memory_management_lock);
+      count_allocation(ptr);
+    }
+    return ptr;
+  } else if (new_size < tunables[TUNABLE_MMAP_THRESHOLD]) {
+    /* Grow in place if the following block is free and big enough */
+    pthread_mutex_lock(&memory_management_lock);
+    grown = grow_memory_block(header, new_size);
+    pthread_mutex_unlock(&memory_management_lock);
+    if (grown) {
+      stats_add(STATS_FREED_BYTES, old_size);
+      drop_profile_sample(ptr);
+      return count_allocation(ptr);
+    }
+  }
 
-  /* Check next header:
-     - If it exists
-     - If it is free
-     - And if both headers are in a continuous chunk of memory
-  */
-  next_header = (memory_block_header_t *)((char *)header + sizeof(memory_block_header_t) + header->size);
-  if (next_header != NULL && header->next->is_free &&
-     ((char *)next_header == ((char *)header) + sizeof(memory_block_header_t) + header->size)) {
-    /* We must merge the two blocks to create one big block */
-    header->next = next_header->next;
-    header->size += sizeof(memory_block_header_t) + next_header->size;
-  }
-
-  /* Check previous header:
-     - If it exists
-     - If it is free
-     - And if both headers are in a continuous chunk of memory
+  /* Allocate a new memory block of the requested size */
+  new_ptr = allocate_memory(size);
+  if (new_ptr == NULL) {
+    return NULL;
+  }
+    
+  /* Copy the contents from the old memory block to the new memory block
+     The minimum size to copy is the minimum of the old and new sizes
   */
-  prev_header = free_block_list;
-  while (prev_header->next != header) {
-    prev_header = prev_header->next;
+  __memcpy(new_ptr, ptr, (old_size < size) ? old_size : size);
+
+  /* Free the old memory block */
+  release_memory(ptr);
+
+  return new_ptr;
+}
+
+void __free_impl(void *ptr) {
+  stats_add(STATS_FREE_CALLS, (size_t) 1);
+
+  if (ptr == NULL) {
+    /* Nothing to free */
+    return; 
+  }
+  if (get_block_owner(ptr) == PAGE_OWNER_NONE) {
+    /* Not ours: giving it to the heap would corrupt it */
+    stats_add(STATS_INVALID_POINTERS, (size_t) 1);
+    return;
+  }
+  release_memory(ptr);
+}
+
+/* C23's free_sized: like free, given the size ptr was allocated
+   with, see release_sized_memory */
+void __free_sized_impl(void *ptr, size_t size) {
+  stats_add(STATS_FREE_CALLS, (size_t) 1);
+
+  if (ptr != NULL) {
+    release_sized_memory(ptr, MEMORY_ALIGNMENT, size);
+  }
+}
+
+/* C23's free_aligned_sized: like free_sized, for a block from
+   aligned_alloc. Alignments are rounded up like memalign does. */
+void __free_aligned_sized_impl(void *ptr, size_t alignment, size_t size) {
+  size_t rounded;
+
+  stats_add(STATS_FREE_CALLS, (size_t) 1);
+
+  if (ptr == NULL) {
+    return;
+  }
+  for (rounded = MEMORY_ALIGNMENT; (rounded < alignment) &&
+	 (rounded <= ((size_t) -1) / ((size_t) 2)); rounded <<= 1);
+  release_sized_memory(ptr, rounded, size);
+}
+
+/* Allocates up to n blocks of at least size bytes each, stores
+   their addresses in out and counts every block as a malloc call.
+   - Returns the number of blocks allocated; on a shortfall, errno is
+     ENOMEM */
+size_t __malloc_batch_impl(size_t size, size_t n, void **out) {
+  size_t done;
+
+  stats_add(STATS_MALLOC_CALLS, n);
+  stats_add(STATS_REQUESTED_BYTES, size * n);
+  done = allocate_memory_batch(size, n, out);
+  if (done < n) {
+    errno = ENOMEM;
+  }
+  return done;
+}
+
+/* Frees the n blocks at ptrs, counting every pointer as a free call */
+void __free_batch_impl(void **ptrs, size_t n) {
+  stats_add(STATS_FREE_CALLS, n);
+  release_memory_batch(ptrs, n);
+}
+
+/* Returns the number of bytes that can be used at ptr, which is at
+   least what was asked for, or 0 if ptr is NULL or not ours. */
+size_t __malloc_usable_size_impl(void *ptr) {
+  if ((ptr == NULL) || (get_block_owner(ptr) == PAGE_OWNER_NONE)) {
+    return (size_t) 0;
+  }
+  return get_usable_size(ptr);
+}
+
+/* Stores in *memptr a ptr to size bytes aligned to alignment,
+   which must be a power of two multiple of sizeof(void *).
+   - Returns 0 on success
+   - Returns EINVAL if alignment is not valid, ENOMEM if no memory
+     could be obtained; *memptr is left untouched then */
+int __posix_memalign_impl(void **memptr, size_t alignment, size_t size) {
+  void *ptr;
+
+  stats_add(STATS_ALIGNED_CALLS, (size_t) 1);
+  stats_add(STATS_REQUESTED_BYTES, size);
+
+  if ((alignment < sizeof(void *)) ||
+      ((alignment & (alignment - ((size_t) 1))) != ((size_t) 0))) {
+    return EINVAL;
+  }
+  ptr = allocate_aligned_memory(alignment, size);
+  if (ptr == NULL) {
+    return ENOMEM;
+  }
+  *memptr = ptr;
+  return 0;
+}
+
+/* C11's aligned_alloc: like memalign, but alignment must be a
+   power of two.
+   - Returns NULL with errno set to EINVAL or ENOMEM on failure */
+void *__aligned_alloc_impl(size_t alignment, size_t size) {
+  void *ptr;
+
+  stats_add(STATS_ALIGNED_CALLS, (size_t) 1);
+  stats_add(STATS_REQUESTED_BYTES, size);
+
+  if ((alignment == ((size_t) 0)) ||
+      ((alignment & (alignment - ((size_t) 1))) != ((size_t) 0))) {
+    errno = EINVAL;
+    return NULL;
+  }
+  ptr = allocate_aligned_memory(alignment, size);
+  if (ptr == NULL) {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+/* The obsolete memalign: like glibc, an alignment that is not a
+   power of two is rounded up to the next one.
+   - Returns NULL with errno set to EINVAL or ENOMEM on failure */
+void *__memalign_impl(size_t alignment, size_t size) {
+  void *ptr;
+  size_t rounded;
+
+  stats_add(STATS_ALIGNED_CALLS, (size_t) 1);
+  stats_add(STATS_REQUESTED_BYTES, size);
+
+  for (rounded = MEMORY_ALIGNMENT; rounded < alignment; rounded <<= 1) {
+    if (rounded > ((size_t) -1) / ((size_t) 2)) {
+      errno = EINVAL;
+      return NULL;
+    }
+  }
+  ptr = allocate_aligned_memory(rounded, size);
+  if (ptr == NULL) {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+/* The obsolete valloc: memalign to the page size.
+   - Returns NULL with errno set to ENOMEM on failure */
+void *__valloc_impl(size_t size) {
+  void *ptr;
+
+  stats_add(STATS_ALIGNED_CALLS, (size_t) 1);
+  stats_add(STATS_REQUESTED_BYTES, size);
+
+  ptr = allocate_aligned_memory(get_page_size(), size);
+  if (ptr == NULL) {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+/* The obsolete pvalloc: like valloc, with size rounded up to a
+   whole number of pages.
+   - Returns NULL with errno set to ENOMEM on failure */
+void *__pvalloc_impl(size_t size) {
+  void *ptr;
+  size_t rounded;
+
+  stats_add(STATS_ALIGNED_CALLS, (size_t) 1);
+  stats_add(STATS_REQUESTED_BYTES, size);
+
+  rounded = round_up_to_page((size == ((size_t) 0)) ? ((size_t) 1) : size);
+  if (rounded == ((size_t) 0)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  ptr = allocate_aligned_memory(get_page_size(), rounded);
+  if (ptr == NULL) {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+/* Gives as much free memory back to the kernel as possible right
+   away, keeping at most pad bytes of entirely free arenas mapped.
+   The calling thread's cache is flushed first; the other threads'
+   caches cannot be touched from here.
+   - Returns 1 if any memory was given back, 0 otherwise */
+int __malloc_trim_impl(size_t pad) {
+  size_t bin;
+  int res;
+
+  stats_add(STATS_MALLOC_TRIM_CALLS, (size_t) 1);
+
+  release_thread_cache();
+
+  pthread_mutex_lock(&memory_management_lock);
+  drain_remote_blocks();
+  res = purge_dirty_memory(pad, 1);
+  pthread_mutex_unlock(&memory_management_lock);
+  pthread_mutex_lock(&slab_lock);
+  for (bin=(size_t) 1; bin<SLAB_CLASS_COUNT; bin++) {
+    drain_remote_slab_objects(bin);
+  }
+  res |= purge_empty_slabs();
+  pthread_mutex_unlock(&slab_lock);
+  return res;
+}
+
+/* Sets the tunable that param stands for to value, as described
+   with the tunables. M_MMAP_THRESHOLD and M_TRIM_THRESHOLD are
+   glibc's; the other parameters glibc knows are accepted and
+   ignored.
+   - Returns 1 on success
+   - Returns 0 if param is unknown or value is out of range */
+int __mallopt_impl(int param, int value) {
+  memory_tunable_t tunable;
+  int res;
+
+  switch (param) {
+  case M_MMAP_THRESHOLD: tunable = TUNABLE_MMAP_THRESHOLD; break;
+  case M_TRIM_THRESHOLD: tunable = TUNABLE_TRIM_THRESHOLD; break;
+  case M_MEMORY_ARENA_GROWTH: tunable = TUNABLE_ARENA_GROWTH; break;
+  case M_MEMORY_DECAY_MS: tunable = TUNABLE_DECAY_MS; break;
+  case M_MEMORY_TCACHE_COUNT: tunable = TUNABLE_TCACHE_COUNT; break;
+  case M_MEMORY_HUGE_PAGES: tunable = TUNABLE_HUGE_PAGES; break;
+  case M_MEMORY_PERCPU_CACHE: tunable = TUNABLE_PERCPU_CACHE; break;
+  case M_MEMORY_BACKGROUND_THREAD: tunable = TUNABLE_BACKGROUND_THREAD; break;
+  case M_MEMORY_PROFILE_INTERVAL: tunable = TUNABLE_PROFILE_INTERVAL; break;
+  case M_MEMORY_TCACHE_BYTES: tunable = TUNABLE_TCACHE_BYTES; break;
+  case M_MXFAST:
+  case M_TOP_PAD:
+  case M_MMAP_MAX:
+  case M_CHECK_ACTION:
+  case M_PERTURB:
+  case M_ARENA_TEST:
+  case M_ARENA_MAX:
+    return 1;
+  default:
+    return 0;
+  }
+  if (value < 0) {
+    return 0;
   }
-  if (prev_header != NULL && prev_header->is_free &&
-      ((char *)header == ((char *)prev_header) + sizeof(memory_block_header_t) + prev_header->size)) {
-      /* We must merge the two blocks to create one big block */
-      prev_header->size += sizeof(memory_block_header_t) + header->size;
-      prev_header->next = header->next;
+  pthread_mutex_lock(&memory_management_lock);
+  res = set_tunable(tunable, (size_t) value);
+  pthread_mutex_unlock(&memory_management_lock);
+  start_background_thread();
+  return res;
+}
+
+/* Fills in glibc's struct mallinfo2 from our statistics. There is
+   a single "main arena" made of all our arenas and slabs; the
+   fastbin fields describe the thread caches. */
+struct mallinfo2 __mallinfo2_impl() {
+  memory_stats_snapshot_t snapshot;
+  struct mallinfo2 info;
+
+  take_stats_snapshot(&snapshot);
+  __memset(&info, 0, sizeof(info));
+  info.arena = snapshot.heap.arena_bytes + snapshot.slabs.slab_bytes - snapshot.slabs.released_bytes;
+  info.ordblks = snapshot.heap.free_block_count + snapshot.slabs.free_object_count;
+  info.smblks = snapshot.counters[STATS_CACHED_BLOCKS];
+  info.hblks = snapshot.counters[STATS_MAPPED_BLOCKS];
+  info.hblkhd = snapshot.counters[STATS_MAPPED_BYTES];
+  info.fsmblks = snapshot.counters[STATS_CACHED_BYTES];
+  info.fordblks = snapshot.heap.free_block_bytes + snapshot.slabs.free_object_bytes;
+  info.uordblks = info.arena - info.fordblks;
+  info.keepcost = snapshot.free_arena_bytes;
+  return info;
+}
+
+/* Prints a summary of the statistics on stderr, in the format of
+   glibc's malloc_stats followed by our own counters. */
+void __malloc_stats_impl() {
+  memory_stats_snapshot_t snapshot;
+  memory_stats_shard_t *shard;
+  size_t i;
+
+  take_stats_snapshot(&snapshot);
+  fprintf(stderr, "Arena 0:\n");
+  fprintf(stderr, "system bytes     = %10zu\n",
+	  snapshot.heap.arena_bytes + snapshot.slabs.slab_bytes - snapshot.slabs.released_bytes);
+  fprintf(stderr, "in use bytes     = %10zu\n",
+	  snapshot.heap.arena_bytes + snapshot.slabs.slab_bytes - snapshot.slabs.released_bytes -
+	  snapshot.heap.free_block_bytes - snapshot.slabs.free_object_bytes);
+  fprintf(stderr, "Total (incl. mmap):\n");
+  fprintf(stderr, "system bytes     = %10zu\n", snapshot.reserved_bytes);
+  fprintf(stderr, "in use bytes     = %10zu\n", snapshot.in_use_bytes);
+  fprintf(stderr, "mmap regions     = %10zu\n", snapshot.counters[STATS_MAPPED_BLOCKS]);
+  fprintf(stderr, "mmap bytes       = %10zu\n", snapshot.counters[STATS_MAPPED_BYTES]);
+  fprintf(stderr, "arenas           = %10zu\n", snapshot.heap.arena_count);
+  fprintf(stderr, "slabs            = %10zu\n", snapshot.slabs.slab_count);
+  fprintf(stderr, "threads          = %10zu\n", snapshot.thread_count);
+  fprintf(stderr, "fragmentation    = %10.4f\n", snapshot.fragmentation);
+  fprintf(stderr, "dirty bytes      = %10zu\n", snapshot.heap.dirty_bytes);
+  fprintf(stderr, "bg wakeups       = %10zu\n", snapshot.heap.background_wakeups);
+  fprintf(stderr, "bg cpu ns        = %10zu\n", snapshot.heap.background_cpu_ns);
+  fprintf(stderr, "tcache claimed   = %10zu\n", snapshot.thread_cache_claimed);
+  for (shard = get_next_live_shard(NULL); shard != NULL; shard = get_next_live_shard(shard)) {
+    fprintf(stderr, "thread %-10d= %10zu cached, limit %zu\n", (int) shard->tid,
+	    get_thread_cache_bytes(shard),
+	    __atomic_load_n(&shard->cache_limit, __ATOMIC_RELAXED));
+  }
+  for (i=(size_t) 0; i<STATS_COUNTER_COUNT; i++) {
+    fprintf(stderr, "%-17s= %10zu\n", stats_counter_names[i], snapshot.counters[i]);
   }
+  for (i=(size_t) 0; i<TUNABLE_COUNT; i++) {
+    fprintf(stderr, "%-17s= %10zu\n", tunable_names[i], snapshot.tunables[i]);
+  }
+}
+
+/* Writes the statistics to fp, as XML if options is 0, like glibc's
+   malloc_info, or as JSON if options is MEMORY_INFO_JSON.
+   - Returns 0 on success
+   - Returns -1 with errno set to EINVAL for any other options */
+int __malloc_info_impl(int options, FILE *fp) {
+  memory_stats_snapshot_t snapshot;
+
+  if ((options != 0) && (options != MEMORY_INFO_JSON)) {
+    errno = EINVAL;
+    return -1;
+  }
+  take_stats_snapshot(&snapshot);
+  if (options == MEMORY_INFO_JSON) {
+    write_stats_json(fp, &snapshot);
+  } else {
+    write_stats_xml(fp, &snapshot);
+  }
+  return 0;
 }
 
 /* End of the actual malloc/calloc/realloc/free functions */
@@ -29,12 +29,24 @@
      the `pwd` statement to your environment.)
 
     You will see a debug message on stderr per
-    malloc/calloc/realloc/free call.
+    malloc/calloc/realloc/free call. The messages are buffered per
+    thread and printed in batches, so they come late and the threads'
+    messages are not interleaved in call order.
 
     If you still want to use your memory management implementation
     but you don't need the debug messages, set MEMORY_DEBUG to no
     before starting the process.
 
+    For a complete, cheap trace of a real program, set MEMORY_TRACE
+    to a file name instead and decode the binary trace written to
+    <file name>.<pid> with
+
+    ./memory_trace_decode <file name>.<pid>
+
+    or replay it against glibc or this implementation with
+
+    ./memory_replay <file name>.<pid>
+
     You do not need to change anything in this file. You don't need to
     understand this file but it may be a good learning exercise to
     understand it. Your actual implementation goes into the file
@@ -80,95 +92,821 @@
 
 #include <stddef.h>
 #include <stdio.h>
-#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <malloc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 
 void *__malloc_impl(size_t);
 void *__calloc_impl(size_t, size_t);
 void *__realloc_impl(void *, size_t);
 void __free_impl(void *);
+int __malloc_trim_impl(size_t);
+struct mallinfo2 __mallinfo2_impl();
+void __malloc_stats_impl();
+int __malloc_info_impl(int, FILE *);
+int __posix_memalign_impl(void **, size_t, size_t);
+void *__aligned_alloc_impl(size_t, size_t);
+void *__memalign_impl(size_t, size_t);
+void *__valloc_impl(size_t);
+void *__pvalloc_impl(size_t);
+size_t __malloc_usable_size_impl(void *);
+int __mallopt_impl(int, int);
+size_t __malloc_batch_impl(size_t, size_t, void **);
+void __free_sized_impl(void *, size_t);
+void __free_aligned_sized_impl(void *, size_t, size_t);
+void __free_batch_impl(void **, size_t);
+
+/* Value of malloc_info's options argument that asks for JSON */
+#define MEMORY_INFO_JSON 1
+
+/* The __*_impl functions are thread-safe by themselves: they serve
+   small sizes from thread-local caches and only lock the shared heap
+   when they need to refill or flush those caches. */
+
+/* Tracing
+
+   Every call is recorded as a fixed-size binary record in a ring
+   buffer of the calling thread. Only that thread appends to its
+   ring, so recording takes neither a lock nor a system call. Rings
+   are written out in batches with raw write() calls: by their
+   thread when they are full and when it exits, by a fork in the
+   parent and by the exit handler at exit. A flush of a ring by
+   another thread than its owner is serialized with the owner's
+   through the ring's flushing flag, which the owner only waits for
+   when its ring is full. No record is ever dropped.
+
+   Rings are never unmapped: the ring of a thread that has exited
+   goes on a free list, from which the next thread to trace a call
+   takes it, so there are never more rings than threads were alive
+   at once. In the child of a fork, the rings of the threads that
+   do not exist there are put on the free list.
+
+   With MEMORY_TRACE=path, the records go in binary form to the file
+   path.<pid>, to be decoded by memory_trace_decode. With
+   MEMORY_DEBUG=yes, they are printed as text on stderr when they are
+   written out. Both may be set at the same time.
+
+   The file starts with a memory_trace_file_header_t, followed by the
+   records in the order in which they were written out, which is per
+   thread chronological. memory_trace_decode.c and memory_replay.c
+   declare the same structures.
+
+   Every record carries a sequence number from a process-wide counter
+   that gives all calls a logical order consistent with what the
+   threads could observe: it is taken after the call for the calls
+   that hand out memory, and before the call for free and realloc.
+   So the call that returns a pointer always comes before any call
+   that gets it back from another thread, and a free comes before the
+   call that hands out the same address again. The counter is only
+   touched while tracing.
+*/
+#define MEMORY_TRACE_MAGIC "MEMTRACE"
+#define MEMORY_TRACE_VERSION 2u
+#define MEMORY_TRACE_RING_RECORDS ((unsigned long) 1024)
+#define MEMORY_TRACE_TEXT_BUFFER_SIZE 4096
+#define MEMORY_TRACE_TEXT_LINE_MAX 128
+
+typedef enum memory_trace_op {
+  MEMORY_TRACE_MALLOC = 1,
+  MEMORY_TRACE_CALLOC,
+  MEMORY_TRACE_REALLOC,
+  MEMORY_TRACE_FREE,
+  MEMORY_TRACE_MALLOC_TRIM,
+  MEMORY_TRACE_MALLINFO2,
+  MEMORY_TRACE_MALLOC_STATS,
+  MEMORY_TRACE_MALLOC_INFO,
+  MEMORY_TRACE_POSIX_MEMALIGN,
+  MEMORY_TRACE_ALIGNED_ALLOC,
+  MEMORY_TRACE_MEMALIGN,
+  MEMORY_TRACE_VALLOC,
+  MEMORY_TRACE_PVALLOC,
+  MEMORY_TRACE_MALLOC_USABLE_SIZE,
+  MEMORY_TRACE_MALLOPT
+} memory_trace_op_t;
+
+typedef struct memory_trace_file_header {
+  char magic[8];
+  unsigned int version;
+  unsigned int record_size;
+} memory_trace_file_header_t;
+
+/* arg0, arg1 and result hold the arguments and return value of the
+   call, in the order of the C prototype, as unsigned integers. For
+   posix_memalign, arg0 and arg1 are alignment and size and result
+   is the pointer stored, or 0 if the call failed. */
+typedef struct memory_trace_record {
+  unsigned long long sequence;
+  unsigned long long timestamp;
+  unsigned long long arg0;
+  unsigned long long arg1;
+  unsigned long long result;
+  unsigned int thread_id;
+  unsigned int op;
+} memory_trace_record_t;
+
+/* head is only written by the owning thread, tail only while
+   holding flushing. Both count records since the ring was made. A
+   ring that is not live has no owner and is on the free list. */
+typedef struct memory_trace_ring {
+  unsigned long head;
+  unsigned long tail;
+  int flushing;
+  int live;
+  struct memory_trace_ring *next;
+  struct memory_trace_ring *next_free;
+  memory_trace_record_t records[MEMORY_TRACE_RING_RECORDS];
+} memory_trace_ring_t;
+
+static pthread_once_t __memory_trace_once = PTHREAD_ONCE_INIT;
+static int __memory_trace_enabled = 0;
+static int __memory_trace_to_stderr = 0;
+static int __memory_trace_stderr_fd = -1;
+static int __memory_trace_fd = -1;
+static int __memory_trace_finished = 0;
+static unsigned long long __memory_trace_next_sequence = 0ull;
+static memory_trace_ring_t *__memory_trace_rings = NULL;
+static pthread_key_t __memory_trace_ring_key;
+
+/* This lock protects the free list of rings */
+static pthread_mutex_t __memory_trace_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static memory_trace_ring_t *__memory_trace_free_rings = NULL;
+
+static __thread memory_trace_ring_t *__memory_trace_ring
+  __attribute__((tls_model("initial-exec")));
+static __thread int __memory_trace_ring_released
+  __attribute__((tls_model("initial-exec")));
+static __thread unsigned int __memory_trace_thread_id
+  __attribute__((tls_model("initial-exec")));
+
+/* This function writes the len bytes at buf to fd, retrying on
+   partial writes and interrupts and giving up on other errors. */
+static void __memory_trace_write(int fd, const void *buf, size_t len) {
+  ssize_t res;
+
+  while (len > (size_t) 0) {
+    res = write(fd, buf, len);
+    if (res < (ssize_t) 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    buf = (const char *)buf + res;
+    len -= (size_t) res;
+  }
+}
 
-static int __memory_print_debug_running = 0;
-static int __memory_print_debug_init_running = 0;
-static int __memory_print_debug_initialized = 0;
-static int __memory_print_debug_do_it = 0;
-
-static pthread_mutex_t memory_management_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+static void __memory_trace_release_ring(void *arg);
 
-static void __memory_print_debug_init() {
+static void __memory_trace_init() {
+  memory_trace_file_header_t header;
+  char path[4096];
   char *env_var;
-  
-  if (__memory_print_debug_init_running) return;
-  __memory_print_debug_init_running = 1;
-  if (!__memory_print_debug_initialized) {
-    __memory_print_debug_do_it = 0;
-    env_var = getenv("MEMORY_DEBUG");
-    if (env_var != NULL) {
-      if (!strcmp(env_var, "yes")) {
-	__memory_print_debug_do_it = 1;
+  int len;
+
+  env_var = getenv("MEMORY_DEBUG");
+  if (env_var != NULL) {
+    if (!strcmp(env_var, "yes")) {
+      /* Programs such as coreutils close stderr before exiting,
+	 while we are still going to print, so we keep our own. */
+      __memory_trace_stderr_fd = fcntl(2, F_DUPFD_CLOEXEC, 3);
+      __memory_trace_to_stderr = (__memory_trace_stderr_fd >= 0);
+    }
+  }
+  env_var = getenv("MEMORY_TRACE");
+  if ((env_var != NULL) && (env_var[0] != '\0')) {
+    len = snprintf(path, sizeof(path), "%s.%d", env_var, (int) getpid());
+    if ((len > 0) && (((size_t) len) < sizeof(path))) {
+      __memory_trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+      if (__memory_trace_fd >= 0) {
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MEMORY_TRACE_MAGIC, sizeof(header.magic));
+	header.version = MEMORY_TRACE_VERSION;
+	header.record_size = (unsigned int) sizeof(memory_trace_record_t);
+	__memory_trace_write(__memory_trace_fd, &header, sizeof(header));
       }
     }
-    __memory_print_debug_initialized = 1;
   }
-  __memory_print_debug_init_running = 0;
+  __memory_trace_enabled = __memory_trace_to_stderr || (__memory_trace_fd >= 0);
+  if (__memory_trace_enabled) {
+    pthread_key_create(&__memory_trace_ring_key, __memory_trace_release_ring);
+  }
+}
+
+/* This function prints record as one line of text into buf, which
+   is at least MEMORY_TRACE_TEXT_LINE_MAX bytes long.
+   - Returns the length of the line */
+static int __memory_trace_format(char *buf, const memory_trace_record_t *record) {
+  size_t n = MEMORY_TRACE_TEXT_LINE_MAX;
+  void *result = (void *) record->result;
+
+  switch (record->op) {
+  case MEMORY_TRACE_MALLOC:
+    return snprintf(buf, n, "malloc(0x%llx) = %p\n", record->arg0, result);
+  case MEMORY_TRACE_CALLOC:
+    return snprintf(buf, n, "calloc(0x%llx, 0x%llx) = %p\n", record->arg0, record->arg1, result);
+  case MEMORY_TRACE_REALLOC:
+    return snprintf(buf, n, "realloc(%p, 0x%llx) = %p\n", (void *) record->arg0, record->arg1, result);
+  case MEMORY_TRACE_FREE:
+    return snprintf(buf, n, "free(%p)\n", (void *) record->arg0);
+  case MEMORY_TRACE_MALLOC_TRIM:
+    return snprintf(buf, n, "malloc_trim(0x%llx) = %d\n", record->arg0, (int) record->result);
+  case MEMORY_TRACE_MALLINFO2:
+    return snprintf(buf, n, "mallinfo2()\n");
+  case MEMORY_TRACE_MALLOC_STATS:
+    return snprintf(buf, n, "malloc_stats()\n");
+  case MEMORY_TRACE_MALLOC_INFO:
+    return snprintf(buf, n, "malloc_info(%d, %p) = %d\n", (int) record->arg0,
+		    (void *) record->arg1, (int) record->result);
+  case MEMORY_TRACE_POSIX_MEMALIGN:
+    return snprintf(buf, n, "posix_memalign(0x%llx, 0x%llx) = %p\n", record->arg0, record->arg1, result);
+  case MEMORY_TRACE_ALIGNED_ALLOC:
+    return snprintf(buf, n, "aligned_alloc(0x%llx, 0x%llx) = %p\n", record->arg0, record->arg1, result);
+  case MEMORY_TRACE_MEMALIGN:
+    return snprintf(buf, n, "memalign(0x%llx, 0x%llx) = %p\n", record->arg0, record->arg1, result);
+  case MEMORY_TRACE_VALLOC:
+    return snprintf(buf, n, "valloc(0x%llx) = %p\n", record->arg0, result);
+  case MEMORY_TRACE_PVALLOC:
+    return snprintf(buf, n, "pvalloc(0x%llx) = %p\n", record->arg0, result);
+  case MEMORY_TRACE_MALLOC_USABLE_SIZE:
+    return snprintf(buf, n, "malloc_usable_size(%p) = 0x%llx\n", (void *) record->arg0, record->result);
+  case MEMORY_TRACE_MALLOPT:
+    return snprintf(buf, n, "mallopt(%d, %d) = %d\n", (int) record->arg0, (int) record->arg1,
+		    (int) record->result);
+  }
+  return snprintf(buf, n, "unknown operation %u\n", record->op);
+}
+
+/* This function writes the count records starting at records out,
+   in binary form to the trace file and as text on stderr. */
+static void __memory_trace_output(const memory_trace_record_t *records, unsigned long count) {
+  char text[MEMORY_TRACE_TEXT_BUFFER_SIZE];
+  size_t used;
+  unsigned long i;
+
+  if (__memory_trace_fd >= 0) {
+    __memory_trace_write(__memory_trace_fd, records, count * sizeof(memory_trace_record_t));
+  }
+  if (__memory_trace_to_stderr) {
+    used = (size_t) 0;
+    for (i=0ul; i<count; i++) {
+      if (used + MEMORY_TRACE_TEXT_LINE_MAX > sizeof(text)) {
+	__memory_trace_write(__memory_trace_stderr_fd, text, used);
+	used = (size_t) 0;
+      }
+      used += (size_t) __memory_trace_format(&text[used], &records[i]);
+    }
+    __memory_trace_write(__memory_trace_stderr_fd, text, used);
+  }
+}
+
+/* This function writes out all records of ring that have not been
+   written out yet. It may be called from any thread; errno is left
+   untouched. */
+static void __memory_trace_flush_ring(memory_trace_ring_t *ring) {
+  unsigned long head, tail, start, count;
+  int saved_errno = errno;
+
+  while (__atomic_exchange_n(&ring->flushing, 1, __ATOMIC_ACQUIRE)) {
+    sched_yield();
+  }
+  tail = ring->tail;
+  head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  while (tail != head) {
+    start = tail % MEMORY_TRACE_RING_RECORDS;
+    count = head - tail;
+    if (count > MEMORY_TRACE_RING_RECORDS - start) {
+      count = MEMORY_TRACE_RING_RECORDS - start;
+    }
+    __memory_trace_output(&ring->records[start], count);
+    tail += count;
+  }
+  __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+  __atomic_store_n(&ring->flushing, 0, __ATOMIC_RELEASE);
+  errno = saved_errno;
+}
+
+/* This function writes out the records of all threads' rings. The
+   free rings have none left. */
+static void __memory_trace_flush_all() {
+  memory_trace_ring_t *ring;
+
+  for (ring = __atomic_load_n(&__memory_trace_rings, __ATOMIC_ACQUIRE);
+       ring != NULL;
+       ring = ring->next) {
+    if (__atomic_load_n(&ring->live, __ATOMIC_ACQUIRE)) {
+      __memory_trace_flush_ring(ring);
+    }
+  }
+}
+
+/* This function is the destructor of __memory_trace_ring_key: it
+   runs when a thread that has a ring exits, writes out the ring's
+   records and puts it on the free list. What the thread still
+   records afterwards is written out record by record. */
+static void __memory_trace_release_ring(void *arg) {
+  memory_trace_ring_t *ring = (memory_trace_ring_t *) arg;
+
+  __memory_trace_ring = NULL;
+  __memory_trace_ring_released = 1;
+  __memory_trace_flush_ring(ring);
+  pthread_mutex_lock(&__memory_trace_ring_lock);
+  __atomic_store_n(&ring->live, 0, __ATOMIC_RELEASE);
+  ring->next_free = __memory_trace_free_rings;
+  __memory_trace_free_rings = ring;
+  pthread_mutex_unlock(&__memory_trace_ring_lock);
+}
+
+/* This function returns the calling thread's ring. On first use, it
+   takes a free ring or maps a new one, which it links into the list
+   of rings.
+   - Returns NULL if the ring cannot be mapped, or if the thread is
+     exiting and has given its ring back */
+static memory_trace_ring_t *__memory_trace_get_ring() {
+  memory_trace_ring_t *ring;
+  void *memory;
+
+  if (__memory_trace_ring != NULL) {
+    return __memory_trace_ring;
+  }
+  if (__memory_trace_ring_released) {
+    return NULL;
+  }
+  pthread_mutex_lock(&__memory_trace_ring_lock);
+  ring = __memory_trace_free_rings;
+  if (ring != NULL) {
+    __memory_trace_free_rings = ring->next_free;
+    __atomic_store_n(&ring->live, 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&__memory_trace_ring_lock);
+  if (ring == NULL) {
+    memory = mmap(NULL, sizeof(memory_trace_ring_t), PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+      return NULL;
+    }
+    ring = (memory_trace_ring_t *)memory;
+    ring->live = 1;
+    ring->next = __atomic_load_n(&__memory_trace_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&__memory_trace_rings, &ring->next, ring, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+  /* pthread_setspecific may allocate, and so get back here */
+  __memory_trace_ring = ring;
+  pthread_setspecific(__memory_trace_ring_key, ring);
+  return ring;
+}
+
+/* This function takes the next sequence number, if tracing is
+   enabled.
+   - Returns the sequence number, or 0 if tracing is disabled */
+static unsigned long long __memory_trace_sequence() {
+  pthread_once(&__memory_trace_once, __memory_trace_init);
+  if (!__memory_trace_enabled) return 0ull;
+  return __atomic_fetch_add(&__memory_trace_next_sequence, 1ull, __ATOMIC_RELAXED);
+}
+
+/* This function reserves count consecutive sequence numbers for the
+   records of a batch call, one per block, if tracing is enabled.
+   - Returns the first of them, or 0 if tracing is disabled */
+static unsigned long long __memory_trace_sequences(size_t count) {
+  pthread_once(&__memory_trace_once, __memory_trace_init);
+  if (!__memory_trace_enabled) return 0ull;
+  return __atomic_fetch_add(&__memory_trace_next_sequence, (unsigned long long) count,
+			    __ATOMIC_RELAXED);
+}
+
+/* This function records one call of operation op, with the sequence
+   number sequence, in the calling thread's ring, if tracing is
+   enabled. */
+static void __memory_trace(memory_trace_op_t op, unsigned long long sequence,
+			   unsigned long long arg0, unsigned long long arg1,
+			   unsigned long long result) {
+  memory_trace_ring_t *ring;
+  memory_trace_record_t *record, single_record;
+  struct timespec ts;
+  int saved_errno;
+
+  pthread_once(&__memory_trace_once, __memory_trace_init);
+  if (!__memory_trace_enabled) return;
+
+  saved_errno = errno;
+  if (__memory_trace_thread_id == 0u) {
+    __memory_trace_thread_id = (unsigned int) syscall(SYS_gettid);
+  }
+  ring = __memory_trace_get_ring();
+  if (ring == NULL) {
+    /* Without a ring, the record is written out on its own */
+    record = &single_record;
+  } else {
+    if (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == MEMORY_TRACE_RING_RECORDS) {
+      __memory_trace_flush_ring(ring);
+    }
+    record = &ring->records[ring->head % MEMORY_TRACE_RING_RECORDS];
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  record->sequence = sequence;
+  record->timestamp = ((unsigned long long) ts.tv_sec) * 1000000000ull + ((unsigned long long) ts.tv_nsec);
+  record->arg0 = arg0;
+  record->arg1 = arg1;
+  record->result = result;
+  record->thread_id = __memory_trace_thread_id;
+  record->op = (unsigned int) op;
+
+  if (ring == NULL) {
+    __memory_trace_output(record, 1ul);
+  } else {
+    __atomic_store_n(&ring->head, ring->head + 1ul, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&__memory_trace_finished, __ATOMIC_ACQUIRE)) {
+      /* The exit handler has run: nobody will flush later */
+      __memory_trace_flush_ring(ring);
+    }
+  }
+  errno = saved_errno;
 }
 
-static void __memory_print_debug(const char *fmt, ...) {
-  va_list valist;
+/* Across fork, the parent's pending records are written out before,
+   and the child forgets the copies it inherits and frees the rings
+   of the threads it does not have. The child's calling thread has a
+   new thread id. */
+static void __memory_trace_fork_prepare() {
+  __memory_trace_flush_all();
+}
 
-  if (pthread_mutex_trylock(&print_lock) != 0) return;
-  if (__memory_print_debug_running) {
-    pthread_mutex_unlock(&print_lock);
-    return;
+static void __memory_trace_fork_child() {
+  memory_trace_ring_t *ring;
+
+  pthread_mutex_init(&__memory_trace_ring_lock, NULL);
+  __memory_trace_free_rings = NULL;
+  for (ring = __memory_trace_rings; ring != NULL; ring = ring->next) {
+    ring->tail = ring->head;
+    ring->flushing = 0;
+    if (ring != __memory_trace_ring) {
+      ring->live = 0;
+      ring->next_free = __memory_trace_free_rings;
+      __memory_trace_free_rings = ring;
+    }
   }
-  __memory_print_debug_running = 1;
-  __memory_print_debug_init();
-  if (__memory_print_debug_do_it) {
-    va_start(valist, fmt);
-    vfprintf(stderr, fmt, valist);
-    va_end(valist);
+  __memory_trace_thread_id = 0u;
+}
+
+static void __memory_trace_setup() __attribute__((constructor));
+
+static void __memory_trace_setup() {
+  pthread_once(&__memory_trace_once, __memory_trace_init);
+  if (__memory_trace_enabled) {
+    pthread_atfork(__memory_trace_fork_prepare, NULL, __memory_trace_fork_child);
   }
-  __memory_print_debug_running = 0;
-  pthread_mutex_unlock(&print_lock);
+}
+
+static void __memory_trace_finish() __attribute__((destructor));
+
+static void __memory_trace_finish() {
+  if (!__memory_trace_enabled) return;
+  __atomic_store_n(&__memory_trace_finished, 1, __ATOMIC_RELEASE);
+  __memory_trace_flush_all();
 }
 
 void *malloc(size_t size) {
   void *ptr;
 
-  pthread_mutex_lock(&memory_management_lock);
   ptr = __malloc_impl(size);
-  pthread_mutex_unlock(&memory_management_lock);
-  __memory_print_debug("malloc(0x%zx) = %p\n", size, ptr);
+  __memory_trace(MEMORY_TRACE_MALLOC, __memory_trace_sequence(), size, 0ull, (unsigned long long) ptr);
   return ptr;
 }
 
 void *calloc(size_t nmemb, size_t size) {
   void *ptr;
 
-  pthread_mutex_lock(&memory_management_lock);
   ptr = __calloc_impl(nmemb, size);
-  pthread_mutex_unlock(&memory_management_lock);
-  __memory_print_debug("calloc(0x%zx, 0x%zx) = %p\n", nmemb, size, ptr);
+  __memory_trace(MEMORY_TRACE_CALLOC, __memory_trace_sequence(), nmemb, size, (unsigned long long) ptr);
   return ptr;
 }
 
 void *realloc(void *old_ptr, size_t size) {
+  unsigned long long sequence;
   void *ptr;
 
-  pthread_mutex_lock(&memory_management_lock);
+  sequence = __memory_trace_sequence();
   ptr = __realloc_impl(old_ptr, size);
-  pthread_mutex_unlock(&memory_management_lock);
-  __memory_print_debug("realloc(%p, 0x%zx) = %p\n", old_ptr, size, ptr);
+  __memory_trace(MEMORY_TRACE_REALLOC, sequence, (unsigned long long) old_ptr, size, (unsigned long long) ptr);
   return ptr;
 }
 
 void free(void *ptr) {
-  pthread_mutex_lock(&memory_management_lock);
+  unsigned long long sequence;
+
+  sequence = __memory_trace_sequence();
   __free_impl(ptr);
-  pthread_mutex_unlock(&memory_management_lock);
-  __memory_print_debug("free(%p)\n", ptr);
+  __memory_trace(MEMORY_TRACE_FREE, sequence, (unsigned long long) ptr, 0ull, 0ull);
+}
+
+/* C23's sized frees are traced as free, which is what they replay
+   as */
+void free_sized(void *ptr, size_t size) {
+  unsigned long long sequence;
+
+  sequence = __memory_trace_sequence();
+  __free_sized_impl(ptr, size);
+  __memory_trace(MEMORY_TRACE_FREE, sequence, (unsigned long long) ptr, 0ull, 0ull);
+}
+
+void free_aligned_sized(void *ptr, size_t alignment, size_t size) {
+  unsigned long long sequence;
+
+  sequence = __memory_trace_sequence();
+  __free_aligned_sized_impl(ptr, alignment, size);
+  __memory_trace(MEMORY_TRACE_FREE, sequence, (unsigned long long) ptr, 0ull, 0ull);
+}
+
+/* The batch calls are traced as one malloc or free record per block,
+   so that traces of programs using them decode and replay like any
+   other. */
+size_t malloc_batch(size_t size, size_t n, void **out) {
+  unsigned long long sequence;
+  size_t done, i;
+
+  done = __malloc_batch_impl(size, n, out);
+  sequence = __memory_trace_sequences(done);
+  if (__memory_trace_enabled) {
+    for (i=(size_t) 0; i<done; i++) {
+      __memory_trace(MEMORY_TRACE_MALLOC, sequence + i, size, 0ull, (unsigned long long) out[i]);
+    }
+  }
+  return done;
+}
+
+void free_batch(void **ptrs, size_t n) {
+  unsigned long long sequence;
+  size_t i;
+
+  sequence = __memory_trace_sequences(n);
+  __free_batch_impl(ptrs, n);
+  if (__memory_trace_enabled) {
+    for (i=(size_t) 0; i<n; i++) {
+      __memory_trace(MEMORY_TRACE_FREE, sequence + i, (unsigned long long) ptrs[i], 0ull, 0ull);
+    }
+  }
+}
+
+int malloc_trim(size_t pad) {
+  int res;
+
+  res = __malloc_trim_impl(pad);
+  __memory_trace(MEMORY_TRACE_MALLOC_TRIM, __memory_trace_sequence(), pad, 0ull, (unsigned long long) res);
+  return res;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  void *ptr;
+  int res;
+
+  ptr = NULL;
+  res = __posix_memalign_impl(&ptr, alignment, size);
+  if (res == 0) {
+    *memptr = ptr;
+  }
+  __memory_trace(MEMORY_TRACE_POSIX_MEMALIGN, __memory_trace_sequence(), alignment, size, (unsigned long long) ptr);
+  return res;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  void *ptr;
+
+  ptr = __aligned_alloc_impl(alignment, size);
+  __memory_trace(MEMORY_TRACE_ALIGNED_ALLOC, __memory_trace_sequence(), alignment, size, (unsigned long long) ptr);
+  return ptr;
+}
+
+void *memalign(size_t alignment, size_t size) {
+  void *ptr;
+
+  ptr = __memalign_impl(alignment, size);
+  __memory_trace(MEMORY_TRACE_MEMALIGN, __memory_trace_sequence(), alignment, size, (unsigned long long) ptr);
+  return ptr;
+}
+
+void *valloc(size_t size) {
+  void *ptr;
+
+  ptr = __valloc_impl(size);
+  __memory_trace(MEMORY_TRACE_VALLOC, __memory_trace_sequence(), size, 0ull, (unsigned long long) ptr);
+  return ptr;
+}
+
+void *pvalloc(size_t size) {
+  void *ptr;
+
+  ptr = __pvalloc_impl(size);
+  __memory_trace(MEMORY_TRACE_PVALLOC, __memory_trace_sequence(), size, 0ull, (unsigned long long) ptr);
+  return ptr;
+}
+
+size_t malloc_usable_size(void *ptr) {
+  size_t size;
+
+  size = __malloc_usable_size_impl(ptr);
+  __memory_trace(MEMORY_TRACE_MALLOC_USABLE_SIZE, __memory_trace_sequence(), (unsigned long long) ptr, 0ull, size);
+  return size;
+}
+
+int mallopt(int param, int value) {
+  int res;
+
+  res = __mallopt_impl(param, value);
+  __memory_trace(MEMORY_TRACE_MALLOPT, __memory_trace_sequence(), (unsigned long long) param,
+		 (unsigned long long) value, (unsigned long long) res);
+  return res;
+}
+
+/* C++'s operator new and delete
+
+   libstdc++ implements them on top of malloc and free, which costs a
+   call more and drops the size the compiler hands to the sized
+   deletes. They are defined here instead, under their mangled names
+   for a size_t that is an unsigned long, so that C++ programs call
+   into the heap directly and sized deletes reach free_sized.
+
+   operator new must not return NULL. On failure, it calls the
+   program's new handler until that gives up, then throws
+   std::bad_alloc through libstdc++'s own std::__throw_bad_alloc.
+   Both are weak references: they are found as soon as the program
+   is a C++ program, and only a C++ program calls operator new. The
+   nothrow variants return NULL without calling the new handler,
+   which might throw through them.
+
+   New and delete are traced as malloc or memalign and free.
+*/
+#if defined(__LP64__)
+
+extern void (*_ZSt15get_new_handlerv(void))(void) __attribute__((weak));
+extern void _ZSt17__throw_bad_allocv(void) __attribute__((weak, noreturn));
+
+static void *__memory_new(size_t size, size_t alignment, int nothrow) {
+  void (*handler)(void);
+  void *ptr;
+
+  for (;;) {
+    if (alignment == ((size_t) 0)) {
+      ptr = __malloc_impl(size);
+      __memory_trace(MEMORY_TRACE_MALLOC, __memory_trace_sequence(), size, 0ull, (unsigned long long) ptr);
+    } else {
+      ptr = __memalign_impl(alignment, size);
+      __memory_trace(MEMORY_TRACE_MEMALIGN, __memory_trace_sequence(), alignment, size, (unsigned long long) ptr);
+    }
+    if ((ptr != NULL) || nothrow) {
+      return ptr;
+    }
+    handler = (_ZSt15get_new_handlerv != NULL) ? _ZSt15get_new_handlerv() : NULL;
+    if (handler == NULL) {
+      if (_ZSt17__throw_bad_allocv != NULL) {
+	_ZSt17__throw_bad_allocv();
+      }
+      abort();
+    }
+    handler();
+  }
+}
+
+/* operator new(size_t) and new[] */
+void *_Znwm(size_t size) {
+  return __memory_new(size, (size_t) 0, 0);
+}
+
+void *_Znam(size_t size) {
+  return __memory_new(size, (size_t) 0, 0);
+}
+
+/* operator new(size_t, const std::nothrow_t &) and new[] */
+void *_ZnwmRKSt9nothrow_t(size_t size, const void *nothrow) {
+  return __memory_new(size, (size_t) 0, 1);
+}
+
+void *_ZnamRKSt9nothrow_t(size_t size, const void *nothrow) {
+  return __memory_new(size, (size_t) 0, 1);
+}
+
+/* operator new(size_t, std::align_val_t) and new[] */
+void *_ZnwmSt11align_val_t(size_t size, size_t alignment) {
+  return __memory_new(size, alignment, 0);
+}
+
+void *_ZnamSt11align_val_t(size_t size, size_t alignment) {
+  return __memory_new(size, alignment, 0);
+}
+
+/* operator new(size_t, std::align_val_t, const std::nothrow_t &)
+   and new[] */
+void *_ZnwmSt11align_val_tRKSt9nothrow_t(size_t size, size_t alignment, const void *nothrow) {
+  return __memory_new(size, alignment, 1);
+}
+
+void *_ZnamSt11align_val_tRKSt9nothrow_t(size_t size, size_t alignment, const void *nothrow) {
+  return __memory_new(size, alignment, 1);
+}
+
+/* operator delete(void *) and delete[], with or without
+   std::nothrow_t or std::align_val_t: the size is not known */
+void _ZdlPv(void *ptr) {
+  free(ptr);
+}
+
+void _ZdaPv(void *ptr) {
+  free(ptr);
+}
+
+void _ZdlPvRKSt9nothrow_t(void *ptr, const void *nothrow) {
+  free(ptr);
+}
+
+void _ZdaPvRKSt9nothrow_t(void *ptr, const void *nothrow) {
+  free(ptr);
+}
+
+void _ZdlPvSt11align_val_t(void *ptr, size_t alignment) {
+  free(ptr);
+}
+
+void _ZdaPvSt11align_val_t(void *ptr, size_t alignment) {
+  free(ptr);
+}
+
+void _ZdlPvSt11align_val_tRKSt9nothrow_t(void *ptr, size_t alignment, const void *nothrow) {
+  free(ptr);
+}
+
+void _ZdaPvSt11align_val_tRKSt9nothrow_t(void *ptr, size_t alignment, const void *nothrow) {
+  free(ptr);
+}
+
+/* operator delete(void *, size_t) and delete[], and their aligned
+   variants */
+void _ZdlPvm(void *ptr, size_t size) {
+  free_sized(ptr, size);
+}
+
+void _ZdaPvm(void *ptr, size_t size) {
+  free_sized(ptr, size);
+}
+
+void _ZdlPvmSt11align_val_t(void *ptr, size_t size, size_t alignment) {
+  free_aligned_sized(ptr, alignment, size);
+}
+
+void _ZdaPvmSt11align_val_t(void *ptr, size_t size, size_t alignment) {
+  free_aligned_sized(ptr, alignment, size);
+}
+
+#endif
+
+struct mallinfo2 mallinfo2() {
+  struct mallinfo2 info;
+
+  info = __mallinfo2_impl();
+  __memory_trace(MEMORY_TRACE_MALLINFO2, __memory_trace_sequence(), 0ull, 0ull, 0ull);
+  return info;
+}
+
+void malloc_stats() {
+  __malloc_stats_impl();
+  __memory_trace(MEMORY_TRACE_MALLOC_STATS, __memory_trace_sequence(), 0ull, 0ull, 0ull);
+}
+
+int malloc_info(int options, FILE *fp) {
+  int res;
+
+  res = __malloc_info_impl(options, fp);
+  __memory_trace(MEMORY_TRACE_MALLOC_INFO, __memory_trace_sequence(), (unsigned long long) options, (unsigned long long) fp, (unsigned long long) res);
+  return res;
+}
+
+/* If the environment variable MEMORY_STATS names a file, a snapshot
+   of the allocator statistics is written to it when the process
+   exits: as XML if the name ends in .xml, as JSON otherwise. */
+static void __memory_stats_dump() __attribute__((destructor));
+
+static void __memory_stats_dump() {
+  char *path;
+  size_t len;
+  FILE *fp;
+
+  path = getenv("MEMORY_STATS");
+  if ((path == NULL) || (path[0] == '\0')) return;
+  fp = fopen(path, "w");
+  if (fp == NULL) return;
+  len = strlen(path);
+  if ((len >= 4) && (!strcmp(&path[len - 4], ".xml"))) {
+    __malloc_info_impl(0, fp);
+  } else {
+    __malloc_info_impl(MEMORY_INFO_JSON, fp);
+  }
+  fclose(fp);
 }
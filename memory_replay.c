@@ -0,0 +1,666 @@
+/*
+
+    Replays a trace written by memory.so with MEMORY_TRACE set (see
+    memory.c) against whatever allocator the replayer itself runs
+    with: glibc's by default, memory.so (or any other allocator) with
+    LD_PRELOAD.
+
+    Compile this file like that (compile.sh does it):
+
+    gcc -Wall -g -O2 -pthread -o memory_replay memory_replay.c -ldl
+
+    Run it like that:
+
+    ./memory_replay [-1] [-n] trace.1234
+    LD_PRELOAD=`pwd`/memory.so ./memory_replay [-1] [-n] trace.1234
+
+    Every traced thread gets a thread of its own that performs its
+    calls in their original order. A call that gets a pointer from
+    another thread waits until that thread's call that returned it
+    has been replayed, so the replay only depends on the logical
+    order recorded in the trace, not on timing. With -1, all calls
+    are replayed in sequence order by a single thread instead, which
+    is fully deterministic. One byte of every page of every block is
+    written, so that the RSS is that of a program that uses its
+    memory.
+
+    The replay runs in a child process, and prints one line of JSON,
+    in the format of bench: the wall time, the peak RSS of the child
+    and its RSS before the replay started. Unless -n is given, the
+    replay is then repeated under ptrace to count the system calls it
+    makes, in total and for memory management.
+
+    The trace is processed before the replay with mmap'd memory only,
+    so that the allocator under test starts out (almost) clean.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+/* These definitions must match the ones in memory.c */
+#define MEMORY_TRACE_MAGIC "MEMTRACE"
+#define MEMORY_TRACE_VERSION 2u
+
+typedef enum memory_trace_op {
+  MEMORY_TRACE_MALLOC = 1,
+  MEMORY_TRACE_CALLOC,
+  MEMORY_TRACE_REALLOC,
+  MEMORY_TRACE_FREE,
+  MEMORY_TRACE_MALLOC_TRIM,
+  MEMORY_TRACE_MALLINFO2,
+  MEMORY_TRACE_MALLOC_STATS,
+  MEMORY_TRACE_MALLOC_INFO,
+  MEMORY_TRACE_POSIX_MEMALIGN,
+  MEMORY_TRACE_ALIGNED_ALLOC,
+  MEMORY_TRACE_MEMALIGN,
+  MEMORY_TRACE_VALLOC,
+  MEMORY_TRACE_PVALLOC,
+  MEMORY_TRACE_MALLOC_USABLE_SIZE,
+  MEMORY_TRACE_MALLOPT
+} memory_trace_op_t;
+
+typedef struct memory_trace_file_header {
+  char magic[8];
+  unsigned int version;
+  unsigned int record_size;
+} memory_trace_file_header_t;
+
+typedef struct memory_trace_record {
+  unsigned long long sequence;
+  unsigned long long timestamp;
+  unsigned long long arg0;
+  unsigned long long arg1;
+  unsigned long long result;
+  unsigned int thread_id;
+  unsigned int op;
+} memory_trace_record_t;
+
+#define REPLAY_MAX_THREADS 1024
+#define REPLAY_NONE ((size_t) -1)
+#define REPLAY_PAGE_SIZE ((size_t) 4096)
+
+/* One call to replay. It takes the block in slot input, if any, and
+   puts what it returns in slot output, if any. The call that put
+   the block in input is depends_on. */
+typedef struct replay_call {
+  unsigned int op;
+  unsigned int thread;
+  size_t nmemb;
+  size_t alignment;
+  size_t size;
+  size_t input;
+  size_t output;
+  size_t depends_on;
+  int done;
+} replay_call_t;
+
+typedef struct replay_thread {
+  pthread_t thread;
+  unsigned int thread_id;
+  size_t *calls;
+  size_t call_count;
+} replay_thread_t;
+
+/* Entry of the table that maps the addresses of the traced process
+   to the slot of the block that currently lives there */
+typedef struct address_entry {
+  unsigned long long address;
+  size_t slot;
+  size_t producer;
+} address_entry_t;
+
+/* What the replaying child reports back, through a shared mapping */
+typedef struct replay_result {
+  double seconds;
+  size_t replayed;
+  long baseline_rss_kb;
+} replay_result_t;
+
+static replay_call_t *calls;
+static size_t call_count = (size_t) 0;
+static void **slots;
+static size_t slot_count = (size_t) 0;
+static replay_thread_t threads[REPLAY_MAX_THREADS];
+static unsigned int thread_count = 0u;
+static pthread_barrier_t start_barrier;
+static int (*trim_function)(size_t);
+
+/* This function maps len bytes of zeroed memory, or exits. */
+static void *replay_map(size_t len) {
+  void *memory;
+
+  memory = mmap(NULL, (len > ((size_t) 0)) ? len : ((size_t) 1), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  return memory;
+}
+
+static double now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((double) ts.tv_sec) * 1e9 + ((double) ts.tv_nsec);
+}
+
+static long current_rss_kb() {
+  char buf[64];
+  long pages, rss;
+  ssize_t len;
+  int fd;
+
+  fd = open("/proc/self/statm", O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) {
+    return -1;
+  }
+  buf[len] = '\0';
+  if (sscanf(buf, "%ld %ld", &pages, &rss) != 2) {
+    return -1;
+  }
+  return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* This function returns the entry for address in table, which has
+   capacity entries, a power of two, creating it if needed. */
+static address_entry_t *lookup_address(address_entry_t *table, size_t capacity,
+				       unsigned long long address) {
+  size_t i = (size_t) ((address >> 4) * 11400714819323198485ull) & (capacity - ((size_t) 1));
+
+  while ((table[i].address != 0ull) && (table[i].address != address)) {
+    i = (i + ((size_t) 1)) & (capacity - ((size_t) 1));
+  }
+  if (table[i].address == 0ull) {
+    table[i].address = address;
+    table[i].slot = REPLAY_NONE;
+    table[i].producer = REPLAY_NONE;
+  }
+  return &table[i];
+}
+
+/* This function returns the index of the replay thread for the
+   traced thread thread_id, or exits if there are too many. */
+static unsigned int get_thread(unsigned int thread_id) {
+  unsigned int i;
+
+  for (i=0u; i<thread_count; i++) {
+    if (threads[i].thread_id == thread_id) {
+      return i;
+    }
+  }
+  if (thread_count == REPLAY_MAX_THREADS) {
+    fprintf(stderr, "more than %d threads in the trace\n", REPLAY_MAX_THREADS);
+    exit(1);
+  }
+  threads[thread_count].thread_id = thread_id;
+  return thread_count++;
+}
+
+/* This function points the entry for address, the block that call
+   i returns, to a new slot.
+   - Returns that slot */
+static size_t new_slot(address_entry_t *table, size_t capacity,
+		       unsigned long long address, size_t i) {
+  address_entry_t *entry = lookup_address(table, capacity, address);
+
+  entry->slot = slot_count++;
+  entry->producer = i;
+  return entry->slot;
+}
+
+/* This function reads the trace in path and turns it into calls,
+   in sequence order, with their slots and dependencies. */
+static void load_trace(const char *path) {
+  memory_trace_file_header_t *header;
+  memory_trace_record_t *records, *record;
+  replay_call_t *call;
+  address_entry_t *table, *entry;
+  size_t record_count, capacity, *order, i, j;
+  unsigned long long first, last;
+  struct stat st;
+  void *file;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if ((fd < 0) || (fstat(fd, &st) != 0)) {
+    perror(path);
+    exit(1);
+  }
+  if (((size_t) st.st_size) < sizeof(memory_trace_file_header_t)) {
+    fprintf(stderr, "%s: not a memory trace\n", path);
+    exit(1);
+  }
+  file = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED) {
+    perror(path);
+    exit(1);
+  }
+  header = (memory_trace_file_header_t *) file;
+  if ((memcmp(header->magic, MEMORY_TRACE_MAGIC, sizeof(header->magic)) != 0) ||
+      (header->version != MEMORY_TRACE_VERSION) ||
+      (header->record_size != sizeof(memory_trace_record_t))) {
+    fprintf(stderr, "%s: not a memory trace of version %u\n", path, MEMORY_TRACE_VERSION);
+    exit(1);
+  }
+  records = (memory_trace_record_t *) (header + 1);
+  record_count = (((size_t) st.st_size) - sizeof(memory_trace_file_header_t)) / sizeof(memory_trace_record_t);
+  if (record_count == ((size_t) 0)) {
+    return;
+  }
+
+  /* The sequence numbers of a process are dense, so the records are
+     put in order by placing each at its number. Holes, left by a
+     process that died before writing everything out, stay empty. */
+  first = records[0].sequence;
+  last = records[0].sequence;
+  for (i=(size_t) 1; i<record_count; i++) {
+    if (records[i].sequence < first) first = records[i].sequence;
+    if (records[i].sequence > last) last = records[i].sequence;
+  }
+  call_count = (size_t) (last - first) + ((size_t) 1);
+  calls = (replay_call_t *) replay_map(call_count * sizeof(replay_call_t));
+  order = (size_t *) replay_map(call_count * sizeof(size_t));
+  for (i=(size_t) 0; i<call_count; i++) {
+    order[i] = REPLAY_NONE;
+  }
+  for (i=(size_t) 0; i<record_count; i++) {
+    order[records[i].sequence - first] = i;
+  }
+
+  /* Follow every address through the calls, in sequence order */
+  for (capacity = (size_t) 16; capacity < ((size_t) 2) * record_count; capacity *= (size_t) 2);
+  table = (address_entry_t *) replay_map(capacity * sizeof(address_entry_t));
+  for (i=(size_t) 0; i<call_count; i++) {
+    call = &calls[i];
+    call->input = REPLAY_NONE;
+    call->output = REPLAY_NONE;
+    call->depends_on = REPLAY_NONE;
+    if (order[i] == REPLAY_NONE) {
+      continue;
+    }
+    record = &records[order[i]];
+    call->thread = get_thread(record->thread_id);
+    switch (record->op) {
+    case MEMORY_TRACE_MALLOC:
+      call->op = record->op;
+      call->size = (size_t) record->arg0;
+      if (record->result != 0ull) {
+	call->output = new_slot(table, capacity, record->result, i);
+      }
+      break;
+    case MEMORY_TRACE_CALLOC:
+      call->op = record->op;
+      call->nmemb = (size_t) record->arg0;
+      call->size = (size_t) record->arg1;
+      if (record->result != 0ull) {
+	call->output = new_slot(table, capacity, record->result, i);
+      }
+      break;
+    case MEMORY_TRACE_POSIX_MEMALIGN:
+    case MEMORY_TRACE_ALIGNED_ALLOC:
+    case MEMORY_TRACE_MEMALIGN:
+      call->op = record->op;
+      call->alignment = (size_t) record->arg0;
+      call->size = (size_t) record->arg1;
+      if (record->result != 0ull) {
+	call->output = new_slot(table, capacity, record->result, i);
+      }
+      break;
+    case MEMORY_TRACE_VALLOC:
+    case MEMORY_TRACE_PVALLOC:
+      call->op = record->op;
+      call->size = (size_t) record->arg0;
+      if (record->result != 0ull) {
+	call->output = new_slot(table, capacity, record->result, i);
+      }
+      break;
+    case MEMORY_TRACE_REALLOC:
+    case MEMORY_TRACE_FREE:
+      if ((record->op == MEMORY_TRACE_REALLOC) && (record->result == 0ull) &&
+	  (record->arg1 != 0ull)) {
+	/* A failed realloc leaves the block alone */
+	break;
+      }
+      call->op = record->op;
+      call->size = (size_t) record->arg1;
+      if (record->arg0 != 0ull) {
+	/* A block that was allocated before the trace started, or
+	   otherwise than through the traced calls, is not known;
+	   NULL stands in for it. */
+	entry = lookup_address(table, capacity, record->arg0);
+	call->input = entry->slot;
+	call->depends_on = entry->producer;
+	entry->slot = REPLAY_NONE;
+	entry->producer = REPLAY_NONE;
+      }
+      if ((record->op == MEMORY_TRACE_REALLOC) && (record->result != 0ull)) {
+	call->output = new_slot(table, capacity, record->result, i);
+      }
+      break;
+    case MEMORY_TRACE_MALLOC_TRIM:
+      call->op = record->op;
+      call->size = (size_t) record->arg0;
+      break;
+    case MEMORY_TRACE_MALLOPT:
+      /* The tunables change what the calls after it do */
+      call->op = record->op;
+      call->nmemb = (size_t) record->arg0;
+      call->size = (size_t) record->arg1;
+      break;
+    }
+  }
+  munmap(table, capacity * sizeof(address_entry_t));
+  munmap(order, call_count * sizeof(size_t));
+  munmap(file, (size_t) st.st_size);
+  slots = (void **) replay_map(slot_count * sizeof(void *));
+
+  /* Hand every thread the list of its calls */
+  for (i=(size_t) 0; i<call_count; i++) {
+    if (calls[i].op != 0u) threads[calls[i].thread].call_count++;
+  }
+  for (j=(size_t) 0; j<(size_t) thread_count; j++) {
+    threads[j].calls = (size_t *) replay_map(threads[j].call_count * sizeof(size_t));
+    threads[j].call_count = (size_t) 0;
+  }
+  for (i=(size_t) 0; i<call_count; i++) {
+    if (calls[i].op != 0u) {
+      threads[calls[i].thread].calls[threads[calls[i].thread].call_count++] = i;
+    }
+  }
+}
+
+/* This function writes one byte of every page of the size bytes
+   at ptr. */
+static void touch(void *ptr, size_t size) {
+  size_t offset;
+
+  if (ptr == NULL) return;
+  for (offset=(size_t) 0; offset<size; offset+=REPLAY_PAGE_SIZE) {
+    ((volatile char *) ptr)[offset] = (char) 1;
+  }
+}
+
+/* This function replays the call with index i. */
+static void replay_call(size_t i) {
+  replay_call_t *call = &calls[i];
+  void *input = NULL, *result = NULL;
+
+  if (call->depends_on != REPLAY_NONE) {
+    while (!__atomic_load_n(&calls[call->depends_on].done, __ATOMIC_ACQUIRE)) {
+      sched_yield();
+    }
+  }
+  if (call->input != REPLAY_NONE) {
+    input = slots[call->input];
+  }
+  switch (call->op) {
+  case MEMORY_TRACE_MALLOC:
+    result = malloc(call->size);
+    touch(result, call->size);
+    break;
+  case MEMORY_TRACE_CALLOC:
+    result = calloc(call->nmemb, call->size);
+    touch(result, call->nmemb * call->size);
+    break;
+  case MEMORY_TRACE_REALLOC:
+    result = realloc(input, call->size);
+    touch(result, call->size);
+    break;
+  case MEMORY_TRACE_FREE:
+    free(input);
+    break;
+  case MEMORY_TRACE_POSIX_MEMALIGN:
+    if (posix_memalign(&result, call->alignment, call->size) != 0) result = NULL;
+    touch(result, call->size);
+    break;
+  case MEMORY_TRACE_ALIGNED_ALLOC:
+    result = aligned_alloc(call->alignment, call->size);
+    touch(result, call->size);
+    break;
+  case MEMORY_TRACE_MEMALIGN:
+    result = memalign(call->alignment, call->size);
+    touch(result, call->size);
+    break;
+  case MEMORY_TRACE_VALLOC:
+    result = valloc(call->size);
+    touch(result, call->size);
+    break;
+  case MEMORY_TRACE_PVALLOC:
+    result = pvalloc(call->size);
+    touch(result, call->size);
+    break;
+  case MEMORY_TRACE_MALLOC_TRIM:
+    if (trim_function != NULL) trim_function(call->size);
+    break;
+  case MEMORY_TRACE_MALLOPT:
+    mallopt((int) call->nmemb, (int) call->size);
+    break;
+  }
+  if (call->output != REPLAY_NONE) {
+    slots[call->output] = result;
+  }
+  __atomic_store_n(&call->done, 1, __ATOMIC_RELEASE);
+}
+
+static void *replay_thread_main(void *arg) {
+  replay_thread_t *thread = (replay_thread_t *) arg;
+  size_t i;
+
+  pthread_barrier_wait(&start_barrier);
+  for (i=(size_t) 0; i<thread->call_count; i++) {
+    replay_call(thread->calls[i]);
+  }
+  return NULL;
+}
+
+/* This function replays all calls, in one thread per traced thread
+   or, with serial set, in this thread alone. The beginning and the
+   end of the replay proper are marked with a getppid system call,
+   for the syscall counter.
+   - Returns the number of calls replayed */
+static size_t replay(int serial, replay_result_t *result) {
+  size_t i, replayed = (size_t) 0;
+  double start;
+  unsigned int t;
+
+  result->baseline_rss_kb = current_rss_kb();
+  if (serial) {
+    syscall(SYS_getppid);
+    start = now_ns();
+    for (i=(size_t) 0; i<call_count; i++) {
+      if (calls[i].op != 0u) {
+	replay_call(i);
+	replayed++;
+      }
+    }
+    result->seconds = (now_ns() - start) / 1e9;
+    syscall(SYS_getppid);
+    return replayed;
+  }
+
+  pthread_barrier_init(&start_barrier, NULL, thread_count + 1u);
+  for (t=0u; t<thread_count; t++) {
+    if (pthread_create(&threads[t].thread, NULL, replay_thread_main, &threads[t]) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+    replayed += threads[t].call_count;
+  }
+  syscall(SYS_getppid);
+  start = now_ns();
+  pthread_barrier_wait(&start_barrier);
+  for (t=0u; t<thread_count; t++) {
+    pthread_join(threads[t].thread, NULL);
+  }
+  result->seconds = (now_ns() - start) / 1e9;
+  syscall(SYS_getppid);
+  return replayed;
+}
+
+/* System calls counted by the traced replay */
+typedef struct syscall_counts {
+  size_t total;
+  size_t mmap;
+  size_t munmap;
+  size_t mremap;
+  size_t madvise;
+  size_t brk;
+} syscall_counts_t;
+
+/* This function runs the replay in a child process traced with
+   ptrace and counts the system calls made between the markers.
+   - Returns 0 on success, -1 if ptrace is not available */
+static int count_syscalls(int serial, syscall_counts_t *counts) {
+  struct __ptrace_syscall_info info;
+  replay_result_t result;
+  int status, counting = 0, sig;
+  pid_t pid, tid;
+
+  memset(counts, 0, sizeof(*counts));
+  pid = fork();
+  if (pid < 0) {
+    return -1;
+  }
+  if (pid == 0) {
+    if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0) {
+      _exit(2);
+    }
+    raise(SIGSTOP);
+    replay(serial, &result);
+    _exit(0);
+  }
+  if ((waitpid(pid, &status, 0) != pid) || !WIFSTOPPED(status)) {
+    return -1;
+  }
+  ptrace(PTRACE_SETOPTIONS, pid, NULL,
+	 (void *) (long) (PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL));
+  ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+  while ((tid = waitpid(-1, &status, __WALL)) > 0) {
+    if (!WIFSTOPPED(status)) {
+      continue;
+    }
+    sig = WSTOPSIG(status);
+    if (sig == (SIGTRAP | 0x80)) {
+      if ((ptrace(PTRACE_GET_SYSCALL_INFO, tid, (void *) sizeof(info), &info) > 0) &&
+	  (info.op == PTRACE_SYSCALL_INFO_ENTRY)) {
+	if (info.entry.nr == SYS_getppid) {
+	  counting = !counting;
+	} else if (counting) {
+	  counts->total++;
+	  if (info.entry.nr == SYS_mmap) counts->mmap++;
+	  if (info.entry.nr == SYS_munmap) counts->munmap++;
+	  if (info.entry.nr == SYS_mremap) counts->mremap++;
+	  if (info.entry.nr == SYS_madvise) counts->madvise++;
+	  if (info.entry.nr == SYS_brk) counts->brk++;
+	}
+      }
+      sig = 0;
+    } else if ((sig == SIGTRAP) || (sig == SIGSTOP)) {
+      /* Clone events and the initial stop of new threads */
+      sig = 0;
+    }
+    ptrace(PTRACE_SYSCALL, tid, NULL, (void *) (long) sig);
+  }
+  return (errno == ECHILD) ? 0 : -1;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-1] [-n] trace-file\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  replay_result_t *result;
+  syscall_counts_t counts;
+  struct rusage child_usage;
+  size_t replayed;
+  int serial = 0, count = 1, opt, status, counted = -1;
+  pid_t pid;
+
+  while ((opt = getopt(argc, argv, "1n")) != -1) {
+    switch (opt) {
+    case '1':
+      serial = 1;
+      break;
+    case 'n':
+      count = 0;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+  }
+  *((void **) &trim_function) = dlsym(RTLD_DEFAULT, "malloc_trim");
+  load_trace(argv[optind]);
+
+  result = (replay_result_t *) mmap(NULL, sizeof(replay_result_t), PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (result == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return 1;
+  }
+  if (pid == 0) {
+    result->replayed = replay(serial, result);
+    _exit(0);
+  }
+  if ((wait4(pid, &status, 0, &child_usage) != pid) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+    fprintf(stderr, "the replay failed\n");
+    return 1;
+  }
+  replayed = result->replayed;
+
+  if (count) {
+    counted = count_syscalls(serial, &counts);
+  }
+  if (counted != 0) {
+    memset(&counts, 0xff, sizeof(counts));
+  }
+
+  printf("{\"bench\": \"replay\", \"allocator\": \"%s\", \"trace\": \"%s\", \"threads\": %u, "
+	 "\"ops\": %zu, \"seconds\": %.6f, \"ops_per_sec\": %.0f, "
+	 "\"syscalls\": %ld, \"mmap_calls\": %ld, \"munmap_calls\": %ld, \"mremap_calls\": %ld, "
+	 "\"madvise_calls\": %ld, \"brk_calls\": %ld, "
+	 "\"peak_rss_kb\": %ld, \"baseline_rss_kb\": %ld}\n",
+	 (dlsym(RTLD_DEFAULT, "__malloc_impl") != NULL) ? "memory.so" : "glibc",
+	 argv[optind], serial ? 1u : thread_count, replayed, result->seconds,
+	 (result->seconds > 0.0) ? ((double) replayed) / result->seconds : 0.0,
+	 (long) counts.total, (long) counts.mmap, (long) counts.munmap, (long) counts.mremap,
+	 (long) counts.madvise, (long) counts.brk,
+	 child_usage.ru_maxrss, result->baseline_rss_kb);
+  return 0;
+}
@@ -0,0 +1,269 @@
+/*  
+
+    Decoder for the binary traces written by memory.so when the
+    environment variable MEMORY_TRACE is set (see memory.c).
+
+    Compile it like that:
+
+    gcc -Wall -g -O0 -o memory_trace_decode memory_trace_decode.c
+
+    Run it like that:
+
+    ./memory_trace_decode trace.1234 [trace.1235 ...]
+
+    It prints one line per call, with its sequence number, the time
+    in seconds since the first call, the thread id, and the call with
+    its arguments and return value. The records of all threads are
+    put in sequence order. The traces of a process and its forked
+    children do not share an order, so when several files are given,
+    they are merged by timestamp instead. With -s, it only prints the
+    number of calls per operation.
+
+    This program is not run with memory.so preloaded; it uses the
+    system's malloc to hold the records.
+
+*/
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* These definitions must match the ones in memory.c */
+#define MEMORY_TRACE_MAGIC "MEMTRACE"
+#define MEMORY_TRACE_VERSION 2u
+
+typedef enum memory_trace_op {
+  MEMORY_TRACE_MALLOC = 1,
+  MEMORY_TRACE_CALLOC,
+  MEMORY_TRACE_REALLOC,
+  MEMORY_TRACE_FREE,
+  MEMORY_TRACE_MALLOC_TRIM,
+  MEMORY_TRACE_MALLINFO2,
+  MEMORY_TRACE_MALLOC_STATS,
+  MEMORY_TRACE_MALLOC_INFO,
+  MEMORY_TRACE_POSIX_MEMALIGN,
+  MEMORY_TRACE_ALIGNED_ALLOC,
+  MEMORY_TRACE_MEMALIGN,
+  MEMORY_TRACE_VALLOC,
+  MEMORY_TRACE_PVALLOC,
+  MEMORY_TRACE_MALLOC_USABLE_SIZE,
+  MEMORY_TRACE_MALLOPT,
+  MEMORY_TRACE_OP_COUNT
+} memory_trace_op_t;
+
+typedef struct memory_trace_file_header {
+  char magic[8];
+  unsigned int version;
+  unsigned int record_size;
+} memory_trace_file_header_t;
+
+typedef struct memory_trace_record {
+  unsigned long long sequence;
+  unsigned long long timestamp;
+  unsigned long long arg0;
+  unsigned long long arg1;
+  unsigned long long result;
+  unsigned int thread_id;
+  unsigned int op;
+} memory_trace_record_t;
+
+static const char *const op_names[MEMORY_TRACE_OP_COUNT] = {
+  "unknown",
+  "malloc",
+  "calloc",
+  "realloc",
+  "free",
+  "malloc_trim",
+  "mallinfo2",
+  "malloc_stats",
+  "malloc_info",
+  "posix_memalign",
+  "aligned_alloc",
+  "memalign",
+  "valloc",
+  "pvalloc",
+  "malloc_usable_size",
+  "mallopt"
+};
+
+/* A record along with its position in the input, so that sorting
+   keeps the order of records with equal timestamps. */
+typedef struct indexed_record {
+  memory_trace_record_t record;
+  size_t index;
+} indexed_record_t;
+
+static indexed_record_t *records = NULL;
+static size_t record_count = (size_t) 0;
+static size_t record_capacity = (size_t) 0;
+static int merge_by_timestamp = 0;
+
+/* This function appends all records of the trace file path to
+   records.
+   - Returns 0 on success
+   - Returns -1 if the file cannot be read or is not a trace */
+static int read_trace(const char *path) {
+  memory_trace_file_header_t header;
+  indexed_record_t *new_records;
+  FILE *fp;
+
+  fp = fopen(path, "rb");
+  if (fp == NULL) {
+    perror(path);
+    return -1;
+  }
+  if ((fread(&header, sizeof(header), 1, fp) != 1) ||
+      (memcmp(header.magic, MEMORY_TRACE_MAGIC, sizeof(header.magic)) != 0) ||
+      (header.version != MEMORY_TRACE_VERSION) ||
+      (header.record_size != sizeof(memory_trace_record_t))) {
+    fprintf(stderr, "%s: not a memory trace of version %u\n", path, MEMORY_TRACE_VERSION);
+    fclose(fp);
+    return -1;
+  }
+  for (;;) {
+    if (record_count == record_capacity) {
+      record_capacity = (record_capacity == ((size_t) 0)) ? ((size_t) 4096) : ((size_t) 2) * record_capacity;
+      new_records = realloc(records, record_capacity * sizeof(indexed_record_t));
+      if (new_records == NULL) {
+	fprintf(stderr, "%s: out of memory\n", path);
+	fclose(fp);
+	return -1;
+      }
+      records = new_records;
+    }
+    if (fread(&records[record_count].record, sizeof(memory_trace_record_t), 1, fp) != 1) {
+      break;
+    }
+    records[record_count].index = record_count;
+    record_count++;
+  }
+  fclose(fp);
+  return 0;
+}
+
+static int compare_records(const void *a, const void *b) {
+  const indexed_record_t *ra = (const indexed_record_t *) a;
+  const indexed_record_t *rb = (const indexed_record_t *) b;
+
+  if (!merge_by_timestamp && (ra->record.sequence != rb->record.sequence)) {
+    return (ra->record.sequence < rb->record.sequence) ? -1 : 1;
+  }
+  if (ra->record.timestamp != rb->record.timestamp) {
+    return (ra->record.timestamp < rb->record.timestamp) ? -1 : 1;
+  }
+  return (ra->index < rb->index) ? -1 : ((ra->index > rb->index) ? 1 : 0);
+}
+
+/* This function prints the call described by record, in the same
+   format as memory.so's MEMORY_DEBUG output. */
+static void print_call(const memory_trace_record_t *record) {
+  void *result = (void *) record->result;
+
+  switch (record->op) {
+  case MEMORY_TRACE_MALLOC:
+    printf("malloc(0x%llx) = %p\n", record->arg0, result);
+    break;
+  case MEMORY_TRACE_CALLOC:
+    printf("calloc(0x%llx, 0x%llx) = %p\n", record->arg0, record->arg1, result);
+    break;
+  case MEMORY_TRACE_REALLOC:
+    printf("realloc(%p, 0x%llx) = %p\n", (void *) record->arg0, record->arg1, result);
+    break;
+  case MEMORY_TRACE_FREE:
+    printf("free(%p)\n", (void *) record->arg0);
+    break;
+  case MEMORY_TRACE_MALLOC_TRIM:
+    printf("malloc_trim(0x%llx) = %d\n", record->arg0, (int) record->result);
+    break;
+  case MEMORY_TRACE_MALLINFO2:
+    printf("mallinfo2()\n");
+    break;
+  case MEMORY_TRACE_MALLOC_STATS:
+    printf("malloc_stats()\n");
+    break;
+  case MEMORY_TRACE_MALLOC_INFO:
+    printf("malloc_info(%d, %p) = %d\n", (int) record->arg0,
+	   (void *) record->arg1, (int) record->result);
+    break;
+  case MEMORY_TRACE_POSIX_MEMALIGN:
+    printf("posix_memalign(0x%llx, 0x%llx) = %p\n", record->arg0, record->arg1, result);
+    break;
+  case MEMORY_TRACE_ALIGNED_ALLOC:
+    printf("aligned_alloc(0x%llx, 0x%llx) = %p\n", record->arg0, record->arg1, result);
+    break;
+  case MEMORY_TRACE_MEMALIGN:
+    printf("memalign(0x%llx, 0x%llx) = %p\n", record->arg0, record->arg1, result);
+    break;
+  case MEMORY_TRACE_VALLOC:
+    printf("valloc(0x%llx) = %p\n", record->arg0, result);
+    break;
+  case MEMORY_TRACE_PVALLOC:
+    printf("pvalloc(0x%llx) = %p\n", record->arg0, result);
+    break;
+  case MEMORY_TRACE_MALLOC_USABLE_SIZE:
+    printf("malloc_usable_size(%p) = 0x%llx\n", (void *) record->arg0, record->result);
+    break;
+  case MEMORY_TRACE_MALLOPT:
+    printf("mallopt(%d, %d) = %d\n", (int) record->arg0, (int) record->arg1, (int) record->result);
+    break;
+  default:
+    printf("unknown operation %u\n", record->op);
+    break;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  size_t counts[MEMORY_TRACE_OP_COUNT];
+  unsigned long long start, elapsed;
+  int summary = 0;
+  int first = 1;
+  size_t i;
+
+  if ((argc > 1) && (!strcmp(argv[1], "-s"))) {
+    summary = 1;
+    first = 2;
+  }
+  if (argc <= first) {
+    fprintf(stderr, "usage: %s [-s] trace-file...\n", argv[0]);
+    return 1;
+  }
+  for (i=(size_t) first; i<(size_t) argc; i++) {
+    if (read_trace(argv[i]) != 0) {
+      return 1;
+    }
+  }
+  merge_by_timestamp = (argc - first > 1);
+  qsort(records, record_count, sizeof(indexed_record_t), compare_records);
+
+  if (summary) {
+    memset(counts, 0, sizeof(counts));
+    for (i=(size_t) 0; i<record_count; i++) {
+      counts[(records[i].record.op < MEMORY_TRACE_OP_COUNT) ? records[i].record.op : 0]++;
+    }
+    for (i=(size_t) 0; i<MEMORY_TRACE_OP_COUNT; i++) {
+      if (counts[i] > ((size_t) 0)) {
+	printf("%-18s %zu\n", op_names[i], counts[i]);
+      }
+    }
+    free(records);
+    return 0;
+  }
+
+  /* In sequence order, the first record need not be the earliest */
+  start = (record_count > ((size_t) 0)) ? records[0].record.timestamp : 0ull;
+  for (i=(size_t) 0; i<record_count; i++) {
+    if (records[i].record.timestamp < start) {
+      start = records[i].record.timestamp;
+    }
+  }
+  for (i=(size_t) 0; i<record_count; i++) {
+    elapsed = records[i].record.timestamp - start;
+    printf("%llu %llu.%09llu [%u] ", records[i].record.sequence,
+	   elapsed / 1000000000ull, elapsed % 1000000000ull,
+	   records[i].record.thread_id);
+    print_call(&records[i].record);
+  }
+  free(records);
+  return 0;
+}